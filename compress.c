@@ -0,0 +1,107 @@
+/* vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab smarttab colorcolumn=80: */
+/*
+ * Copyright (c) 2016 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "compress.h"
+
+#include <errno.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/* Metadata is written rarely and read at boot, so favor the ratio. */
+#define ZLIB_LEVEL Z_BEST_COMPRESSION
+#define ZSTD_LEVEL 19
+
+compress_alg_t
+compress_best(void)
+{
+#if defined(HAVE_ZSTD)
+    return COMPRESS_ZSTD;
+#elif defined(HAVE_ZLIB)
+    return COMPRESS_ZLIB;
+#else
+    return COMPRESS_NONE;
+#endif
+}
+
+ssize_t
+compress_data(compress_alg_t alg, const void *in, size_t inlen,
+              void *out, size_t outlen)
+{
+    switch (alg) {
+#ifdef HAVE_ZLIB
+    case COMPRESS_ZLIB: {
+        uLongf len = outlen;
+
+        switch (compress2(out, &len, in, inlen, ZLIB_LEVEL)) {
+        case Z_OK: return len;
+        case Z_BUF_ERROR: return 0;
+        case Z_MEM_ERROR: return -ENOMEM;
+        default: return -EINVAL;
+        }
+    }
+#endif
+
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD: {
+        size_t len = ZSTD_compress(out, outlen, in, inlen, ZSTD_LEVEL);
+
+        /* Mostly a too small output buffer; storing raw is always safe. */
+        return ZSTD_isError(len) ? 0 : (ssize_t) len;
+    }
+#endif
+
+    default:
+        return -ENOTSUP;
+    }
+}
+
+ssize_t
+decompress_data(compress_alg_t alg, const void *in, size_t inlen,
+                void *out, size_t outlen)
+{
+    switch (alg) {
+#ifdef HAVE_ZLIB
+    case COMPRESS_ZLIB: {
+        uLongf len = outlen;
+
+        switch (uncompress(out, &len, in, inlen)) {
+        case Z_OK: return len;
+        case Z_MEM_ERROR: return -ENOMEM;
+        default: return -EINVAL;
+        }
+    }
+#endif
+
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD: {
+        size_t len = ZSTD_decompress(out, outlen, in, inlen);
+
+        return ZSTD_isError(len) ? -EINVAL : (ssize_t) len;
+    }
+#endif
+
+    default:
+        return -ENOTSUP;
+    }
+}
@@ -0,0 +1,50 @@
+/* vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab smarttab colorcolumn=80: */
+/*
+ * Copyright (c) 2016 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <sys/types.h>
+#include <stddef.h>
+
+/* Compression algorithms, as stored in the slot flags. */
+typedef enum {
+    COMPRESS_NONE = 0,
+    COMPRESS_ZLIB = 1,
+    COMPRESS_ZSTD = 2,
+} compress_alg_t;
+
+/* Returns the preferred compiled-in algorithm or COMPRESS_NONE. */
+compress_alg_t
+compress_best(void);
+
+/*
+ * Compresses inlen bytes into out. Returns the compressed length, zero if
+ * the result does not fit in outlen bytes or a negative errno value.
+ */
+ssize_t
+compress_data(compress_alg_t alg, const void *in, size_t inlen,
+              void *out, size_t outlen);
+
+/*
+ * Decompresses inlen bytes into out. Returns the decompressed length or a
+ * negative errno value: -ENOTSUP if the algorithm is not compiled in and
+ * -EINVAL if the data is corrupted or does not fit in outlen bytes.
+ */
+ssize_t
+decompress_data(compress_alg_t alg, const void *in, size_t inlen,
+                void *out, size_t outlen);
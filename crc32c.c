@@ -19,6 +19,24 @@
 
 #include "crc32c.h"
 
+#include <endian.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#define CRC32C_X86
+#endif
+
+/* Block sizes used by the interleaved kernels. */
+#define LONG 8192
+#define SHORT 256
+
+/* Below this size, folding does not pay for its setup and reduction. */
+#define FOLD_MIN 1024
+
+#define POLY 0x82f63b78UL
+
 static const uint32_t table[] = {
     0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c,
     0x26a1e7e8, 0xd4ca64eb, 0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
@@ -65,8 +83,51 @@ static const uint32_t table[] = {
     0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351,
 };
 
+/* Tables for slicing-by-8; slices[n][b] is table[b] extended by n zero bytes. */
+static uint32_t slices[8][256];
+
+/* x2n[n] is x^(2^n) modulo POLY. */
+static uint32_t x2n[32];
+
+/* The values below are x^(8 * LONG) and x^(8 * SHORT) modulo POLY. */
+static const uint32_t LONG_SHIFT = 0x28461564;
+static const uint32_t SHORT_SHIFT = 0x88e56f72;
+
+/*
+ * Folding constants: a 128-bit block is carried forward over n bits by
+ * multiplying its low half by x^(n + 31) and its high half by x^(n - 33).
+ */
+static const uint64_t FOLD_512[] = { 0x740eef02, 0x9e4addf8 };
+static const uint64_t FOLD_384[] = { 0x1c291d04, 0xddc0152b };
+static const uint64_t FOLD_256[] = { 0x3da6d0cb, 0xba4fc28e };
+static const uint64_t FOLD_128[] = { 0xf20c0dfe, 0x493c7d27 };
+
+/*
+ * Multiplies a by b modulo POLY (reflected; x^0 is the high bit). Multiplying
+ * a CRC by x^(8n) modulo POLY is the same as extending it by n zero bytes.
+ */
+static uint32_t
+multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t m = 1UL << 31;
+    uint32_t p = 0;
+
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+    }
+
+    return p;
+}
+
 uint32_t
-crc32c(uint32_t crc, const void *buf, size_t len)
+crc32c_table(uint32_t crc, const void *buf, size_t len)
 {
     const uint8_t *tmp = buf;
 
@@ -80,3 +141,239 @@ crc32c(uint32_t crc, const void *buf, size_t len)
     return crc;
 }
 
+__attribute__((constructor))
+static void
+crc32c_init(void)
+{
+    for (size_t i = 0; i < 256; i++)
+        slices[0][i] = table[i];
+
+    for (size_t n = 1; n < 8; n++) {
+        for (size_t i = 0; i < 256; i++) {
+            uint32_t c = slices[n - 1][i];
+            slices[n][i] = table[c & 0xff] ^ (c >> 8);
+        }
+    }
+
+    x2n[0] = 1UL << 30; /* x^1 */
+    for (size_t n = 1; n < 32; n++)
+        x2n[n] = multmodp(x2n[n - 1], x2n[n - 1]);
+}
+
+uint32_t
+crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+    uint32_t p = 1UL << 31; /* x^0 */
+
+    /* Compute x^(8 * len2) one bit of len2 at a time. */
+    for (size_t n = 3; len2 > 0; len2 >>= 1, n = (n + 1) % 32) {
+        if (len2 & 1)
+            p = multmodp(x2n[n], p);
+    }
+
+    return multmodp(p, crc1) ^ crc2;
+}
+
+static inline uint32_t
+load32le(const uint8_t *buf)
+{
+    uint32_t v;
+    memcpy(&v, buf, sizeof(v));
+    return le32toh(v);
+}
+
+/*
+ * Processes eight bytes per iteration with eight independent table lookups
+ * instead of a chain of eight dependent ones.
+ */
+static uint32_t
+crc32c_slice8(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *next = buf;
+
+    crc ^= 0xffffffffUL;
+
+    for (; len > 0 && ((uintptr_t) next & 7) != 0; len--)
+        crc = slices[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+
+    for (; len >= 8; len -= 8, next += 8) {
+        uint32_t lo = load32le(next) ^ crc;
+        uint32_t hi = load32le(next + 4);
+
+        crc = slices[7][lo & 0xff] ^ slices[6][(lo >> 8) & 0xff] ^
+              slices[5][(lo >> 16) & 0xff] ^ slices[4][lo >> 24] ^
+              slices[3][hi & 0xff] ^ slices[2][(hi >> 8) & 0xff] ^
+              slices[1][(hi >> 16) & 0xff] ^ slices[0][hi >> 24];
+    }
+
+    for (; len > 0; len--)
+        crc = slices[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+
+    crc ^= 0xffffffffUL;
+
+    return crc;
+}
+
+#ifdef CRC32C_X86
+static inline uint64_t
+load64(const uint8_t *buf)
+{
+    uint64_t v;
+    memcpy(&v, buf, sizeof(v));
+    return v;
+}
+
+/*
+ * Consumes as many 3 * size blocks as possible from the buffer. Each block is
+ * split into three streams whose crc32 instructions do not depend upon each
+ * other, so they can execute in parallel. The streams are then merged by
+ * shifting the running CRC over the following stream and XORing it in.
+ */
+__attribute__((target("sse4.2")))
+static inline uint64_t
+sse42_streams(uint64_t crc0, const uint8_t **buf, size_t *len,
+              size_t size, uint32_t shift)
+{
+    const uint8_t *next = *buf;
+
+    while (*len >= size * 3) {
+        const uint8_t *end = next + size;
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+
+        do {
+            crc0 = _mm_crc32_u64(crc0, load64(next));
+            crc1 = _mm_crc32_u64(crc1, load64(next + size));
+            crc2 = _mm_crc32_u64(crc2, load64(next + size * 2));
+            next += 8;
+        } while (next < end);
+
+        crc0 = multmodp(shift, crc0) ^ crc1;
+        crc0 = multmodp(shift, crc0) ^ crc2;
+        next += size * 2;
+        *len -= size * 3;
+    }
+
+    *buf = next;
+    return crc0;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *next = buf;
+    uint64_t crc0 = crc ^ 0xffffffffUL;
+
+    for (; len > 0 && ((uintptr_t) next & 7) != 0; len--)
+        crc0 = _mm_crc32_u8(crc0, *next++);
+
+    crc0 = sse42_streams(crc0, &next, &len, LONG, LONG_SHIFT);
+    crc0 = sse42_streams(crc0, &next, &len, SHORT, SHORT_SHIFT);
+
+    for (; len >= 8; len -= 8, next += 8)
+        crc0 = _mm_crc32_u64(crc0, load64(next));
+
+    for (; len > 0; len--)
+        crc0 = _mm_crc32_u8(crc0, *next++);
+
+    return crc0 ^ 0xffffffffUL;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static inline __m128i
+fold(__m128i x, const uint64_t k[2])
+{
+    __m128i kk = _mm_set_epi64x(k[1], k[0]);
+
+    return _mm_xor_si128(_mm_clmulepi64_si128(x, kk, 0x00),
+                         _mm_clmulepi64_si128(x, kk, 0x11));
+}
+
+/*
+ * Folds 64 bytes per iteration into four 128-bit accumulators using
+ * carry-less multiplication. The accumulators are then folded into one and
+ * the remaining 16 bytes are reduced with the crc32 instruction.
+ */
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t
+crc32c_pclmul(uint32_t crc, const void *buf, size_t len)
+{
+    const __m128i *next = buf;
+    __m128i x0, x1, x2, x3;
+    uint64_t crc0;
+
+    if (len < FOLD_MIN)
+        return crc32c_sse42(crc, buf, len);
+
+    x0 = _mm_loadu_si128(next++);
+    x1 = _mm_loadu_si128(next++);
+    x2 = _mm_loadu_si128(next++);
+    x3 = _mm_loadu_si128(next++);
+    x0 = _mm_xor_si128(x0, _mm_cvtsi32_si128(crc ^ 0xffffffffUL));
+
+    for (len -= 64; len >= 64; len -= 64) {
+        x0 = _mm_xor_si128(fold(x0, FOLD_512), _mm_loadu_si128(next++));
+        x1 = _mm_xor_si128(fold(x1, FOLD_512), _mm_loadu_si128(next++));
+        x2 = _mm_xor_si128(fold(x2, FOLD_512), _mm_loadu_si128(next++));
+        x3 = _mm_xor_si128(fold(x3, FOLD_512), _mm_loadu_si128(next++));
+    }
+
+    x3 = _mm_xor_si128(x3, fold(x0, FOLD_384));
+    x3 = _mm_xor_si128(x3, fold(x1, FOLD_256));
+    x3 = _mm_xor_si128(x3, fold(x2, FOLD_128));
+
+    crc0 = _mm_crc32_u64(0, _mm_cvtsi128_si64(x3));
+    crc0 = _mm_crc32_u64(crc0, _mm_extract_epi64(x3, 1));
+    return crc32c_sse42(crc0 ^ 0xffffffffUL, next, len);
+}
+
+static bool
+have_sse42(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+
+static bool
+have_pclmul(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2") &&
+           __builtin_cpu_supports("pclmul");
+}
+#endif
+
+const crc32c_kernel_t crc32c_kernels[] = {
+#ifdef CRC32C_X86
+    { "pclmul", crc32c_pclmul, have_pclmul },
+    { "sse42", crc32c_sse42, have_sse42 },
+#endif
+    { "slice8", crc32c_slice8 },
+    { "table", crc32c_table },
+    {}
+};
+
+#ifdef CRC32C_X86
+/* Picks the first supported kernel when the library is loaded. */
+static crc32c_func_t *
+crc32c_resolve(void)
+{
+    for (size_t i = 0; crc32c_kernels[i].name; i++) {
+        if (!crc32c_kernels[i].supported || crc32c_kernels[i].supported())
+            return crc32c_kernels[i].func;
+    }
+
+    return crc32c_slice8;
+}
+
+uint32_t
+crc32c(uint32_t crc, const void *buf, size_t len)
+    __attribute__((ifunc("crc32c_resolve")));
+#else
+uint32_t
+crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    return crc32c_slice8(crc, buf, len);
+}
+#endif
@@ -19,8 +19,32 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 
+typedef uint32_t crc32c_func_t(uint32_t crc, const void *buf, size_t len);
+
+typedef struct {
+    const char *name;
+    crc32c_func_t *func;
+    bool (*supported)(void); /* NULL if always available */
+} crc32c_kernel_t;
+
+/* All compiled-in kernels, fastest first, terminated by an empty entry. */
+extern const crc32c_kernel_t crc32c_kernels[];
+
+/* Computes the CRC using the fastest kernel supported by this CPU. */
 uint32_t
 crc32c(uint32_t crc, const void *buf, size_t len);
+
+/*
+ * Returns the CRC of A followed by B, given crc1 of A and crc2 of B. This
+ * allows checksumming chunks independently and merging the results.
+ */
+uint32_t
+crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+
+/* The portable, byte-at-a-time reference implementation. */
+uint32_t
+crc32c_table(uint32_t crc, const void *buf, size_t len);
@@ -17,21 +17,50 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
+#include "compress.h"
 #include "crc32c.h"
+#include "luks2.h"
 #include "luksmeta.h"
+#include "uring.h"
 
+#include <linux/fs.h>
+#include <stddef.h>
 #include <sys/types.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #define ALIGN(s, up) (((s) + (up ? 4095 : 0)) & ~4095ULL)
 #define LUKS_NSLOTS 8
-#define LM_VERSION 1
+#define READ_CHUNK 16384
+#define READ_MAX_GAP 65536 /* Largest gap read and discarded to merge reads */
+#define ZERO_IOVS 256      /* Pages of zeroes per write (1 MiB) */
+#define ROUNDUP(s, g) (((s) + (g) - 1) / (g) * (g))
+#define LM_V2_GRAIN 64     /* Slot data alignment in the packed layout */
+#define LM_V2_START 512    /* Keeps the header in a sector of its own */
+#define LM_V3_COPY 512     /* Offset of the second header copy */
+#define LM_V3_START 1024   /* Keeps both header copies in their own sectors */
+#define LM_FLAG_COMPRESS 0xff /* Compression algorithm (compress_alg_t) */
+#define LM_MAX_ENTRIES 112 /* Keeps the entry table within 4 KiB */
+#define LM_MAX_EXTENTS (LUKS_NSLOTS + 1 + LM_MAX_ENTRIES)
+#define BATCH_DEVICES 32   /* Devices whose reads are in flight together */
+#define BATCH_HEADER 0xff  /* Operation of the header read of a device */
+#define CACHE_ENTRIES 64   /* Devices kept by the header cache */
+#define LUKS1_MAGIC "LUKS\xba\xbe"
+#define LUKS1_KEY_ENABLED 0x00AC71F3
+
+static const uint8_t ZERO[ALIGN(1, true)];
 
 static const uint8_t LM_MAGIC[] = { 'L', 'U', 'K', 'S', 'M', 'E', 'T', 'A' };
 
@@ -40,7 +69,7 @@ typedef struct __attribute__((packed)) {
     uint32_t offset;   /* Bytes from the start of the hole */
     uint32_t length;   /* Bytes */
     uint32_t crc32c;
-    uint32_t _reserved; /* Reserved */
+    uint32_t flags;    /* LM_FLAG_* */
 } lm_slot_t;
 
 typedef struct __attribute__((packed)) {
@@ -48,8 +77,59 @@ typedef struct __attribute__((packed)) {
     uint32_t version;
     uint32_t crc32c;
     lm_slot_t slots[LUKS_NSLOTS];
+    uint64_t generation; /* Version 3 only; the newest valid copy wins */
+    lm_slot_t table;     /* Version 4 only; the extent of the entry table */
 } lm_t;
 
+/* The parts of the LUKSv1 header needed to locate the hole (big-endian). */
+typedef struct __attribute__((packed)) {
+    uint32_t active;
+    uint32_t iterations;
+    uint8_t salt[32];
+    uint32_t key_material_offset; /* In sectors */
+    uint32_t stripes;
+} luks1_keyslot_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t magic[6];
+    uint16_t version;
+    char cipher_name[32];
+    char cipher_mode[32];
+    char hash_spec[32];
+    uint32_t payload_offset;      /* In sectors */
+    uint32_t key_bytes;
+    uint8_t mk_digest[20];
+    uint8_t mk_digest_salt[32];
+    uint32_t mk_digest_iterations;
+    char uuid[40];
+    luks1_keyslot_t keyslots[LUKS_NSLOTS];
+} luks1_phdr_t;
+
+typedef struct __attribute__((packed)) {
+    lm_slot_t slot;      /* The data of the entry */
+    uint32_t keyslot;    /* The LUKS keyslot the entry belongs to */
+} lm_entry_t;
+
+struct luksmeta {
+    struct crypt_device *cd; /* NULL for header images */
+    uint8_t active;     /* Header images only: active keyslots (bitmask) */
+    uint32_t length;    /* Bytes in the hole */
+    off_t hole;         /* Absolute offset of the hole */
+    lm_t lm;            /* Parsed header (host byte order) */
+    bool dirty;         /* A header write has not been flushed yet */
+    int fd;
+
+    /* Parsed entry table (host byte order), sorted by keyslot and UUID */
+    lm_entry_t entries[LM_MAX_ENTRIES];
+    size_t nentries;
+
+    /* LUKSv2 devices keep the slots in a token rather than in the hole */
+    bool luks2;
+    bool rdonly;
+    int token;
+    luks2_slot_t data[LUKS_NSLOTS];
+};
+
 static bool
 uuid_is_zero(const luksmeta_uuid_t uuid)
 {
@@ -61,58 +141,175 @@ uuid_is_zero(const luksmeta_uuid_t uuid)
     return true;
 }
 
+/**
+ * Returns the number of bytes in the on-disk header.
+ *
+ * The generation counter was added in version 3 and the entry table in
+ * version 4; older headers end before them.
+ */
+static inline size_t
+header_size(uint32_t version)
+{
+    if (version >= LUKSMETA_VERSION_4)
+        return sizeof(lm_t);
+
+    if (version >= LUKSMETA_VERSION_3)
+        return offsetof(lm_t, table);
+
+    return offsetof(lm_t, generation);
+}
+
 static inline uint32_t
-checksum(lm_t lm)
+checksum(lm_t lm, uint32_t version)
 {
     lm.crc32c = 0;
-    return crc32c(0, &lm, sizeof(lm_t));
+    return crc32c(0, &lm, header_size(version));
 }
 
-static inline bool
-overlap(const lm_t *lm, uint32_t start, size_t end, uint32_t hard_limit)
+static int
+cmp_offset(const void *a, const void *b)
 {
-    /* Make sure the data fits the available area in the gap. */
-    if (end > hard_limit)
-        return true;
+    const lm_slot_t *x = *(const lm_slot_t **) a;
+    const lm_slot_t *y = *(const lm_slot_t **) b;
 
-    for (int i = 0; i < LUKS_NSLOTS; i++) {
-        const lm_slot_t *s = &lm->slots[i];
-        uint32_t e = s->offset + s->length;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
 
-        if (start <= s->offset && s->offset < end)
-            return true;
+static int
+cmp_entry(const lm_entry_t *x, uint32_t keyslot, const luksmeta_uuid_t uuid)
+{
+    if (x->keyslot != keyslot)
+        return x->keyslot < keyslot ? -1 : 1;
 
-        if (start < e && e <= end)
-            return true;
-    }
+    return memcmp(x->slot.uuid, uuid, sizeof(luksmeta_uuid_t));
+}
 
-    return false;
+/**
+ * Returns the granularity at which slot data is placed.
+ *
+ * Version 1 places every slot on its own pages. Version 2 packs the slots
+ * so that small payloads share pages with each other and with the header.
+ */
+static inline uint32_t
+grain(const lm_t *lm)
+{
+    return lm->version >= LUKSMETA_VERSION_2 ? LM_V2_GRAIN : ALIGN(1, true);
 }
 
+/**
+ * Returns the offset of the first byte available for slot data.
+ */
 static inline uint32_t
-find_gap(const lm_t *lm, uint32_t length, size_t size)
+first_offset(const lm_t *lm)
+{
+    if (lm->version >= LUKSMETA_VERSION_3)
+        return LM_V3_START;
+
+    if (lm->version == LUKSMETA_VERSION_2)
+        return LM_V2_START;
+
+    return ALIGN(sizeof(lm_t), true);
+}
+
+/**
+ * Collects the occupied extents, sorted by offset.
+ *
+ * These are the used slots, the entry table and the entries.
+ */
+static size_t
+find_used(const lm_t *lm, const lm_entry_t *entries, size_t nentries,
+          const lm_slot_t *used[LM_MAX_EXTENTS])
 {
-    size = ALIGN(size, true);
+    size_t n = 0;
+
+    for (int i = 0; i < LUKS_NSLOTS; i++) {
+        if (!uuid_is_zero(lm->slots[i].uuid))
+            used[n++] = &lm->slots[i];
+    }
 
-    /* Make sure the data is not larger than the total available
-     * area in the gap. */
-    if (length < size)
+    if (lm->table.length > 0)
+        used[n++] = &lm->table;
+
+    for (size_t i = 0; i < nentries; i++)
+        used[n++] = &entries[i].slot;
+
+    qsort(used, n, sizeof(*used), cmp_offset);
+    return n;
+}
+
+/**
+ * Finds space for size bytes of slot data in the hole.
+ *
+ * The occupied extents are sorted by offset once and the free extents
+ * between them are visited in order. Depending on the policy, the first free
+ * extent that fits, the smallest one that fits or the largest one is used.
+ *
+ * Returns the offset of the new slot or zero if there is not enough space.
+ */
+static uint32_t
+find_gap(const lm_t *lm, const lm_entry_t *entries, size_t nentries,
+         uint32_t length, size_t size, int policy)
+{
+    const lm_slot_t *used[LM_MAX_EXTENTS] = {};
+    uint64_t pos = first_offset(lm);
+    uint64_t bestlen = 0;
+    uint32_t best = 0;
+    size_t n = 0;
+
+    size = ROUNDUP(size, grain(lm));
+    if (size > length)
         return 0;
 
-    for (uint32_t off = ALIGN(1, true); off < length; off += ALIGN(1, true)) {
-        if (!overlap(lm, off, off + size, lm->slots[0].offset + length))
-            return off;
+    n = find_used(lm, entries, nentries, used);
+
+    for (size_t i = 0; i <= n; i++) {
+        uint64_t end = i < n ? used[i]->offset : length;
+
+        if (end > length)
+            end = length;
+
+        if (end >= pos && end - pos >= size) {
+            switch (policy) {
+            case LUKSMETA_SAVE_FIRST_FIT:
+                return pos;
+
+            case LUKSMETA_SAVE_BEST_FIT:
+                if (best == 0 || end - pos < bestlen)
+                    best = pos, bestlen = end - pos;
+                break;
+
+            case LUKSMETA_SAVE_WORST_FIT:
+                if (best == 0 || end - pos > bestlen)
+                    best = pos, bestlen = end - pos;
+                break;
+            }
+        }
+
+        if (i < n) {
+            uint64_t next = ROUNDUP((uint64_t) used[i]->offset +
+                                    used[i]->length, grain(lm));
+            if (next > pos)
+                pos = next;
+        }
     }
 
-    return 0;
+    return best;
+}
+
+static bool
+keyslot_inactive(const luksmeta_t *lm, int slot)
+{
+    if (!lm->cd)
+        return !(lm->active & (1 << slot));
+
+    return crypt_keyslot_status(lm->cd, slot) == CRYPT_SLOT_INACTIVE;
 }
 
 static int
-find_unused_slot(struct crypt_device *cd, const lm_t *lm)
+find_unused_slot(const luksmeta_t *lm, const lm_t *tmp)
 {
     for (int slot = 0; slot < LUKS_NSLOTS; slot++) {
-        if (crypt_keyslot_status(cd, slot) == CRYPT_SLOT_INACTIVE &&
-            uuid_is_zero(lm->slots[slot].uuid))
+        if (keyslot_inactive(lm, slot) && uuid_is_zero(tmp->slots[slot].uuid))
             return slot;
     }
 
@@ -120,30 +317,58 @@ find_unused_slot(struct crypt_device *cd, const lm_t *lm)
 }
 
 static inline ssize_t
-readall(int fd, void *data, size_t size)
+readall(int fd, void *data, size_t size, off_t off)
 {
     uint8_t *tmp = data;
 
     for (ssize_t r, t = 0; t < (ssize_t) size; t += r) {
-        r = read(fd, &tmp[t], size - t);
-        if (r < 0 && errno != EAGAIN)
-            return -errno;
-        if (r == 0)
+        r = pread(fd, &tmp[t], size - t, off + t);
+        if (r < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                return -errno;
+            r = 0;
+        } else if (r == 0) {
             return -ENOENT;
+        }
+    }
+
+    return size;
+}
+
+/**
+ * Reads size bytes, updating the CRC as each chunk arrives.
+ *
+ * Checksumming each chunk while it is still in cache avoids a second pass
+ * over the whole buffer once the read is complete.
+ */
+static inline ssize_t
+readall_crc32c(int fd, void *data, size_t size, off_t off, uint32_t *crc)
+{
+    uint8_t *tmp = data;
+
+    for (size_t t = 0, n; t < size; t += n) {
+        ssize_t r;
+
+        n = size - t < READ_CHUNK ? size - t : READ_CHUNK;
+        r = readall(fd, &tmp[t], n, off + t);
+        if (r < 0)
+            return r;
+
+        *crc = crc32c(*crc, &tmp[t], n);
     }
 
     return size;
 }
 
 static inline ssize_t
-writeall(int fd, const void *buf, size_t size)
+writeall(int fd, const void *buf, size_t size, off_t off)
 {
     const uint8_t *tmp = buf;
 
     for (ssize_t r, t = 0; t < (ssize_t) size; t += r) {
-        r = write(fd, &tmp[t], size - t);
+        r = pwrite(fd, &tmp[t], size - t, off + t);
         if (r < 0) {
-            if (errno != EAGAIN)
+            if (errno != EAGAIN && errno != EINTR)
                 return -errno;
             r = 0;
         }
@@ -153,248 +378,2721 @@ writeall(int fd, const void *buf, size_t size)
 }
 
 /**
- * Opens the device with the specified flags.
- *
- * The length parameter is set to the amount of space in the gap between the
- * end of the last slot and the start of the encrypted data.
+ * Waits until all previous writes have reached stable storage.
  *
- * The function returns either the file descriptor positioned to the start of
- * the hole or a negative errno.
+ * This is used as a barrier between dependent writes: slot data must be
+ * durable before a header referencing it is written.
  */
-static int
-open_hole(struct crypt_device *cd, int flags, uint32_t *length)
+static inline int
+flush(int fd)
 {
-    const char *name = NULL;
-    const char *type = NULL;
-    uint64_t hole = 0;
-    uint64_t data = 0;
-    int fd = 0;
-    int r = 0;
+    return fdatasync(fd) == 0 ? 0 : -errno;
+}
 
-    type = crypt_get_type(cd);
-    if (!type || strcmp(CRYPT_LUKS1, type) != 0)
-        return -ENOTSUP;
+static ssize_t
+preadvall(int fd, struct iovec *iov, int iovcnt, off_t off)
+{
+    ssize_t total = 0;
 
-    data = crypt_get_data_offset(cd) * 512;
-    if (data < 4096)
-        return -ENOSPC;
+    while (iovcnt > 0) {
+        ssize_t r;
 
-    for (int slot = 0; slot < LUKS_NSLOTS; slot++) {
-        uint64_t off = 0;
-        uint64_t len = 0;
+        r = preadv(fd, iov, iovcnt, off + total);
+        if (r < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                return -errno;
+            continue;
+        } else if (r == 0) {
+            return -ENOENT;
+        }
 
-        r = crypt_keyslot_area(cd, slot, &off, &len);
-        if (r < 0)
-            return r;
+        total += r;
 
-        if (hole < off + len)
-            hole = ALIGN(off + len, true);
+        /* Skip the fully read vectors and advance into the partial one. */
+        for (; iovcnt > 0 && (size_t) r >= iov->iov_len; iov++, iovcnt--)
+            r -= iov->iov_len;
+
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + r;
+            iov->iov_len -= r;
+        }
     }
 
-    if (hole == 0)
-        return -ENOTSUP;
+    return total;
+}
 
-    if (hole >= data)
-        return -ENOSPC;
+/**
+ * Writes zeroes to the range using a shared page of zeroes.
+ *
+ * Each write covers up to ZERO_IOVS pages, so no memory is allocated.
+ */
+static int
+zero_write(int fd, off_t off, size_t len)
+{
+    const size_t max = sizeof(ZERO) * ZERO_IOVS;
+    struct iovec iov[ZERO_IOVS];
 
-    name = crypt_get_device_name(cd);
-    if (!name)
-        return -ENOTSUP;
+    for (size_t i = 0; i < ZERO_IOVS; i++)
+        iov[i] = (struct iovec) { (void *) ZERO, sizeof(ZERO) };
 
-    fd = open(name, flags);
-    if (fd < 0)
-        return -errno;
+    while (len > 0) {
+        size_t n = len < max ? len : max;
+        int cnt = (n + sizeof(ZERO) - 1) / sizeof(ZERO);
+        ssize_t r;
 
-    if (lseek(fd, hole, SEEK_SET) == -1) {
-        close(fd);
-        return -errno;
+        iov[cnt - 1].iov_len = n - (cnt - 1) * sizeof(ZERO);
+        r = pwritev(fd, iov, cnt, off);
+        iov[cnt - 1].iov_len = sizeof(ZERO);
+        if (r < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                return -errno;
+            continue;
+        }
+
+        off += r;
+        len -= r;
     }
 
-    *length = ALIGN(data - hole, false);
-    return fd;
+    return 0;
 }
 
+/**
+ * Zeroes the range using the cheapest method supported by the device.
+ *
+ * Block devices are zeroed with BLKZEROOUT and regular files with
+ * fallocate(). If neither works, zeroes are written. The data is flushed
+ * before returning. The method used is stored in strategy.
+ */
 static int
-read_header(struct crypt_device *cd, int flags, uint32_t *length, lm_t *lm)
+zero_range(int fd, off_t off, size_t len, luksmeta_zero_t *strategy)
 {
-    uint32_t maxlen;
-    int fd = -1;
+    struct stat st = {};
     int r = 0;
 
-    fd = open_hole(cd, flags, length);
-    if (fd < 0)
-        return fd;
-
-    r = *length >= sizeof(lm_t) ? 0 : -ENOENT;
-    if (r < 0)
-        goto error;
-
-    r = readall(fd, lm, sizeof(lm_t));
-    if (r < 0)
-        goto error;
+    if (fstat(fd, &st) != 0)
+        return -errno;
 
-    r = memcmp(LM_MAGIC, lm->magic, sizeof(LM_MAGIC)) == 0 ? 0 : -ENOENT;
-    if (r < 0)
-        goto error;
+    if (S_ISBLK(st.st_mode) && off % 512 == 0 && len % 512 == 0) {
+        uint64_t range[] = { off, len };
 
-    r = lm->version == htobe32(LM_VERSION) ? 0 : -ENOTSUP;
-    if (r < 0)
-        goto error;
+        if (ioctl(fd, BLKZEROOUT, range) == 0) {
+            *strategy = LUKSMETA_ZERO_BLKZEROOUT;
+            return flush(fd);
+        }
+    } else if (S_ISREG(st.st_mode)) {
+        if (fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+                      off, len) == 0 ||
+            fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      off, len) == 0) {
+            *strategy = LUKSMETA_ZERO_FALLOCATE;
+            return flush(fd);
+        }
+    }
 
-    lm->crc32c = be32toh(lm->crc32c);
-    r = checksum(*lm) == lm->crc32c ? 0 : -EINVAL;
+    r = zero_write(fd, off, len);
     if (r < 0)
-        goto error;
+        return r;
 
-    lm->version = be32toh(lm->version);
+    *strategy = LUKSMETA_ZERO_WRITE;
+    return flush(fd);
+}
 
-    maxlen = *length - ALIGN(sizeof(lm_t), true);
-    for (int slot = 0; slot < LUKS_NSLOTS; slot++) {
-        lm_slot_t *s = &lm->slots[slot];
+/**
+ * Identifies a file: block devices by their device number, since several
+ * nodes may refer to one, and other files by their inode.
+ */
+static void
+file_id(const struct stat *st, dev_t *dev, ino_t *ino)
+{
+    if (S_ISBLK(st->st_mode)) {
+        *dev = st->st_rdev;
+        *ino = 0;
+    } else {
+        *dev = st->st_dev;
+        *ino = st->st_ino;
+    }
+}
 
-        s->offset = be32toh(s->offset);
-        s->length = be32toh(s->length);
-        s->crc32c = be32toh(s->crc32c);
+/* A lock held by a descriptor of this process (see lock()) */
+typedef struct held {
+    struct held *next;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    pid_t pid;          /* Entries inherited across fork() are ignored */
+    pthread_t thread;
+    bool exclusive;
+} held_t;
 
-        if (!uuid_is_zero(s->uuid)) {
-            r = s->offset > sizeof(lm_t) ? 0 : -EINVAL;
-            if (r < 0)
-                goto error;
+static pthread_mutex_t held_mutex = PTHREAD_MUTEX_INITIALIZER;
+static held_t *held_list;
 
-            r = s->length <= maxlen ? 0 : -EINVAL;
-            if (r < 0)
-                goto error;
-        }
+/**
+ * Checks whether the calling thread holds a lock on the file which
+ * conflicts with the one requested.
+ */
+static bool
+held_here(dev_t dev, ino_t ino, bool exclusive)
+{
+    pid_t pid = getpid();
+    bool found = false;
+
+    pthread_mutex_lock(&held_mutex);
+    for (const held_t *h = held_list; h && !found; h = h->next) {
+        found = h->dev == dev && h->ino == ino && h->pid == pid &&
+                pthread_equal(h->thread, pthread_self()) &&
+                (h->exclusive || exclusive);
     }
+    pthread_mutex_unlock(&held_mutex);
 
-    return fd;
-
-error:
-    close(fd);
-    return r;
+    return found;
 }
 
+/**
+ * Locks the device against other luksmeta handles, waiting if necessary.
+ *
+ * Readers (O_RDONLY) share the lock, while a writer holds it exclusively
+ * from the time it reads the header until it is done with its changes, so
+ * that two writers never plan their changes on the same header. The lock
+ * belongs to the open file description and is released when it is closed
+ * with unlock().
+ *
+ * If the lock is taken and the calling thread itself holds the conflicting
+ * lock through another handle, waiting would never end, so -EDEADLK is
+ * returned instead. With O_NONBLOCK, -EAGAIN is returned rather than
+ * waiting for anyone else.
+ */
 static int
-write_header(int fd, lm_t lm)
+lock(int fd, int flags)
 {
-    for (int slot = 0; slot < LUKS_NSLOTS; slot++) {
-        lm.slots[slot].offset = htobe32(lm.slots[slot].offset);
-        lm.slots[slot].length = htobe32(lm.slots[slot].length);
-        lm.slots[slot].crc32c = htobe32(lm.slots[slot].crc32c);
-    }
+    bool exclusive = (flags & O_ACCMODE) != O_RDONLY;
+    int op = exclusive ? LOCK_EX : LOCK_SH;
+    struct stat st = {};
+    held_t *h = NULL;
+    dev_t dev = 0;
+    ino_t ino = 0;
+    int r = 0;
 
-    memcpy(lm.magic, LM_MAGIC, sizeof(LM_MAGIC));
-    lm.version = htobe32(LM_VERSION);
-    lm.crc32c = htobe32(checksum(lm));
-    return writeall(fd, &lm, sizeof(lm));
-}
+    if (fstat(fd, &st) < 0)
+        return -errno;
+    file_id(&st, &dev, &ino);
 
-int
-luksmeta_test(struct crypt_device *cd)
-{
-    int fd = -1;
+    while ((r = flock(fd, op | LOCK_NB)) < 0 && errno == EINTR)
+        continue;
 
-    fd = read_header(cd, O_RDONLY, &(uint32_t) {0}, &(lm_t) {});
-    if (fd >= 0) {
-        close(fd);
-        return 0;
+    if (r < 0 && errno == EWOULDBLOCK) {
+        if (held_here(dev, ino, exclusive))
+            return -EDEADLK;
+
+        if (flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        while ((r = flock(fd, op)) < 0 && errno == EINTR)
+            continue;
     }
 
-    return fd;
+    if (r < 0)
+        return -errno;
+
+    /* Without an entry, only the deadlock detection is lost. */
+    h = malloc(sizeof(*h));
+    if (!h)
+        return 0;
+
+    *h = (held_t) {
+        .fd = fd, .dev = dev, .ino = ino, .pid = getpid(),
+        .thread = pthread_self(), .exclusive = exclusive,
+    };
+
+    pthread_mutex_lock(&held_mutex);
+    h->next = held_list;
+    held_list = h;
+    pthread_mutex_unlock(&held_mutex);
+    return 0;
 }
 
-int
-luksmeta_nuke(struct crypt_device *cd)
+/**
+ * Closes a descriptor, releasing the lock taken by lock() if any.
+ */
+static void
+unlock(int fd)
 {
-    uint8_t zero[ALIGN(1, true)] = {};
-    uint32_t length = 0;
-    int fd = -1;
-    int r = 0;
+    pid_t pid = getpid();
 
-    fd = open_hole(cd, O_RDWR | O_SYNC, &length);
-    if (fd < 0)
-        return fd;
+    pthread_mutex_lock(&held_mutex);
+    for (held_t **h = &held_list; *h; h = &(*h)->next) {
+        held_t *tmp = *h;
+
+        if (tmp->fd != fd || tmp->pid != pid)
+            continue;
 
-    for (size_t i = 0; r >= 0 && i < length; i += sizeof(zero))
-        r = writeall(fd, zero, sizeof(zero));
+        *h = tmp->next;
+        free(tmp);
+        break;
+    }
+    pthread_mutex_unlock(&held_mutex);
 
     close(fd);
-    return r < 0 ? r : 0;
 }
 
-int
-luksmeta_init(struct crypt_device *cd)
+/**
+ * Computes the hole between the end of the keyslots and the encrypted data.
+ */
+static int
+find_hole(uint64_t end, uint64_t data, off_t *hole, uint32_t *length)
 {
-    uint32_t length = 0;
-    int fd = -1;
-    int r = 0;
+    uint64_t start = ALIGN(end, true);
 
-    r = luksmeta_test(cd);
-    if (r == 0)
-        return -EALREADY;
-    else if (r != -ENOENT && r != -EINVAL)
-        return r;
+    if (data < 4096)
+        return -ENOSPC;
 
-    fd = open_hole(cd, O_RDWR | O_SYNC, &length);
-    if (fd < 0)
-        return fd;
+    if (start == 0)
+        return -ENOTSUP;
 
-    if (length < ALIGN(sizeof(lm_t), true)) {
-        close(fd);
+    if (start >= data)
         return -ENOSPC;
-    }
 
-    r = write_header(fd, (lm_t) {});
-    close(fd);
-    return r > 0 ? 0 : r;
+    *hole = start;
+    *length = ALIGN(data - start, false);
+    return 0;
 }
 
-int
-luksmeta_load(struct crypt_device *cd, int slot,
-              luksmeta_uuid_t uuid, void *buf, size_t size)
+/**
+ * Locates the hole of a LUKSv1 device from the geometry of its keyslots.
+ */
+static int
+query_hole(struct crypt_device *cd, off_t *hole, uint32_t *length)
 {
-    uint32_t length = 0;
-    lm_slot_t *s = NULL;
-    lm_t lm = {};
-    int fd = -1;
+    const char *type = NULL;
+    uint64_t end = 0;
     int r = 0;
 
-    if (slot < 0 || slot >= LUKS_NSLOTS)
-        return -EBADSLT;
-    s = &lm.slots[slot];
-
-    fd = read_header(cd, O_RDONLY, &length, &lm);
-    if (fd < 0)
-        return fd;
+    type = crypt_get_type(cd);
+    if (!type || strcmp(CRYPT_LUKS1, type) != 0)
+        return -ENOTSUP;
 
-    r = uuid_is_zero(s->uuid) ? -ENODATA : 0;
-    if (r < 0)
-        goto error;
+    for (int slot = 0; slot < LUKS_NSLOTS; slot++) {
+        uint64_t off = 0;
+        uint64_t len = 0;
 
-    if (buf) {
-        r = size >= s->length ? 0 : -E2BIG;
+        r = crypt_keyslot_area(cd, slot, &off, &len);
         if (r < 0)
-            goto error;
+            return r;
 
-        r = lseek(fd, s->offset - sizeof(lm), SEEK_CUR) == -1 ? -errno : 0;
+        if (end < off + len)
+            end = off + len;
+    }
+
+    return find_hole(end, crypt_get_data_offset(cd) * 512, hole, length);
+}
+
+/**
+ * Opens the LUKSv1 device with the specified flags.
+ *
+ * The descriptor is locked (see lock()) until it is closed.
+ *
+ * The function returns either the file descriptor or a negative errno. All
+ * I/O on the descriptor is positional, so its file offset is never used.
+ */
+static int
+open_device(struct crypt_device *cd, int flags)
+{
+    const char *name = NULL;
+    const char *type = NULL;
+    int fd = 0;
+    int r = 0;
+
+    type = crypt_get_type(cd);
+    if (!type || strcmp(CRYPT_LUKS1, type) != 0)
+        return -ENOTSUP;
+
+    name = crypt_get_device_name(cd);
+    if (!name)
+        return -ENOTSUP;
+
+    fd = open(name, (flags & O_ACCMODE) | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+
+    r = lock(fd, flags);
+    if (r < 0) {
+        close(fd);
+        return r;
+    }
+
+    return fd;
+}
+
+/**
+ * Opens the device with the specified flags and locates its hole.
+ *
+ * The hole parameter is set to the absolute offset of the gap between the
+ * end of the last slot and the start of the encrypted data. The length
+ * parameter is set to the amount of space in this gap.
+ *
+ * Returns the locked file descriptor (see open_device()) or a negative errno.
+ */
+static int
+open_hole(struct crypt_device *cd, int flags, off_t *hole, uint32_t *length)
+{
+    int r = 0;
+
+    r = query_hole(cd, hole, length);
+    if (r < 0)
+        return r;
+
+    return open_device(cd, flags);
+}
+
+/**
+ * Finds the hole and the active keyslots by parsing a LUKSv1 header.
+ *
+ * The checksum in crc, if given, is updated with the bytes of the header.
+ */
+static int
+read_luks1(int fd, off_t *hole, uint32_t *length, uint8_t *active,
+           uint32_t *crc)
+{
+    luks1_phdr_t hdr = {};
+    uint64_t end = 0;
+    ssize_t r = 0;
+
+    r = readall(fd, &hdr, sizeof(hdr), 0);
+    if (r < 0)
+        return r;
+
+    if (crc)
+        *crc = crc32c(*crc, &hdr, sizeof(hdr));
+
+    if (memcmp(hdr.magic, LUKS1_MAGIC, sizeof(hdr.magic)) != 0 ||
+        be16toh(hdr.version) != 1)
+        return -ENOTSUP;
+
+    *active = 0;
+    for (int slot = 0; slot < LUKS_NSLOTS; slot++) {
+        const luks1_keyslot_t *k = &hdr.keyslots[slot];
+        uint64_t off = be32toh(k->key_material_offset) * 512ULL;
+        uint64_t len = (uint64_t) be32toh(hdr.key_bytes) * be32toh(k->stripes);
+
+        /* The key material is stored in whole sectors. */
+        len = ROUNDUP(len, 512);
+        if (end < off + len)
+            end = off + len;
+
+        if (be32toh(k->active) == LUKS1_KEY_ENABLED)
+            *active |= 1 << slot;
+    }
+
+    return find_hole(end, be32toh(hdr.payload_offset) * 512ULL, hole, length);
+}
+
+/**
+ * Checks one copy of the header and converts it to host byte order.
+ */
+static int
+parse_header(const void *buf, lm_t *lm)
+{
+    uint32_t version;
+
+    memcpy(lm, buf, sizeof(lm_t));
+
+    if (memcmp(LM_MAGIC, lm->magic, sizeof(LM_MAGIC)) != 0)
+        return -ENOENT;
+
+    version = be32toh(lm->version);
+    switch (version) {
+    case LUKSMETA_VERSION_1: break;
+    case LUKSMETA_VERSION_2: break;
+    case LUKSMETA_VERSION_3: break;
+    case LUKSMETA_VERSION_4: break;
+    default: return -ENOTSUP;
+    }
+
+    lm->crc32c = be32toh(lm->crc32c);
+    if (checksum(*lm, version) != lm->crc32c)
+        return -EINVAL;
+
+    lm->version = version;
+    lm->generation = version >= LUKSMETA_VERSION_3 ?
+        be64toh(lm->generation) : 0;
+
+    if (version < LUKSMETA_VERSION_4)
+        memset(&lm->table, 0, sizeof(lm->table));
+
+    for (int slot = 0; slot <= LUKS_NSLOTS; slot++) {
+        lm_slot_t *s = slot < LUKS_NSLOTS ? &lm->slots[slot] : &lm->table;
+
+        s->offset = be32toh(s->offset);
+        s->length = be32toh(s->length);
+        s->crc32c = be32toh(s->crc32c);
+        s->flags = be32toh(s->flags);
+    }
+
+    return 0;
+}
+
+/* The bytes at the start of the hole which hold all copies of the header */
+#define LM_HEADERS (LM_V3_COPY + sizeof(lm_t))
+
+/**
+ * Selects and validates the current header from the start of the hole.
+ *
+ * Version 3 keeps two copies of the header, both of which are read at once.
+ * The valid copy with the highest generation is used, so a reader racing a
+ * writer (or a crash during a header write) never sees a torn header. The
+ * first copy is used as is for older versions, which have only one.
+ *
+ * The buffer holds the first LM_HEADERS bytes of the hole, or all of it if
+ * the hole is smaller (the rest zeroed).
+ */
+static int
+select_header(const uint8_t buf[LM_HEADERS], uint32_t length, lm_t *lm)
+{
+    uint32_t maxlen;
+    lm_t b = {};
+    int ra = 0;
+    int rb = 0;
+
+    ra = parse_header(buf, lm);
+    if (ra < 0 || lm->version >= LUKSMETA_VERSION_3) {
+        rb = parse_header(&buf[LM_V3_COPY], &b);
+        if (rb == 0 && b.version < LUKSMETA_VERSION_3)
+            rb = -ENOENT;
+
+        if (rb == 0 && (ra < 0 || b.generation > lm->generation))
+            *lm = b;
+        else if (ra < 0)
+            return ra;
+    }
+
+    if (length < first_offset(lm))
+        return -EINVAL;
+
+    maxlen = length - first_offset(lm);
+    for (int slot = 0; slot < LUKS_NSLOTS; slot++) {
+        const lm_slot_t *s = &lm->slots[slot];
+
+        if (!uuid_is_zero(s->uuid)) {
+            if (s->offset < first_offset(lm))
+                return -EINVAL;
+
+            if (s->length > maxlen)
+                return -EINVAL;
+        }
+    }
+
+    if (lm->table.length > 0) {
+        if (lm->table.offset < first_offset(lm))
+            return -EINVAL;
+
+        if (lm->table.length > LM_MAX_ENTRIES * sizeof(lm_entry_t) ||
+            lm->table.length % sizeof(lm_entry_t) != 0)
+            return -EINVAL;
+    }
+
+    return 0;
+}
+
+/**
+ * Reads the bytes holding all copies of the header and updates the
+ * checksum in crc with them.
+ */
+static int
+read_headers(int fd, off_t hole, uint32_t length, uint8_t buf[LM_HEADERS],
+             uint32_t *crc)
+{
+    ssize_t r = 0;
+
+    memset(buf, 0, LM_HEADERS);
+    if (length < sizeof(lm_t))
+        return -ENOENT;
+
+    r = readall(fd, buf, length < LM_HEADERS ? length : LM_HEADERS, hole);
+    if (r < 0)
+        return r;
+
+    *crc = crc32c(*crc, buf, LM_HEADERS);
+    return 0;
+}
+
+/**
+ * Reads the current header.
+ *
+ * The checksum in crc, if given, is updated with the bytes the header was
+ * selected from.
+ */
+static int
+read_header(int fd, off_t hole, uint32_t length, lm_t *lm, uint32_t *crc)
+{
+    uint8_t buf[LM_HEADERS];
+    uint32_t tmp = 0;
+    int r = 0;
+
+    r = read_headers(fd, hole, length, buf, crc ? crc : &tmp);
+    if (r < 0)
+        return r;
+
+    return select_header(buf, length, lm);
+}
+
+/**
+ * Reads the entry table referenced by the header of the handle.
+ */
+static int
+read_table(luksmeta_t *lm)
+{
+    const lm_slot_t *t = &lm->lm.table;
+    uint32_t maxlen = lm->length - first_offset(&lm->lm);
+    uint32_t crc = 0;
+    ssize_t r = 0;
+
+    lm->nentries = 0;
+    if (t->length == 0)
+        return 0;
+
+    r = readall_crc32c(lm->fd, lm->entries, t->length, lm->hole + t->offset,
+                       &crc);
+    if (r < 0)
+        return r;
+
+    if (crc != t->crc32c)
+        return -EINVAL;
+
+    for (size_t i = 0; i < t->length / sizeof(lm_entry_t); i++) {
+        lm_entry_t *e = &lm->entries[i];
+
+        e->slot.offset = be32toh(e->slot.offset);
+        e->slot.length = be32toh(e->slot.length);
+        e->slot.crc32c = be32toh(e->slot.crc32c);
+        e->slot.flags = be32toh(e->slot.flags);
+        e->keyslot = be32toh(e->keyslot);
+
+        if (uuid_is_zero(e->slot.uuid) || e->keyslot >= LUKS_NSLOTS)
+            return -EINVAL;
+
+        if (e->slot.offset < first_offset(&lm->lm) ||
+            e->slot.length > maxlen)
+            return -EINVAL;
+
+        /* Lookups rely on the order. */
+        if (i > 0 && cmp_entry(&e[-1], e->keyslot, e->slot.uuid) >= 0)
+            return -EINVAL;
+
+        lm->nentries++;
+    }
+
+    return 0;
+}
+
+/**
+ * Identifies a cache entry.
+ *
+ * Block devices are identified by their device number and other files by
+ * their inode. For devices opened through libcryptsetup, the UUID and data
+ * offset of the LUKSv1 header stand in for the position of the hole, so
+ * that it need not be recomputed from the keyslots on every open.
+ */
+typedef struct {
+    dev_t dev;          /* Block device, or file system of the file */
+    ino_t ino;          /* Inode of the file, zero for block devices */
+    bool image;         /* Opened with luksmeta_open_image() */
+    char uuid[40];      /* UUID of the LUKSv1 header (devices only) */
+    uint64_t data;      /* Data offset in sectors (devices only) */
+} cache_key_t;
+
+/**
+ * An entry of the header cache (see luksmeta_cache_enable()).
+ *
+ * Entries are valid as long as the bytes holding the header have the same
+ * checksum, which for images also covers the LUKSv1 header. Images which are
+ * regular files are valid as long as the file has the same modification
+ * time and size instead, so they are used without any read at all. The
+ * modification time of a device node does not change when the device is
+ * written, so images on block devices are checked like crypt devices.
+ */
+typedef struct cache {
+    struct cache *next;
+    cache_key_t key;
+    uint32_t crc;           /* Checksum of the header bytes */
+    struct timespec mtime;  /* Modification time of the file (images) */
+    off_t size;             /* Size of the file (images) */
+
+    off_t hole;
+    uint32_t length;
+    uint8_t active;
+    lm_t lm;
+    lm_entry_t entries[LM_MAX_ENTRIES];
+    size_t nentries;
+} cache_t;
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static cache_t *cache_list; /* Most recently used first */
+static bool cache_on;
+static luksmeta_cache_stats_t cache_stats;
+
+static bool
+cache_enabled(void)
+{
+    bool on;
+
+    pthread_mutex_lock(&cache_mutex);
+    on = cache_on;
+    pthread_mutex_unlock(&cache_mutex);
+    return on;
+}
+
+/**
+ * Fills in the cache key of the file of a handle.
+ */
+static void
+cache_key(const luksmeta_t *lm, const struct stat *st, cache_key_t *key)
+{
+    const char *uuid = NULL;
+
+    memset(key, 0, sizeof(*key));
+    file_id(st, &key->dev, &key->ino);
+
+    key->image = !lm->cd;
+    if (lm->cd) {
+        uuid = crypt_get_uuid(lm->cd);
+        snprintf(key->uuid, sizeof(key->uuid), "%s", uuid ? uuid : "");
+        key->data = crypt_get_data_offset(lm->cd);
+    }
+}
+
+/**
+ * Finds an entry and makes it the most recently used one.
+ *
+ * The cache must be locked.
+ */
+static cache_t *
+cache_find(const cache_key_t *key)
+{
+    for (cache_t **e = &cache_list; *e; e = &(*e)->next) {
+        cache_t *c = *e;
+
+        if (c->key.dev != key->dev || c->key.ino != key->ino ||
+            c->key.image != key->image || c->key.data != key->data ||
+            strcmp(c->key.uuid, key->uuid) != 0)
+            continue;
+
+        *e = c->next;
+        c->next = cache_list;
+        cache_list = c;
+        return c;
+    }
+
+    return NULL;
+}
+
+/* Checks whether an entry is validated by the modification time. */
+static bool
+cache_stamped(const cache_key_t *key, const struct stat *st)
+{
+    return key->image && S_ISREG(st->st_mode);
+}
+
+/**
+ * Fills in the header of a handle from the cache, if it is still valid.
+ *
+ * Unless the entry is validated by the modification time, the header bytes
+ * (preceded by the LUKSv1 header for images) are read again and their
+ * checksum compared with the one they had when cached. The reads are done
+ * with the cache unlocked, so the entry is looked up again afterwards.
+ */
+static bool
+cache_get(luksmeta_t *lm, const cache_key_t *key, const struct stat *st)
+{
+    uint8_t buf[LM_HEADERS];
+    luks1_phdr_t hdr = {};
+    uint32_t length = 0;
+    uint32_t crc = 0;
+    off_t hole = 0;
+    cache_t *c = NULL;
+    bool read = false;
+    bool hit = false;
+
+    if (!cache_stamped(key, st)) {
+        pthread_mutex_lock(&cache_mutex);
+        c = cache_find(key);
+        if (c) {
+            hole = c->hole;
+            length = c->length;
+        }
+        pthread_mutex_unlock(&cache_mutex);
+
+        read = c != NULL;
+        if (read && key->image) {
+            read = readall(lm->fd, &hdr, sizeof(hdr), 0) >= 0;
+            crc = crc32c(crc, &hdr, sizeof(hdr));
+        }
+
+        if (read)
+            read = read_headers(lm->fd, hole, length, buf, &crc) == 0;
+    }
+
+    pthread_mutex_lock(&cache_mutex);
+    c = cache_find(key);
+    if (c && cache_stamped(key, st))
+        hit = c->size == st->st_size &&
+              c->mtime.tv_sec == st->st_mtim.tv_sec &&
+              c->mtime.tv_nsec == st->st_mtim.tv_nsec;
+    else if (c)
+        hit = read && c->hole == hole && c->length == length &&
+              c->crc == crc;
+
+    if (hit) {
+        lm->hole = c->hole;
+        lm->length = c->length;
+        lm->active = c->active;
+        lm->lm = c->lm;
+        memcpy(lm->entries, c->entries, c->nentries * sizeof(lm_entry_t));
+        lm->nentries = c->nentries;
+        cache_stats.hits++;
+    } else {
+        cache_stats.misses++;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+
+    return hit;
+}
+
+/**
+ * Stores the header of a freshly opened handle in the cache.
+ *
+ * When the cache is full, the least recently used entry is replaced. Since
+ * this is only a cache, failing to allocate an entry is not an error.
+ */
+static void
+cache_put(const luksmeta_t *lm, const cache_key_t *key, const struct stat *st,
+          uint32_t crc)
+{
+    cache_t **e = NULL;
+    cache_t *c = NULL;
+    size_t n = 0;
+
+    pthread_mutex_lock(&cache_mutex);
+    if (!cache_on)
+        goto egress;
+
+    c = cache_find(key);
+    if (!c) {
+        for (e = &cache_list; *e; e = &(*e)->next) {
+            if (++n < CACHE_ENTRIES)
+                continue;
+
+            c = *e;
+            *e = NULL;
+            break;
+        }
+
+        if (!c)
+            c = malloc(sizeof(*c));
+        if (!c)
+            goto egress;
+
+        c->next = cache_list;
+        cache_list = c;
+    }
+
+    c->key = *key;
+    c->crc = crc;
+    c->mtime = st->st_mtim;
+    c->size = st->st_size;
+    c->hole = lm->hole;
+    c->length = lm->length;
+    c->active = lm->active;
+    c->lm = lm->lm;
+    memcpy(c->entries, lm->entries, lm->nentries * sizeof(lm_entry_t));
+    c->nentries = lm->nentries;
+
+egress:
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+/**
+ * Removes all entries of the file of a descriptor about to be written.
+ */
+static void
+cache_drop(int fd)
+{
+    struct stat st = {};
+    dev_t dev = 0;
+    ino_t ino = 0;
+
+    if (!cache_enabled() || fstat(fd, &st) < 0)
+        return;
+    file_id(&st, &dev, &ino);
+
+    pthread_mutex_lock(&cache_mutex);
+    for (cache_t **e = &cache_list; *e;) {
+        cache_t *c = *e;
+
+        if (c->key.dev != dev || c->key.ino != ino) {
+            e = &c->next;
+            continue;
+        }
+
+        *e = c->next;
+        free(c);
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+/**
+ * Reads the header and the entry table of a newly opened handle.
+ *
+ * With the cache enabled, they are taken from it if possible. Otherwise,
+ * the hole is located, by querying libcryptsetup or by parsing the LUKSv1
+ * header of an image, and the header and table are read and validated.
+ */
+static int
+read_handle(luksmeta_t *lm)
+{
+    struct stat st = {};
+    cache_key_t key = {};
+    uint32_t crc = 0;
+    bool cached = false;
+    int r = 0;
+
+    /* The modification time must predate the reads it vouches for. */
+    cached = cache_enabled() && fstat(lm->fd, &st) == 0;
+    if (cached) {
+        cache_key(lm, &st, &key);
+        if (cache_get(lm, &key, &st))
+            return 0;
+    }
+
+    if (lm->cd)
+        r = query_hole(lm->cd, &lm->hole, &lm->length);
+    else
+        r = read_luks1(lm->fd, &lm->hole, &lm->length, &lm->active, &crc);
+    if (r == 0)
+        r = read_header(lm->fd, lm->hole, lm->length, &lm->lm, &crc);
+    if (r == 0)
+        r = read_table(lm);
+    if (r == 0 && cached)
+        cache_put(lm, &key, &st, crc);
+
+    return r;
+}
+
+/**
+ * Writes the header.
+ *
+ * Older versions overwrite their only copy, which must be durable before
+ * anything else is written, so the write is flushed. Version 3 bumps the
+ * generation and overwrites the older copy instead. The newer copy stays
+ * valid until the next flush, so the flush is left to the caller.
+ */
+static int
+write_header(int fd, off_t hole, lm_t *lm)
+{
+    uint32_t version = lm->version;
+    lm_t tmp = *lm;
+    ssize_t r;
+
+    cache_drop(fd);
+
+    if (version >= LUKSMETA_VERSION_3) {
+        tmp.generation = htobe64(++lm->generation);
+        if (lm->generation % 2 == 1)
+            hole += LM_V3_COPY;
+    }
+
+    for (int slot = 0; slot <= LUKS_NSLOTS; slot++) {
+        lm_slot_t *s = slot < LUKS_NSLOTS ? &tmp.slots[slot] : &tmp.table;
+
+        s->offset = htobe32(s->offset);
+        s->length = htobe32(s->length);
+        s->crc32c = htobe32(s->crc32c);
+        s->flags = htobe32(s->flags);
+    }
+
+    memcpy(tmp.magic, LM_MAGIC, sizeof(LM_MAGIC));
+    tmp.version = htobe32(version);
+    tmp.crc32c = htobe32(checksum(tmp, version));
+
+    r = writeall(fd, &tmp, header_size(version), hole);
+    if (r < 0)
+        return r;
+
+    return version >= LUKSMETA_VERSION_3 ? 0 : flush(fd);
+}
+
+/**
+ * Writes both header copies of a version 3 header, one after the other.
+ *
+ * This replaces whatever was in the first copy, such as an older header,
+ * without ever leaving the device without a valid header.
+ */
+static int
+write_headers(int fd, off_t hole, lm_t *lm)
+{
+    int r = 0;
+
+    for (int i = 0; i < 2; i++) {
+        r = write_header(fd, hole, lm);
+        if (r < 0)
+            return r;
+
+        r = flush(fd);
+        if (r < 0)
+            return r;
+    }
+
+    return 0;
+}
+
+/**
+ * Writes the header and makes it the current header of the handle.
+ */
+static int
+commit(luksmeta_t *lm, lm_t *tmp)
+{
+    int r = 0;
+
+    r = write_header(lm->fd, lm->hole, tmp);
+    if (r < 0)
+        return r;
+
+    lm->lm = *tmp;
+    lm->dirty = tmp->version >= LUKSMETA_VERSION_3;
+    return 0;
+}
+
+/**
+ * Makes a deferred header write durable.
+ *
+ * This must happen before overwriting data the previous header references.
+ */
+static int
+settle(luksmeta_t *lm)
+{
+    if (!lm->dirty)
+        return 0;
+
+    lm->dirty = false;
+    return flush(lm->fd);
+}
+
+/**
+ * Prepares the bytes stored for a slot, compressing them if requested.
+ *
+ * Compression is only used with version 2 and later layouts, since older
+ * releases ignore the slot flags, and only when it actually saves space.
+ * Compressed data is prefixed with its uncompressed length (BE32). If
+ * compression is used, *enc is set to an allocated buffer which the caller
+ * must free.
+ *
+ * Returns the number of bytes to store or a negative errno value.
+ */
+static ssize_t
+encode(const lm_t *lm, lm_slot_t *s, const void *buf, size_t size,
+       int flags, uint8_t **enc)
+{
+    compress_alg_t alg = compress_best();
+    uint32_t len = htobe32(size);
+    uint8_t *tmp = NULL;
+    ssize_t r = 0;
+
+    s->flags = 0;
+    *enc = NULL;
+
+    if (!(flags & LUKSMETA_SAVE_COMPRESS) || alg == COMPRESS_NONE ||
+        lm->version < LUKSMETA_VERSION_2 ||
+        size <= sizeof(len) + 1 || size > UINT32_MAX)
+        return size;
+
+    tmp = malloc(size);
+    if (!tmp)
+        return -errno;
+
+    r = compress_data(alg, buf, size, &tmp[sizeof(len)],
+                      size - sizeof(len) - 1);
+    if (r <= 0) {
+        memset(tmp, 0, size);
+        free(tmp);
+        return r < 0 ? r : (ssize_t) size;
+    }
+
+    memcpy(tmp, &len, sizeof(len));
+    s->flags = alg;
+    *enc = tmp;
+    return r + sizeof(len);
+}
+
+/**
+ * Decodes the stored bytes of a compressed slot into buf.
+ *
+ * Returns the length of the original data or a negative errno value. If
+ * buf is NULL, only the length is returned.
+ */
+static ssize_t
+decode(const lm_slot_t *s, const uint8_t *raw, void *buf, size_t size)
+{
+    uint32_t len = 0;
+    ssize_t r = 0;
+
+    if (s->length < sizeof(len))
+        return -EINVAL;
+
+    memcpy(&len, raw, sizeof(len));
+    len = be32toh(len);
+
+    if (!buf)
+        return len;
+
+    if (size < len)
+        return -E2BIG;
+
+    r = decompress_data(s->flags & LM_FLAG_COMPRESS, &raw[sizeof(len)],
+                        s->length - sizeof(len), buf, len);
+    if (r < 0)
+        return r;
+
+    return r == len ? (ssize_t) len : -EINVAL;
+}
+
+/**
+ * Writes data to free space and fills in the extent of s accordingly.
+ *
+ * Space occupied by the header tmp and the given entries is avoided. The
+ * data is not flushed.
+ */
+static ssize_t
+place(luksmeta_t *lm, const lm_t *tmp, const lm_entry_t *entries,
+      size_t nentries, lm_slot_t *s, const void *buf, size_t size, int flags)
+{
+    uint8_t *enc = NULL;
+    uint32_t offset = 0;
+    ssize_t len = 0;
+    ssize_t r = 0;
+
+    len = encode(tmp, s, buf, size, flags, &enc);
+    if (len < 0)
+        return len;
+
+    if (enc)
+        buf = enc;
+
+    offset = find_gap(tmp, entries, nentries, lm->length, len,
+                      flags & ~LUKSMETA_SAVE_COMPRESS);
+    if (offset < first_offset(tmp)) {
+        r = -ENOSPC;
+        goto egress;
+    }
+
+    s->offset = offset;
+    s->length = len;
+    s->crc32c = crc32c(0, buf, len);
+
+    r = writeall(lm->fd, buf, len, lm->hole + s->offset);
+
+egress:
+    if (enc) {
+        memset(enc, 0, len);
+        free(enc);
+    }
+
+    return r;
+}
+
+/**
+ * Writes data for a slot to free space and commits the updated header.
+ *
+ * The header is only written once the data has reached stable storage. On
+ * success, the handle's cached header is replaced by tmp.
+ */
+static ssize_t
+store(luksmeta_t *lm, lm_t *tmp, int slot, const luksmeta_uuid_t uuid,
+      const void *buf, size_t size, int flags)
+{
+    lm_slot_t *s = &tmp->slots[slot];
+    ssize_t r = 0;
+
+    r = place(lm, tmp, lm->entries, lm->nentries, s, buf, size, flags);
+    if (r < 0)
+        return r;
+
+    memcpy(s->uuid, uuid, sizeof(luksmeta_uuid_t));
+
+    r = flush(lm->fd);
+    if (r < 0)
+        return r;
+
+    return commit(lm, tmp);
+}
+
+static bool
+valid_save_flags(int flags)
+{
+    switch (flags & ~LUKSMETA_SAVE_COMPRESS) {
+    case LUKSMETA_SAVE_FIRST_FIT: return true;
+    case LUKSMETA_SAVE_BEST_FIT: return true;
+    case LUKSMETA_SAVE_WORST_FIT: return true;
+    default: return false;
+    }
+}
+
+/**
+ * Rereads the token of a LUKSv2 device.
+ *
+ * LUKSv1 writers hold an exclusive lock on the device from the time the
+ * header is read. On LUKSv2, libcryptsetup locks the metadata itself, but
+ * only for the duration of each token read or write, so a writer rereads
+ * the token right before changing it rather than trusting the copy read
+ * when the handle was opened.
+ */
+static int
+refresh_luks2(luksmeta_t *lm)
+{
+    luks2_slot_t tmp[LUKS_NSLOTS] = {};
+    int r = 0;
+
+    r = luks2_read(lm->cd, lm->token, tmp, LUKS_NSLOTS);
+    if (r < 0)
+        return r;
+
+    luks2_free(lm->data, LUKS_NSLOTS);
+    memcpy(lm->data, tmp, sizeof(tmp));
+
+    for (int i = 0; i < LUKS_NSLOTS; i++) {
+        memset(&lm->lm.slots[i], 0, sizeof(lm_slot_t));
+        memcpy(lm->lm.slots[i].uuid, lm->data[i].uuid,
+               sizeof(luksmeta_uuid_t));
+        lm->lm.slots[i].length = lm->data[i].size;
+    }
+
+    return 0;
+}
+
+/**
+ * Reads the slots of a LUKSv2 device from its token.
+ *
+ * The UUIDs and sizes are mirrored into the cached header, so that lookups
+ * which only need those work the same as for LUKSv1.
+ */
+static int
+open_luks2(luksmeta_t *lm, int flags)
+{
+    int r = 0;
+
+    lm->luks2 = true;
+    lm->rdonly = flags == O_RDONLY;
+    lm->fd = -1;
+
+    r = luks2_find(lm->cd);
+    if (r < 0)
+        return r;
+    lm->token = r;
+
+    return refresh_luks2(lm);
+}
+
+static ssize_t
+load_luks2(const luksmeta_t *lm, int slot, void *buf, size_t size)
+{
+    const luks2_slot_t *s = &lm->data[slot];
+
+    if (buf) {
+        if (size < s->size)
+            return -E2BIG;
+
+        memcpy(buf, s->data, s->size);
+    }
+
+    return s->size;
+}
+
+/**
+ * Replaces a slot of a LUKSv2 device or, without a UUID, empties it.
+ *
+ * The whole token is rewritten by libcryptsetup, which updates both copies
+ * of the LUKSv2 header in turn.
+ */
+static int
+store_luks2(luksmeta_t *lm, int slot, const luksmeta_uuid_t uuid,
+            const void *buf, size_t size)
+{
+    luks2_slot_t tmp[LUKS_NSLOTS] = {};
+    luks2_slot_t *s = &tmp[slot];
+    int r = 0;
+
+    if (lm->rdonly)
+        return -EBADF;
+
+    memcpy(tmp, lm->data, sizeof(tmp));
+    memset(s, 0, sizeof(*s));
+
+    if (uuid) {
+        s->data = malloc(size > 0 ? size : 1);
+        if (!s->data)
+            return -errno;
+
+        if (size > 0)
+            memcpy(s->data, buf, size);
+
+        memcpy(s->uuid, uuid, sizeof(luksmeta_uuid_t));
+        s->size = size;
+    }
+
+    r = luks2_write(lm->cd, lm->token, tmp, LUKS_NSLOTS);
+    if (r < 0) {
+        luks2_free(s, 1);
+        return r;
+    }
+
+    luks2_free(&lm->data[slot], 1);
+    lm->data[slot] = *s;
+
+    memset(&lm->lm.slots[slot], 0, sizeof(lm_slot_t));
+    memcpy(lm->lm.slots[slot].uuid, s->uuid, sizeof(luksmeta_uuid_t));
+    lm->lm.slots[slot].length = s->size;
+    return 0;
+}
+
+int
+luksmeta_open(struct crypt_device *cd, int flags, luksmeta_t **lm)
+{
+    luksmeta_t *h = NULL;
+    int r = 0;
+
+    switch (flags & ~O_NONBLOCK) {
+    case O_RDONLY: break;
+    case O_RDWR: break;
+    default: return -EINVAL;
+    }
+
+    h = calloc(1, sizeof(*h));
+    if (!h)
+        return -errno;
+
+    h->cd = cd;
+    if (luks2_supported(cd)) {
+        r = open_luks2(h, flags & O_ACCMODE);
+        if (r < 0) {
+            luksmeta_close(h);
+            return r;
+        }
+
+        *lm = h;
+        return 0;
+    }
+
+    h->fd = open_device(cd, flags);
+    if (h->fd < 0) {
+        r = h->fd;
+        free(h);
+        return r;
+    }
+
+    r = read_handle(h);
+    if (r < 0) {
+        luksmeta_close(h);
+        return r;
+    }
+
+    *lm = h;
+    return 0;
+}
+
+int
+luksmeta_open_image(int fd, luksmeta_t **lm)
+{
+    luksmeta_t *h = NULL;
+    int r = 0;
+
+    h = calloc(1, sizeof(*h));
+    if (!h)
+        return -errno;
+
+    h->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (h->fd < 0) {
+        r = -errno;
+        free(h);
+        return r;
+    }
+
+    r = fcntl(fd, F_GETFL);
+    r = r < 0 ? -errno : lock(h->fd, r & O_ACCMODE);
+    if (r == 0)
+        r = read_handle(h);
+    if (r < 0) {
+        luksmeta_close(h);
+        return r;
+    }
+
+    *lm = h;
+    return 0;
+}
+
+int
+luksmeta_flush(luksmeta_t *lm)
+{
+    return settle(lm);
+}
+
+void
+luksmeta_close(luksmeta_t *lm)
+{
+    if (!lm)
+        return;
+
+    settle(lm);
+    if (lm->fd >= 0)
+        unlock(lm->fd);
+
+    luks2_free(lm->data, LUKS_NSLOTS);
+    free(lm);
+}
+
+/**
+ * Closes a handle after a change, returning the result of the change or the
+ * error of the flush which makes its header durable.
+ */
+static int
+close_flushed(luksmeta_t *lm, int r)
+{
+    int f = r < 0 ? 0 : settle(lm);
+
+    luksmeta_close(lm);
+    return f < 0 ? f : r;
+}
+
+int
+luksmeta_test(struct crypt_device *cd)
+{
+    luksmeta_t *lm = NULL;
+    int r = 0;
+
+    r = luksmeta_open(cd, O_RDONLY, &lm);
+    luksmeta_close(lm);
+    return r;
+}
+
+int
+luksmeta_nuke(struct crypt_device *cd)
+{
+    return luksmeta_nuke_strategy(cd, NULL);
+}
+
+int
+luksmeta_nuke_strategy(struct crypt_device *cd, luksmeta_zero_t *strategy)
+{
+    luksmeta_zero_t tmp = LUKSMETA_ZERO_NONE;
+    uint32_t length = 0;
+    off_t hole = 0;
+    int fd = -1;
+    int r = 0;
+
+    /* Removing the token leaves nothing behind in the LUKSv2 header. */
+    if (luks2_supported(cd)) {
+        if (strategy)
+            *strategy = tmp;
+
+        r = luks2_find(cd);
+        return r < 0 ? 0 : luks2_remove(cd, r);
+    }
+
+    fd = open_hole(cd, O_RDWR, &hole, &length);
+    if (fd < 0)
+        return fd;
+
+    cache_drop(fd);
+    r = zero_range(fd, hole, length, &tmp);
+    unlock(fd);
+
+    if (strategy)
+        *strategy = tmp;
+
+    return r;
+}
+
+int
+luksmeta_init(struct crypt_device *cd)
+{
+    return luksmeta_init_version(cd, LUKSMETA_VERSION_1);
+}
+
+int
+luksmeta_init_version(struct crypt_device *cd, int version)
+{
+    lm_t lm = { .version = version };
+    luksmeta_t *cur = NULL;
+    int r = 0;
+
+    switch (version) {
+    case LUKSMETA_VERSION_1: break;
+    case LUKSMETA_VERSION_2: break;
+    case LUKSMETA_VERSION_3: break;
+    case LUKSMETA_VERSION_4: break;
+    default: return -EINVAL;
+    }
+
+    /* LUKSv2 devices have no layout; a damaged token is replaced. */
+    if (luks2_supported(cd)) {
+        r = luksmeta_test(cd);
+        if (r == 0)
+            return -EALREADY;
+        else if (r != -ENOENT && r != -EINVAL)
+            return r;
+
+        r = luks2_find(cd);
+        r = luks2_write(cd, r < 0 ? CRYPT_ANY_TOKEN : r, NULL, 0);
+        return r < 0 ? r : 0;
+    }
+
+    /* The existing header is checked under the lock, like any change. */
+    cur = calloc(1, sizeof(*cur));
+    if (!cur)
+        return -errno;
+
+    cur->cd = cd;
+    cur->fd = open_hole(cd, O_RDWR, &cur->hole, &cur->length);
+    if (cur->fd < 0) {
+        r = cur->fd;
+        free(cur);
+        return r;
+    }
+
+    r = read_header(cur->fd, cur->hole, cur->length, &cur->lm, NULL);
+    if (r == 0)
+        r = read_table(cur);
+
+    if (r == 0) {
+        r = -EALREADY;
+    } else if (r == -ENOENT || r == -EINVAL) {
+        if (cur->length < first_offset(&lm))
+            r = -ENOSPC;
+        else if (version >= LUKSMETA_VERSION_3)
+            r = write_headers(cur->fd, cur->hole, &lm);
+        else
+            r = write_header(cur->fd, cur->hole, &lm);
+    }
+
+    luksmeta_close(cur);
+    return r;
+}
+
+/**
+ * Reads and verifies the data of a used slot or entry.
+ *
+ * Returns the size of the (decompressed) data. Without a buffer, only the
+ * size is returned.
+ */
+static ssize_t
+read_slot(const luksmeta_t *lm, const lm_slot_t *s, void *buf, size_t size)
+{
+    uint32_t crc = 0;
+    ssize_t r = 0;
+
+    if (s->flags & LM_FLAG_COMPRESS) {
+        uint8_t *raw = NULL;
+
+        raw = malloc(s->length > 0 ? s->length : 1);
+        if (!raw)
+            return -errno;
+
+        r = readall_crc32c(lm->fd, raw, s->length, lm->hole + s->offset, &crc);
+        if (r >= 0)
+            r = crc == s->crc32c ? decode(s, raw, buf, size) : -EINVAL;
+
+        memset(raw, 0, s->length);
+        free(raw);
+        return r;
+    }
+
+    if (buf) {
+        if (size < s->length)
+            return -E2BIG;
+
+        /* Let the kernel read ahead while we checksum each chunk. */
+        if (s->length > READ_CHUNK)
+            posix_fadvise(lm->fd, lm->hole + s->offset, s->length,
+                          POSIX_FADV_WILLNEED);
+
+        r = readall_crc32c(lm->fd, buf, s->length, lm->hole + s->offset, &crc);
+        if (r < 0)
+            return r;
+
+        if (crc != s->crc32c)
+            return -EINVAL;
+    }
+
+    return s->length;
+}
+
+int
+luksmeta_handle_load(luksmeta_t *lm, int slot,
+                     luksmeta_uuid_t uuid, void *buf, size_t size)
+{
+    const lm_slot_t *s = NULL;
+    ssize_t r = 0;
+
+    if (slot < 0 || slot >= LUKS_NSLOTS)
+        return -EBADSLT;
+    s = &lm->lm.slots[slot];
+
+    if (uuid_is_zero(s->uuid))
+        return -ENODATA;
+
+    if (lm->luks2)
+        r = load_luks2(lm, slot, buf, size);
+    else
+        r = read_slot(lm, s, buf, size);
+    if (r < 0)
+        return r;
+
+    memcpy(uuid, s->uuid, sizeof(luksmeta_uuid_t));
+    return r;
+}
+
+int
+luksmeta_handle_save(luksmeta_t *lm, int slot, const luksmeta_uuid_t uuid,
+                     const void *buf, size_t size, int flags)
+{
+    lm_t tmp = {};
+    ssize_t r = 0;
+
+    if (!valid_save_flags(flags))
+        return -EINVAL;
+
+    if (uuid_is_zero(uuid))
+        return -EKEYREJECTED;
+
+    if (lm->luks2 && !lm->rdonly) {
+        r = refresh_luks2(lm);
+        if (r < 0)
+            return r;
+    }
+
+    tmp = lm->lm;
+
+    if (slot == CRYPT_ANY_SLOT)
+        slot = find_unused_slot(lm, &tmp);
+
+    if (slot < 0 || slot >= LUKS_NSLOTS)
+        return -EBADSLT;
+
+    if (!uuid_is_zero(tmp.slots[slot].uuid))
+        return -EALREADY;
+
+    if (lm->luks2)
+        r = store_luks2(lm, slot, uuid, buf, size);
+    else
+        r = store(lm, &tmp, slot, uuid, buf, size, flags);
+    return r < 0 ? r : slot;
+}
+
+int
+luksmeta_handle_update(luksmeta_t *lm, int slot, const luksmeta_uuid_t uuid,
+                       const void *buf, size_t size, int flags)
+{
+    lm_slot_t old = {};
+    lm_t tmp = {};
+    ssize_t r = 0;
+
+    if (!valid_save_flags(flags))
+        return -EINVAL;
+
+    if (uuid_is_zero(uuid))
+        return -EKEYREJECTED;
+
+    if (slot < 0 || slot >= LUKS_NSLOTS)
+        return -EBADSLT;
+
+    if (lm->luks2 && !lm->rdonly) {
+        r = refresh_luks2(lm);
+        if (r < 0)
+            return r;
+    }
+
+    tmp = lm->lm;
+
+    if (uuid_is_zero(tmp.slots[slot].uuid))
+        return -ENODATA;
+
+    if (lm->luks2) {
+        r = store_luks2(lm, slot, uuid, buf, size);
+        return r < 0 ? r : slot;
+    }
+
+    /* The old extent is still in use here, so the new one cannot overlap. */
+    old = tmp.slots[slot];
+    r = store(lm, &tmp, slot, uuid, buf, size, flags);
+    if (r < 0)
+        return r;
+
+    r = settle(lm);
+    if (r < 0)
+        return r;
+
+    /*
+     * The old extent is no longer referenced, so there is no need to wait
+     * for the zeroes to reach the disk. They go out with the next barrier.
+     */
+    r = zero_write(lm->fd, lm->hole + old.offset, old.length);
+    return r < 0 ? r : slot;
+}
+
+static void
+free_raw(const luksmeta_t *lm, uint8_t *raw[LUKS_NSLOTS])
+{
+    for (size_t i = 0; i < LUKS_NSLOTS; i++) {
+        if (raw[i]) {
+            memset(raw[i], 0, lm->lm.slots[i].length);
+            free(raw[i]);
+        }
+    }
+}
+
+static int
+load_all_luks2(const luksmeta_t *lm, luksmeta_slot_t slots[], size_t nslots)
+{
+    int count = 0;
+
+    for (size_t i = 0; i < nslots; i++) {
+        const luks2_slot_t *s = &lm->data[i];
+        luksmeta_slot_t *o = &slots[i];
+
+        memcpy(o->uuid, s->uuid, sizeof(luksmeta_uuid_t));
+
+        if (uuid_is_zero(s->uuid)) {
+            o->status = -ENODATA;
+            continue;
+        }
+
+        count++;
+
+        if (!o->data) {
+            o->data = malloc(s->size > 0 ? s->size : 1);
+            if (!o->data) {
+                o->status = -ENOMEM;
+                continue;
+            }
+
+            o->size = s->size;
+        }
+
+        o->status = load_luks2(lm, i, o->data, o->size);
+    }
+
+    return count;
+}
+
+/* A load of all slots, between allocating the buffers and checking them */
+typedef struct {
+    luksmeta_slot_t *slots;
+    size_t nslots;
+    const lm_slot_t *sorted[LUKS_NSLOTS]; /* The slots to read, by offset */
+    size_t nsorted;
+    bool allocated[LUKS_NSLOTS];
+    uint8_t *raw[LUKS_NSLOTS];            /* Compressed slots, read aside */
+} load_t;
+
+/**
+ * Sets up the output slots and the buffers to read the used slots into.
+ *
+ * Returns the number of non-empty slots.
+ */
+static int
+load_prepare(const luksmeta_t *lm, load_t *ld)
+{
+    int count = 0;
+
+    for (size_t i = 0; i < ld->nslots; i++) {
+        const lm_slot_t *s = &lm->lm.slots[i];
+        luksmeta_slot_t *o = &ld->slots[i];
+
+        memcpy(o->uuid, s->uuid, sizeof(luksmeta_uuid_t));
+
+        if (uuid_is_zero(s->uuid)) {
+            o->status = -ENODATA;
+            continue;
+        }
+
+        count++;
+
+        if (s->flags & LM_FLAG_COMPRESS) {
+            /* Compressed slots are read aside and decoded afterwards. */
+            ld->raw[i] = malloc(s->length > 0 ? s->length : 1);
+            if (!ld->raw[i]) {
+                o->status = -ENOMEM;
+                continue;
+            }
+        } else if (!o->data) {
+            o->data = malloc(s->length > 0 ? s->length : 1);
+            if (!o->data) {
+                o->status = -ENOMEM;
+                continue;
+            }
+
+            o->size = s->length;
+            ld->allocated[i] = true;
+        } else if (o->size < s->length) {
+            o->status = -E2BIG;
+            continue;
+        }
+
+        o->status = s->length;
+        ld->sorted[ld->nsorted++] = s;
+    }
+
+    qsort(ld->sorted, ld->nsorted, sizeof(*ld->sorted), cmp_offset);
+    return count;
+}
+
+/* Returns the buffer the data of a slot to read is read into. */
+static void *
+load_buffer(const luksmeta_t *lm, const load_t *ld, const lm_slot_t *s)
+{
+    size_t n = s - lm->lm.slots;
+    return ld->raw[n] ? (void *) ld->raw[n] : ld->slots[n].data;
+}
+
+/**
+ * Verifies the slots which were read and decodes the compressed ones.
+ */
+static void
+load_check(const luksmeta_t *lm, load_t *ld)
+{
+    for (size_t i = 0; i < ld->nsorted; i++) {
+        const lm_slot_t *s = ld->sorted[i];
+        size_t n = s - lm->lm.slots;
+        luksmeta_slot_t *o = &ld->slots[n];
+        ssize_t len = 0;
+
+        if (crc32c(0, load_buffer(lm, ld, s), s->length) != s->crc32c) {
+            o->status = -EINVAL;
+            continue;
+        }
+
+        if (!ld->raw[n])
+            continue;
+
+        len = decode(s, ld->raw[n], NULL, 0);
+        if (len >= 0 && !o->data) {
+            o->data = malloc(len > 0 ? len : 1);
+            if (o->data) {
+                o->size = len;
+                ld->allocated[n] = true;
+            } else {
+                len = -ENOMEM;
+            }
+        }
+
+        if (len >= 0)
+            len = decode(s, ld->raw[n], o->data, o->size);
+
+        o->status = len;
+    }
+}
+
+/**
+ * Releases the buffers used for reading and, if the load failed, the ones
+ * allocated for the caller.
+ */
+static void
+load_cleanup(const luksmeta_t *lm, load_t *ld, bool failed)
+{
+    for (size_t i = 0; failed && i < ld->nslots; i++) {
+        if (ld->allocated[i]) {
+            free(ld->slots[i].data);
+            ld->slots[i].data = NULL;
+            ld->slots[i].size = 0;
+        }
+    }
+
+    free_raw(lm, ld->raw);
+}
+
+int
+luksmeta_handle_load_all(luksmeta_t *lm,
+                         luksmeta_slot_t slots[], size_t nslots)
+{
+    struct iovec iov[LUKS_NSLOTS * 2] = {};
+    load_t ld = { .slots = slots, .nslots = nslots };
+    uint8_t *discard = NULL;
+    int count = 0;
+    int r = 0;
+
+    if (ld.nslots > LUKS_NSLOTS)
+        ld.nslots = LUKS_NSLOTS;
+
+    if (lm->luks2)
+        return load_all_luks2(lm, slots, ld.nslots);
+
+    count = load_prepare(lm, &ld);
+
+    /* Read runs of nearby slots with one vectored read per run. */
+    for (size_t i = 0; i < ld.nsorted; ) {
+        uint32_t start = ld.sorted[i]->offset;
+        uint32_t end = start;
+        int iovcnt = 0;
+
+        for (; i < ld.nsorted; i++) {
+            const lm_slot_t *s = ld.sorted[i];
+            uint32_t gap = s->offset - end;
+
+            if (s->offset < end || (iovcnt > 0 && gap > READ_MAX_GAP))
+                break;
+
+            if (gap > 0) {
+                if (!discard) {
+                    discard = malloc(READ_MAX_GAP);
+                    if (!discard) {
+                        r = -ENOMEM;
+                        goto error;
+                    }
+                }
+
+                iov[iovcnt++] = (struct iovec) { discard, gap };
+            }
+
+            iov[iovcnt++] = (struct iovec) {
+                load_buffer(lm, &ld, s), s->length
+            };
+            end = s->offset + s->length;
+        }
+
+        r = preadvall(lm->fd, iov, iovcnt, lm->hole + start);
         if (r < 0)
             goto error;
+    }
+
+    load_check(lm, &ld);
+    load_cleanup(lm, &ld, false);
+    free(discard);
+    return count;
+
+error:
+    load_cleanup(lm, &ld, true);
+    free(discard);
+    return r;
+}
+
+/* A device of a batch load, from its header read to its last slot read */
+typedef struct {
+    luksmeta_batch_t *item;
+    luksmeta_t *lm;
+    load_t ld;
+    int count;            /* Non-empty slots */
+    int error;            /* The first error, if any */
+    unsigned pending;     /* Reads in flight */
+    uint8_t buf[LM_HEADERS];
+} batch_t;
+
+/**
+ * Completes a read of a batch which came back short.
+ *
+ * A short read is not an error; the remainder is read synchronously, which
+ * also reports the end of the device as -ENOENT.
+ */
+static ssize_t
+batch_complete(const batch_t *b, ssize_t res, void *buf, size_t size, off_t off)
+{
+    if (res < 0 || (size_t) res >= size)
+        return res;
+
+    return readall(b->lm->fd, (uint8_t *) buf + res, size - res, off + res);
+}
+
+static void
+batch_finish(batch_t *b)
+{
+    if (b->error < 0) {
+        load_cleanup(b->lm, &b->ld, true);
+        b->item->status = b->error;
+    } else {
+        load_check(b->lm, &b->ld);
+        load_cleanup(b->lm, &b->ld, false);
+        b->item->status = b->count;
+    }
+
+    luksmeta_close(b->lm);
+    b->lm = NULL;
+}
+
+/**
+ * Gives up on the reads of a device after the ring failed and loads the
+ * device synchronously instead.
+ *
+ * Its reads may still be in flight, so the buffers they target are leaked
+ * rather than freed: the header buffer and the slots read aside (which the
+ * caller leaks with the batch state) and any data buffers allocated for the
+ * caller. Buffers supplied by the caller may still be written to, but only
+ * with the bytes the synchronous load reads into them.
+ */
+static void
+batch_abandon(batch_t *b)
+{
+    for (size_t i = 0; i < b->ld.nslots; i++) {
+        if (b->ld.allocated[i]) {
+            b->ld.slots[i].data = NULL;
+            b->ld.slots[i].size = 0;
+        }
+    }
+
+    luksmeta_close(b->lm);
+    b->lm = NULL;
+
+    b->item->status = luksmeta_load_all(b->item->cd, b->item->slots,
+                                        b->ld.nslots);
+}
+
+/**
+ * Handles the completion of a read of a batch.
+ *
+ * Once the header of a device arrives, the reads of all its used slots are
+ * queued right away. A device is finished when its last read completes.
+ */
+static void
+batch_read(uring_t *ring, batch_t *batch, uint64_t tag, ssize_t res)
+{
+    batch_t *b = &batch[tag >> 8];
+    luksmeta_t *lm = b->lm;
+    unsigned op = tag & 0xff;
+    int r = 0;
+
+    b->pending--;
+
+    if (op == BATCH_HEADER) {
+        size_t size = lm->length < LM_HEADERS ? lm->length : LM_HEADERS;
+
+        r = batch_complete(b, res, b->buf, size, lm->hole);
+        if (r >= 0)
+            r = select_header(b->buf, lm->length, &lm->lm);
+        if (r < 0) {
+            b->error = r;
+        } else {
+            b->count = load_prepare(lm, &b->ld);
+            for (size_t i = 0; i < b->ld.nsorted && b->error == 0; i++) {
+                const lm_slot_t *s = b->ld.sorted[i];
+
+                r = uring_read(ring, lm->fd, load_buffer(lm, &b->ld, s),
+                               s->length, lm->hole + s->offset,
+                               (tag & ~0xffULL) | (s - lm->lm.slots));
+                if (r < 0)
+                    b->error = r;
+                else
+                    b->pending++;
+            }
+        }
+    } else {
+        const lm_slot_t *s = &lm->lm.slots[op];
+
+        r = batch_complete(b, res, load_buffer(lm, &b->ld, s), s->length,
+                           lm->hole + s->offset);
+        if (r < 0 && b->error == 0)
+            b->error = r;
+    }
+
+    if (b->pending == 0)
+        batch_finish(b);
+}
+
+/**
+ * Loads up to BATCH_DEVICES devices with all their reads on one ring.
+ *
+ * Returns zero or, if the ring failed, a negative errno value. The ring
+ * must then no longer be used and the batch state must not be freed, since
+ * the kernel may still complete reads into it.
+ */
+static int
+batch_load(uring_t *ring, batch_t *batch, luksmeta_batch_t items[], size_t n)
+{
+    uint64_t tag = 0;
+    ssize_t res = 0;
+    int r = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        batch_t *b = &batch[i];
+        luksmeta_t *lm = NULL;
+
+        memset(b, 0, sizeof(*b));
+        b->item = &items[i];
+        b->ld.slots = items[i].slots;
+        b->ld.nslots = items[i].nslots;
+        if (b->ld.nslots > LUKS_NSLOTS)
+            b->ld.nslots = LUKS_NSLOTS;
+
+        /* The token of a LUKSv2 device has already been read. */
+        if (luks2_supported(items[i].cd)) {
+            items[i].status = luksmeta_load_all(items[i].cd, items[i].slots,
+                                                b->ld.nslots);
+            continue;
+        }
+
+        lm = calloc(1, sizeof(*lm));
+        if (!lm) {
+            items[i].status = -errno;
+            continue;
+        }
+
+        lm->cd = items[i].cd;
+        lm->fd = open_hole(lm->cd, O_RDONLY, &lm->hole, &lm->length);
+        if (lm->fd < 0) {
+            items[i].status = lm->fd;
+            free(lm);
+            continue;
+        }
+
+        b->lm = lm;
+        if (lm->length < sizeof(lm_t))
+            r = -ENOENT;
+        else
+            r = uring_read(ring, lm->fd, b->buf,
+                           lm->length < LM_HEADERS ? lm->length : LM_HEADERS,
+                           lm->hole, (uint64_t) i << 8 | BATCH_HEADER);
+        if (r < 0) {
+            b->error = r;
+            batch_finish(b);
+            continue;
+        }
+
+        b->pending++;
+    }
+
+    while ((r = uring_wait(ring, &tag, &res)) == 0)
+        batch_read(ring, batch, tag, res);
+
+    if (r == -ENOENT)
+        return 0;
+
+    /*
+     * Interruptions are retried, so the ring only fails if the kernel
+     * rejects it (for instance with -EAGAIN or -ENOMEM). Which reads were
+     * submitted is unknown, so the devices still waiting are read again.
+     */
+    for (size_t i = 0; i < n; i++) {
+        if (batch[i].lm)
+            batch_abandon(&batch[i]);
+    }
+
+    return r;
+}
+
+int
+luksmeta_load_batch(luksmeta_batch_t batch[], size_t n)
+{
+    uring_t *ring = NULL;
+    batch_t *state = NULL;
+    int count = 0;
+
+    /*
+     * Each device has either its header read or the reads of its slots in
+     * flight, so a ring with room for all slots of each device never fills.
+     */
+    if (n > 0 && uring_open(&ring, BATCH_DEVICES * LUKS_NSLOTS) == 0)
+        state = calloc(BATCH_DEVICES, sizeof(*state));
+
+    for (size_t i = 0; i < n; i += BATCH_DEVICES) {
+        size_t m = n - i < BATCH_DEVICES ? n - i : BATCH_DEVICES;
+
+        if (state) {
+            /* After a failure, the rest is read without io_uring. */
+            if (batch_load(ring, state, &batch[i], m) < 0) {
+                uring_close(ring);
+                ring = NULL;
+                state = NULL;
+            }
+
+            continue;
+        }
+
+        for (size_t j = i; j < i + m; j++) {
+            batch[j].status = luksmeta_load_all(batch[j].cd, batch[j].slots,
+                                                batch[j].nslots);
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (batch[i].status >= 0)
+            count++;
+    }
+
+    uring_close(ring);
+    free(state);
+    return count;
+}
+
+void
+luksmeta_cache_enable(int enable)
+{
+    pthread_mutex_lock(&cache_mutex);
+    if (enable && !cache_on)
+        memset(&cache_stats, 0, sizeof(cache_stats));
+
+    cache_on = enable;
+    while (!cache_on && cache_list) {
+        cache_t *c = cache_list;
+
+        cache_list = c->next;
+        free(c);
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+void
+luksmeta_cache_stats(luksmeta_cache_stats_t *stats)
+{
+    pthread_mutex_lock(&cache_mutex);
+    *stats = cache_stats;
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+/**
+ * Moves the data of a slot to a new offset and commits the move.
+ *
+ * The data is first copied to the new location, which must not overlap the
+ * old one, and flushed. Then the header is updated to point at the copy.
+ * Only then are the parts of the old extent no longer in use zeroed. At no
+ * point does the header on disk reference incomplete data.
+ */
+static int
+move_slot(luksmeta_t *lm, int slot, uint32_t offset, uint8_t *buf)
+{
+    lm_t tmp = lm->lm;
+    lm_slot_t *s = &tmp.slots[slot];
+    uint32_t oend = s->offset + s->length;
+    uint32_t nend = offset + s->length;
+    uint32_t old = s->offset;
+    ssize_t r = 0;
+
+    r = readall(lm->fd, buf, s->length, lm->hole + old);
+    if (r < 0)
+        return r;
+
+    r = writeall(lm->fd, buf, s->length, lm->hole + offset);
+    if (r < 0)
+        return r;
+
+    r = flush(lm->fd);
+    if (r < 0)
+        return r;
+
+    s->offset = offset;
+    r = commit(lm, &tmp);
+    if (r < 0)
+        return r;
+
+    r = settle(lm);
+    if (r < 0)
+        return r;
+
+    /* Zero whatever part of the old extent the new one does not cover. */
+    if (old < offset) {
+        uint32_t end = oend < offset ? oend : offset;
+        r = zero_write(lm->fd, lm->hole + old, end - old);
+    }
+
+    if (r >= 0 && nend < oend) {
+        uint32_t start = nend > old ? nend : old;
+        r = zero_write(lm->fd, lm->hole + start, oend - start);
+    }
+
+    return r < 0 ? r : 0;
+}
+
+int
+luksmeta_handle_compact(luksmeta_t *lm, uint64_t *moved)
+{
+    const lm_slot_t *used[LM_MAX_EXTENTS] = {};
+    uint32_t pos = first_offset(&lm->lm);
+    uint32_t max = 0;
+    uint8_t *buf = NULL;
+    uint64_t total = 0;
+    size_t n = 0;
+    int r = 0;
+
+    if (lm->luks2)
+        return -ENOTSUP;
+
+    for (int i = 0; i < LUKS_NSLOTS; i++) {
+        if (lm->lm.slots[i].length > max)
+            max = lm->lm.slots[i].length;
+    }
+
+    n = find_used(&lm->lm, lm->entries, lm->nentries, used);
+
+    buf = malloc(max > 0 ? max : 1);
+    if (!buf)
+        return -errno;
+
+    /*
+     * Slide each slot down to the end of the previous extent. The entry
+     * table and the entries stay where they are.
+     */
+    for (size_t i = 0; i < n; i++) {
+        const lm_slot_t *s = used[i];
+        uint32_t size = ROUNDUP(s->length, grain(&lm->lm));
+        int slot = -1;
+
+        for (int j = 0; j < LUKS_NSLOTS; j++) {
+            if (s == &lm->lm.slots[j])
+                slot = j;
+        }
+
+        if (slot >= 0 && s->offset > pos) {
+            /* If the extents overlap, bounce through free space. */
+            if (pos + size > s->offset) {
+                uint32_t bounce;
+
+                bounce = find_gap(&lm->lm, lm->entries, lm->nentries,
+                                  lm->length, s->length,
+                                  LUKSMETA_SAVE_WORST_FIT);
+                if (bounce < first_offset(&lm->lm)) {
+                    pos = ROUNDUP(s->offset + s->length, grain(&lm->lm));
+                    continue;
+                }
+
+                r = move_slot(lm, slot, bounce, buf);
+                if (r < 0)
+                    goto egress;
+                total += s->length;
+            }
+
+            r = move_slot(lm, slot, pos, buf);
+            if (r < 0)
+                goto egress;
+            total += s->length;
+        }
+
+        pos = ROUNDUP(s->offset + s->length, grain(&lm->lm));
+    }
+
+    r = flush(lm->fd);
+
+egress:
+    memset(buf, 0, max);
+    free(buf);
+    if (moved)
+        *moved = total;
+    return r;
+}
+
+int
+luksmeta_handle_upgrade(luksmeta_t *lm, int version)
+{
+    lm_t tmp = lm->lm;
+    uint8_t *buf = NULL;
+    uint32_t max = 0;
+    int r = 0;
+
+    switch (version) {
+    case LUKSMETA_VERSION_1: break;
+    case LUKSMETA_VERSION_2: break;
+    case LUKSMETA_VERSION_3: break;
+    case LUKSMETA_VERSION_4: break;
+    default: return -EINVAL;
+    }
+
+    if (lm->luks2)
+        return -ENOTSUP;
+
+    if (version == (int) tmp.version)
+        return -EALREADY;
+
+    if (version < (int) tmp.version)
+        return -EINVAL;
+
+    tmp.version = version;
+    if (lm->length < first_offset(&tmp))
+        return -ENOSPC;
+
+    for (int i = 0; i < LUKS_NSLOTS; i++) {
+        if (lm->lm.slots[i].length > max)
+            max = lm->lm.slots[i].length;
+    }
+
+    buf = malloc(max > 0 ? max : 1);
+    if (!buf)
+        return -errno;
+
+    /*
+     * Any valid layout is also valid in the newer, finer-grained ones,
+     * except that they may reserve more room for the header. Move any
+     * slots which are in the way first.
+     */
+    for (int i = 0; i < LUKS_NSLOTS; i++) {
+        const lm_slot_t *s = &lm->lm.slots[i];
+        uint32_t offset;
+
+        if (uuid_is_zero(s->uuid) || s->offset >= first_offset(&tmp))
+            continue;
+
+        tmp = lm->lm;
+        tmp.version = version;
+        offset = find_gap(&tmp, lm->entries, lm->nentries, lm->length,
+                          s->length, LUKSMETA_SAVE_FIRST_FIT);
+        if (offset < first_offset(&tmp)) {
+            r = -ENOSPC;
+            goto egress;
+        }
+
+        r = move_slot(lm, i, offset, buf);
+        if (r < 0)
+            goto egress;
+    }
+
+    tmp = lm->lm;
+    tmp.version = version;
+    tmp.generation = 0;
+
+    if (version >= LUKSMETA_VERSION_3) {
+        r = write_headers(lm->fd, lm->hole, &tmp);
+        if (r == 0)
+            lm->lm = tmp;
+    } else {
+        r = commit(lm, &tmp);
+    }
+
+egress:
+    memset(buf, 0, max);
+    free(buf);
+    return r;
+}
+
+int
+luksmeta_handle_wipe(luksmeta_t *lm, int slot, const luksmeta_uuid_t uuid)
+{
+    lm_slot_t *s = NULL;
+    lm_t tmp = {};
+    ssize_t r = 0;
+
+    if (slot < 0 || slot >= LUKS_NSLOTS)
+        return -EBADSLT;
+
+    if (lm->luks2 && !lm->rdonly) {
+        r = refresh_luks2(lm);
+        if (r < 0)
+            return r;
+    }
+
+    tmp = lm->lm;
+    s = &tmp.slots[slot];
+
+    if (uuid_is_zero(s->uuid))
+        return -EALREADY;
+
+    if (uuid && memcmp(uuid, s->uuid, sizeof(luksmeta_uuid_t)) != 0)
+        return -EKEYREJECTED;
+
+    if (lm->luks2)
+        return store_luks2(lm, slot, NULL, NULL, 0);
+
+    /* Overwrite the data in place; discarding the blocks is not enough. */
+    r = zero_write(lm->fd, lm->hole + s->offset, s->length);
+    if (r < 0)
+        return r;
 
-        r = readall(fd, buf, s->length);
-        if (r < 0)
-            goto error;
+    r = flush(lm->fd);
+    if (r < 0)
+        return r;
 
-        r = crc32c(0, buf, s->length) == s->crc32c ? 0 : -EINVAL;
-        if (r < 0)
-            goto error;
+    memset(s, 0, sizeof(lm_slot_t));
+    return commit(lm, &tmp);
+}
+
+int
+luksmeta_handle_find(luksmeta_t *lm, const luksmeta_uuid_t uuid,
+                     int slots[], size_t n)
+{
+    size_t c = 0;
+
+    if (uuid_is_zero(uuid))
+        return -EKEYREJECTED;
+
+    for (int i = 0; i < LUKS_NSLOTS; i++) {
+        if (memcmp(lm->lm.slots[i].uuid, uuid, sizeof(luksmeta_uuid_t)) != 0)
+            continue;
+
+        if (c < n)
+            slots[c] = i;
+
+        c++;
     }
 
-    memcpy(uuid, s->uuid, sizeof(luksmeta_uuid_t));
-    close(fd);
-    return s->length;
+    return c;
+}
 
-error:
-    close(fd);
+int
+luksmeta_handle_stamp(luksmeta_t *lm, uint64_t *stamp)
+{
+    lm_t tmp = lm->lm;
+    uint32_t crc = 0;
+
+    if (lm->luks2) {
+        for (int i = 0; i < LUKS_NSLOTS; i++) {
+            const luks2_slot_t *s = &lm->data[i];
+
+            crc = crc32c(crc, s->uuid, sizeof(s->uuid));
+            crc = crc32c(crc, s->data, s->size);
+        }
+
+        *stamp = crc;
+        return 0;
+    }
+
+    /*
+     * The header covers the checksums of all slots and of the entry table,
+     * so it changes whenever any of them does.
+     */
+    tmp.crc32c = 0;
+    *stamp = lm->lm.generation << 32 |
+             crc32c(0, &tmp, header_size(lm->lm.version));
+    return 0;
+}
+
+/**
+ * Looks up an entry with a binary search.
+ *
+ * Returns the index of the entry or, if there is none, -(i + 1) where i is
+ * the index at which it would have to be inserted.
+ */
+static ssize_t
+find_entry(const luksmeta_t *lm, uint32_t keyslot, const luksmeta_uuid_t uuid)
+{
+    size_t lo = 0;
+    size_t hi = lm->nentries;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int c = cmp_entry(&lm->entries[mid], keyslot, uuid);
+
+        if (c == 0)
+            return mid;
+
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return -(ssize_t) lo - 1;
+}
+
+/**
+ * Writes a new entry table to free space and points tmp at it.
+ *
+ * The old table is still referenced by tmp while searching for space, so it
+ * is not overwritten. The table is not flushed.
+ */
+static int
+write_table(luksmeta_t *lm, lm_t *tmp, const lm_entry_t *entries, size_t n)
+{
+    lm_entry_t table[LM_MAX_ENTRIES] = {};
+    uint32_t size = n * sizeof(lm_entry_t);
+    uint32_t offset = 0;
+    ssize_t r = 0;
+
+    memset(&tmp->table, 0, sizeof(tmp->table));
+    if (n == 0)
+        return 0;
+
+    for (size_t i = 0; i < n; i++) {
+        table[i] = entries[i];
+        table[i].slot.offset = htobe32(entries[i].slot.offset);
+        table[i].slot.length = htobe32(entries[i].slot.length);
+        table[i].slot.crc32c = htobe32(entries[i].slot.crc32c);
+        table[i].slot.flags = htobe32(entries[i].slot.flags);
+        table[i].keyslot = htobe32(entries[i].keyslot);
+    }
+
+    offset = find_gap(&lm->lm, entries, n, lm->length, size,
+                      LUKSMETA_SAVE_FIRST_FIT);
+    if (offset < first_offset(tmp))
+        return -ENOSPC;
+
+    r = writeall(lm->fd, table, size, lm->hole + offset);
+    if (r < 0)
+        return r;
+
+    tmp->table.offset = offset;
+    tmp->table.length = size;
+    tmp->table.crc32c = crc32c(0, table, size);
+    return 0;
+}
+
+/**
+ * Commits a new entry table along with the header referencing it.
+ *
+ * The previous table is free once this returns, so the header is settled.
+ */
+static int
+commit_table(luksmeta_t *lm, const lm_entry_t *entries, size_t n)
+{
+    lm_t tmp = lm->lm;
+    int r = 0;
+
+    r = write_table(lm, &tmp, entries, n);
+    if (r < 0)
+        return r;
+
+    r = flush(lm->fd);
+    if (r < 0)
+        return r;
+
+    r = commit(lm, &tmp);
+    if (r < 0)
+        return r;
+
+    memmove(lm->entries, entries, n * sizeof(lm_entry_t));
+    lm->nentries = n;
+    return settle(lm);
+}
+
+int
+luksmeta_handle_entry_save(luksmeta_t *lm, int keyslot,
+                           const luksmeta_uuid_t uuid,
+                           const void *buf, size_t size, int flags)
+{
+    lm_entry_t entries[LM_MAX_ENTRIES] = {};
+    lm_entry_t *e = NULL;
+    ssize_t i = 0;
+    ssize_t r = 0;
+
+    if (!valid_save_flags(flags))
+        return -EINVAL;
+
+    if (lm->lm.version < LUKSMETA_VERSION_4)
+        return -ENOTSUP;
+
+    if (keyslot < 0 || keyslot >= LUKS_NSLOTS)
+        return -EBADSLT;
+
+    if (uuid_is_zero(uuid))
+        return -EKEYREJECTED;
+
+    i = find_entry(lm, keyslot, uuid);
+    if (i >= 0)
+        return -EALREADY;
+    i = -i - 1;
+
+    if (lm->nentries >= LM_MAX_ENTRIES)
+        return -ENOSPC;
+
+    memcpy(entries, lm->entries, i * sizeof(lm_entry_t));
+    memcpy(&entries[i + 1], &lm->entries[i],
+           (lm->nentries - i) * sizeof(lm_entry_t));
+
+    e = &entries[i];
+    memcpy(e->slot.uuid, uuid, sizeof(luksmeta_uuid_t));
+    e->keyslot = keyslot;
+
+    r = place(lm, &lm->lm, lm->entries, lm->nentries, &e->slot,
+              buf, size, flags);
+    if (r < 0)
+        return r;
+
+    return commit_table(lm, entries, lm->nentries + 1);
+}
+
+int
+luksmeta_handle_entry_load(luksmeta_t *lm, int keyslot,
+                           const luksmeta_uuid_t uuid, void *buf, size_t size)
+{
+    ssize_t i = 0;
+
+    if (keyslot < 0 || keyslot >= LUKS_NSLOTS)
+        return -EBADSLT;
+
+    i = find_entry(lm, keyslot, uuid);
+    if (i < 0)
+        return -ENODATA;
+
+    return read_slot(lm, &lm->entries[i].slot, buf, size);
+}
+
+int
+luksmeta_handle_entry_wipe(luksmeta_t *lm, int keyslot,
+                           const luksmeta_uuid_t uuid)
+{
+    lm_entry_t entries[LM_MAX_ENTRIES] = {};
+    const lm_slot_t *s = NULL;
+    ssize_t i = 0;
+    ssize_t r = 0;
+
+    if (keyslot < 0 || keyslot >= LUKS_NSLOTS)
+        return -EBADSLT;
+
+    i = find_entry(lm, keyslot, uuid);
+    if (i < 0)
+        return -EALREADY;
+    s = &lm->entries[i].slot;
+
+    /* Overwrite the data in place; discarding the blocks is not enough. */
+    r = zero_write(lm->fd, lm->hole + s->offset, s->length);
+    if (r < 0)
+        return r;
+
+    memcpy(entries, lm->entries, i * sizeof(lm_entry_t));
+    memcpy(&entries[i], &lm->entries[i + 1],
+           (lm->nentries - i - 1) * sizeof(lm_entry_t));
+
+    return commit_table(lm, entries, lm->nentries - 1);
+}
+
+int
+luksmeta_handle_entry_list(luksmeta_t *lm, int keyslot,
+                           luksmeta_uuid_t uuids[], size_t n)
+{
+    ssize_t i = 0;
+    size_t c = 0;
+
+    if (keyslot < 0 || keyslot >= LUKS_NSLOTS)
+        return -EBADSLT;
+
+    /* The zero UUID sorts before all others, so this finds the first one. */
+    i = find_entry(lm, keyslot, (luksmeta_uuid_t) {});
+    for (i = i < 0 ? -i - 1 : i; (size_t) i < lm->nentries; i++) {
+        const lm_entry_t *e = &lm->entries[i];
+
+        if (e->keyslot != (uint32_t) keyslot)
+            break;
+
+        if (c < n)
+            memcpy(uuids[c], e->slot.uuid, sizeof(luksmeta_uuid_t));
+
+        c++;
+    }
+
+    return c;
+}
+
+int
+luksmeta_load(struct crypt_device *cd, int slot,
+              luksmeta_uuid_t uuid, void *buf, size_t size)
+{
+    luksmeta_t *lm = NULL;
+    int r = 0;
+
+    if (slot < 0 || slot >= LUKS_NSLOTS)
+        return -EBADSLT;
+
+    r = luksmeta_open(cd, O_RDONLY, &lm);
+    if (r < 0)
+        return r;
+
+    r = luksmeta_handle_load(lm, slot, uuid, buf, size);
+    luksmeta_close(lm);
+    return r;
+}
+
+int
+luksmeta_load_all(struct crypt_device *cd,
+                  luksmeta_slot_t slots[], size_t nslots)
+{
+    luksmeta_t *lm = NULL;
+    int r = 0;
+
+    r = luksmeta_open(cd, O_RDONLY, &lm);
+    if (r < 0)
+        return r;
+
+    r = luksmeta_handle_load_all(lm, slots, nslots);
+    luksmeta_close(lm);
     return r;
 }
 
@@ -402,113 +3100,178 @@ int
 luksmeta_save(struct crypt_device *cd, int slot,
               const luksmeta_uuid_t uuid, const void *buf, size_t size)
 {
-    uint32_t length = 0;
-    lm_slot_t *s = NULL;
-    lm_t lm = {};
-    int fd = -1;
+    luksmeta_t *lm = NULL;
     int r = 0;
-    off_t off;
 
     if (uuid_is_zero(uuid))
         return -EKEYREJECTED;
 
-    fd = read_header(cd, O_RDWR | O_SYNC, &length, &lm);
-    if (fd < 0)
-        return fd;
+    r = luksmeta_open(cd, O_RDWR, &lm);
+    if (r < 0)
+        return r;
 
-    if (slot == CRYPT_ANY_SLOT)
-        slot = find_unused_slot(cd, &lm);
+    r = luksmeta_handle_save(lm, slot, uuid, buf, size,
+                             LUKSMETA_SAVE_FIRST_FIT);
+    return close_flushed(lm, r);
+}
 
-    r = slot >= 0 && slot < LUKS_NSLOTS ? 0 : -EBADSLT;
-    if (r < 0)
-        goto error;
-    s = &lm.slots[slot];
+int
+luksmeta_update(struct crypt_device *cd, int slot,
+                const luksmeta_uuid_t uuid, const void *buf, size_t size)
+{
+    luksmeta_t *lm = NULL;
+    int r = 0;
 
-    r = uuid_is_zero(s->uuid) ? 0 : -EALREADY;
-    if (r < 0)
-        goto error;
+    if (slot < 0 || slot >= LUKS_NSLOTS)
+        return -EBADSLT;
 
-    s->offset = find_gap(&lm, length, size);
-    r = s->offset >= ALIGN(sizeof(lm), true) ? 0 : -ENOSPC;
+    r = luksmeta_open(cd, O_RDWR, &lm);
     if (r < 0)
-        goto error;
+        return r;
 
-    memcpy(s->uuid, uuid, sizeof(luksmeta_uuid_t));
-    s->length = size;
-    s->crc32c = crc32c(0, buf, size);
+    r = luksmeta_handle_update(lm, slot, uuid, buf, size,
+                               LUKSMETA_SAVE_FIRST_FIT);
+    return close_flushed(lm, r);
+}
 
-    off = s->offset - sizeof(lm);
-    r = lseek(fd, off, SEEK_CUR) == -1 ? -errno : 0;
-    if (r < 0)
-        goto error;
+int
+luksmeta_compact(struct crypt_device *cd, uint64_t *moved)
+{
+    luksmeta_t *lm = NULL;
+    int r = 0;
 
-    r = writeall(fd, buf, size);
+    r = luksmeta_open(cd, O_RDWR, &lm);
     if (r < 0)
-        goto error;
+        return r;
 
-    off = s->offset + s->length;
-    r = lseek(fd, -off, SEEK_CUR) == -1 ? -errno : 0;
+    r = luksmeta_handle_compact(lm, moved);
+    return close_flushed(lm, r);
+}
+
+int
+luksmeta_version(struct crypt_device *cd)
+{
+    luksmeta_t *lm = NULL;
+    int r = 0;
+
+    r = luksmeta_open(cd, O_RDONLY, &lm);
     if (r < 0)
-        goto error;
+        return r;
+
+    r = lm->luks2 ? -ENOTSUP : (int) lm->lm.version;
+    luksmeta_close(lm);
+    return r;
+}
 
-    r = write_header(fd, lm);
+int
+luksmeta_upgrade(struct crypt_device *cd, int version)
+{
+    luksmeta_t *lm = NULL;
+    int r = 0;
 
-error:
-    close(fd);
-    return r < 0 ? r : slot;
+    r = luksmeta_open(cd, O_RDWR, &lm);
+    if (r < 0)
+        return r;
+
+    r = luksmeta_handle_upgrade(lm, version);
+    return close_flushed(lm, r);
 }
 
 int
 luksmeta_wipe(struct crypt_device *cd, int slot, const luksmeta_uuid_t uuid)
 {
-    uint8_t *zero = NULL;
-    uint32_t length = 0;
-    lm_slot_t *s = NULL;
-    lm_t lm = {};
-    int fd = -1;
+    luksmeta_t *lm = NULL;
     int r = 0;
-    off_t off;
 
     if (slot < 0 || slot >= LUKS_NSLOTS)
         return -EBADSLT;
-    s = &lm.slots[slot];
-
-    fd = read_header(cd, O_RDWR | O_SYNC, &length, &lm);
-    if (fd < 0)
-        return fd;
 
-    r = uuid_is_zero(s->uuid) ? -EALREADY : 0;
+    r = luksmeta_open(cd, O_RDWR, &lm);
     if (r < 0)
-        goto error;
+        return r;
 
-    if (uuid && memcmp(uuid, s->uuid, sizeof(luksmeta_uuid_t)) != 0) {
-        r = -EKEYREJECTED;
-        goto error;
-    }
+    r = luksmeta_handle_wipe(lm, slot, uuid);
+    return close_flushed(lm, r);
+}
+
+int
+luksmeta_find(struct crypt_device *cd, const luksmeta_uuid_t uuid,
+              int slots[], size_t n)
+{
+    luksmeta_t *lm = NULL;
+    int r = 0;
 
-    off = s->offset - sizeof(lm_t);
-    r = lseek(fd, off, SEEK_CUR) == -1 ? -errno : 0;
+    if (uuid_is_zero(uuid))
+        return -EKEYREJECTED;
+
+    r = luksmeta_open(cd, O_RDONLY, &lm);
     if (r < 0)
-        goto error;
+        return r;
+
+    r = luksmeta_handle_find(lm, uuid, slots, n);
+    luksmeta_close(lm);
+    return r;
+}
+
+int
+luksmeta_entry_save(struct crypt_device *cd, int keyslot,
+                    const luksmeta_uuid_t uuid, const void *buf, size_t size)
+{
+    luksmeta_t *lm = NULL;
+    int r = 0;
 
-    r = (zero = calloc(1, s->length)) ? 0 : -errno;
+    r = luksmeta_open(cd, O_RDWR, &lm);
     if (r < 0)
-        goto error;
+        return r;
+
+    r = luksmeta_handle_entry_save(lm, keyslot, uuid, buf, size,
+                                   LUKSMETA_SAVE_FIRST_FIT);
+    return close_flushed(lm, r);
+}
+
+int
+luksmeta_entry_load(struct crypt_device *cd, int keyslot,
+                    const luksmeta_uuid_t uuid, void *buf, size_t size)
+{
+    luksmeta_t *lm = NULL;
+    int r = 0;
 
-    r = writeall(fd, zero, s->length);
-    free(zero);
+    r = luksmeta_open(cd, O_RDONLY, &lm);
     if (r < 0)
-        goto error;
+        return r;
+
+    r = luksmeta_handle_entry_load(lm, keyslot, uuid, buf, size);
+    luksmeta_close(lm);
+    return r;
+}
+
+int
+luksmeta_entry_wipe(struct crypt_device *cd, int keyslot,
+                    const luksmeta_uuid_t uuid)
+{
+    luksmeta_t *lm = NULL;
+    int r = 0;
 
-    off = s->offset + s->length;
-    r = lseek(fd, -off, SEEK_CUR) == -1 ? -errno : 0;
+    r = luksmeta_open(cd, O_RDWR, &lm);
     if (r < 0)
-        goto error;
+        return r;
 
-    memset(s, 0, sizeof(lm_slot_t));
-    r = write_header(fd, lm);
+    r = luksmeta_handle_entry_wipe(lm, keyslot, uuid);
+    return close_flushed(lm, r);
+}
 
-error:
-    close(fd);
-    return r < 0 ? r : 0;
+int
+luksmeta_entry_list(struct crypt_device *cd, int keyslot,
+                    luksmeta_uuid_t uuids[], size_t n)
+{
+    luksmeta_t *lm = NULL;
+    int r = 0;
+
+    r = luksmeta_open(cd, O_RDONLY, &lm);
+    if (r < 0)
+        return r;
+
+    r = luksmeta_handle_entry_list(lm, keyslot, uuids, n);
+    luksmeta_close(lm);
+    return r;
 }
@@ -0,0 +1,128 @@
+/* vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab smarttab colorcolumn=80: */
+/*
+ * Copyright (c) 2016 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "lmd.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Waits for events on the socket until the deadline. Returns zero or -errno. */
+static int
+lmd_wait(int fd, short events, const struct timespec *deadline)
+{
+    struct pollfd pfd = { .fd = fd, .events = events };
+    struct timespec now = {};
+    int64_t ms = 0;
+    int r = 0;
+
+    if (!deadline)
+        return 0;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+        return -errno;
+
+    ms = (deadline->tv_sec - now.tv_sec) * 1000;
+    ms += (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    if (ms <= 0)
+        return -ETIMEDOUT;
+
+    r = poll(&pfd, 1, ms);
+    if (r < 0)
+        return errno == EINTR ? 0 : -errno;
+
+    return r == 0 ? -ETIMEDOUT : 0;
+}
+
+int
+lmd_connect(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd = -1;
+    int r = 0;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -ENAMETOOLONG;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -errno;
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        r = -errno;
+        close(fd);
+        return r;
+    }
+
+    return fd;
+}
+
+int
+lmd_recv(int fd, void *buf, size_t size,
+         const struct timespec *deadline)
+{
+    int flags = deadline ? MSG_DONTWAIT : 0;
+    uint8_t *tmp = buf;
+
+    for (ssize_t r, t = 0; t < (ssize_t) size; t += r) {
+        r = lmd_wait(fd, POLLIN, deadline);
+        if (r < 0)
+            return r;
+
+        r = recv(fd, &tmp[t], size - t, flags);
+        if (r < 0) {
+            if (errno != EINTR && errno != EAGAIN)
+                return -errno;
+            r = 0;
+        } else if (r == 0) {
+            return -ECONNRESET;
+        }
+    }
+
+    return 0;
+}
+
+int
+lmd_send(int fd, const void *buf, size_t size,
+         const struct timespec *deadline)
+{
+    int flags = MSG_NOSIGNAL | (deadline ? MSG_DONTWAIT : 0);
+    const uint8_t *tmp = buf;
+
+    for (ssize_t r, t = 0; t < (ssize_t) size; t += r) {
+        r = lmd_wait(fd, POLLOUT, deadline);
+        if (r < 0)
+            return r;
+
+        r = send(fd, &tmp[t], size - t, flags);
+        if (r < 0) {
+            if (errno != EINTR && errno != EAGAIN)
+                return -errno;
+            r = 0;
+        }
+    }
+
+    return 0;
+}
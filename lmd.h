@@ -0,0 +1,86 @@
+/* vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab smarttab colorcolumn=80: */
+/*
+ * Copyright (c) 2016 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "luksmeta.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * The protocol spoken by luksmetad over its Unix socket. Both ends run on
+ * the same host, so all integers are in host byte order.
+ *
+ * A client sends any number of requests on a connection, waiting for the
+ * reply to each. A request is an lmd_request_t followed by pathlen bytes of
+ * device path (without a terminating NUL) and datalen bytes of data. A
+ * reply is an lmd_reply_t followed by datalen bytes of data.
+ */
+
+#define LMD_SOCKET "/run/luksmetad.sock"
+#define LMD_MAX_PATH 4096
+#define LMD_MAX_DATA (16 << 20)
+
+enum {
+    LMD_LOAD = 1, /* Data of a slot or, without one, of the first with uuid */
+    LMD_SHOW,     /* An lmd_slot_t for each slot */
+    LMD_FIND,     /* An int32_t slot number for each slot holding uuid */
+    LMD_SAVE,     /* Saves the data of the request with uuid */
+    LMD_WIPE,     /* Wipes a slot or, without one, all slots holding uuid */
+};
+
+typedef struct __attribute__((packed)) {
+    uint8_t op;           /* LMD_* */
+    int8_t slot;          /* Slot number or CRYPT_ANY_SLOT */
+    uint16_t pathlen;
+    uint32_t datalen;
+    luksmeta_uuid_t uuid; /* All zeroes if not given */
+} lmd_request_t;
+
+typedef struct __attribute__((packed)) {
+    int32_t status;       /* As returned by the library, or -errno */
+    uint32_t datalen;
+    luksmeta_uuid_t uuid; /* LMD_LOAD: the UUID of the slot */
+} lmd_reply_t;
+
+typedef struct __attribute__((packed)) {
+    luksmeta_uuid_t uuid;
+    int32_t status;       /* Metadata length or negative errno */
+    int32_t keyslot;      /* crypt_keyslot_info of the LUKS keyslot */
+} lmd_slot_t;
+
+/* Connects to the socket of the daemon. Returns the socket or -errno. */
+int
+lmd_connect(const char *path);
+
+/*
+ * Receives exactly size bytes. If deadline (on CLOCK_MONOTONIC) is not NULL,
+ * gives up with -ETIMEDOUT once it has passed, however the bytes trickle in.
+ * Returns zero, -ECONNRESET at EOF or -errno.
+ */
+int
+lmd_recv(int fd, void *buf, size_t size,
+         const struct timespec *deadline);
+
+/* Sends exactly size bytes, like lmd_recv(). Returns zero or -errno. */
+int
+lmd_send(int fd, const void *buf, size_t size,
+         const struct timespec *deadline);
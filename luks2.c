@@ -0,0 +1,524 @@
+/* vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab smarttab colorcolumn=80: */
+/*
+ * Copyright (c) 2016 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "luks2.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_LUKS2
+
+#define MAX_DEPTH 32 /* Nesting limit when skipping unknown JSON values */
+
+static const char *const LITERALS[] = { "true", "false", "null" };
+
+static const char B64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* Maps a base64 character to its value, or returns -1. */
+static int
+unb64(char c)
+{
+    const char *p = c ? strchr(B64, c) : NULL;
+    return p ? p - B64 : -1;
+}
+
+/* Maps a hex digit to its value, or returns -1. */
+static int
+unhex(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static void
+write_b64(FILE *f, const uint8_t *buf, size_t size)
+{
+    for (size_t i = 0; i < size; i += 3) {
+        uint32_t v = buf[i] << 16;
+
+        if (i + 1 < size)
+            v |= buf[i + 1] << 8;
+        if (i + 2 < size)
+            v |= buf[i + 2];
+
+        fputc(B64[v >> 18 & 63], f);
+        fputc(B64[v >> 12 & 63], f);
+        fputc(i + 1 < size ? B64[v >> 6 & 63] : '=', f);
+        fputc(i + 2 < size ? B64[v & 63] : '=', f);
+    }
+}
+
+/*
+ * Decodes base64 into a newly allocated buffer. Only the canonical encoding
+ * is accepted: padded, and with the unused bits of the last group zero.
+ */
+static int
+read_b64(const char *str, size_t len, uint8_t **buf, size_t *size)
+{
+    size_t pad = 0;
+    size_t n = 0;
+
+    if (len % 4 != 0)
+        return -EINVAL;
+
+    while (pad < 2 && pad < len && str[len - pad - 1] == '=')
+        pad++;
+
+    *size = len / 4 * 3 - pad;
+    *buf = malloc(*size > 0 ? *size : 1);
+    if (!*buf)
+        return -errno;
+
+    for (size_t i = 0; i < len; i += 4) {
+        uint32_t v = 0;
+
+        for (size_t j = 0; j < 4; j++) {
+            int c = i + j < len - pad ? unb64(str[i + j]) : 0;
+
+            if (c < 0)
+                goto error;
+
+            v = v << 6 | c;
+        }
+
+        if (i + 4 == len && (v & ((1 << pad * 8) - 1)) != 0)
+            goto error;
+
+        for (size_t j = 0; j < 3 && n < *size; j++)
+            (*buf)[n++] = v >> (16 - j * 8);
+    }
+
+    return 0;
+
+error:
+    free(*buf);
+    *buf = NULL;
+    return -EINVAL;
+}
+
+/* Parses the 8-4-4-4-12 form of a UUID. */
+static int
+read_uuid(const char *str, size_t len, uint8_t uuid[16])
+{
+    size_t n = 0;
+
+    if (len != 36)
+        return -EINVAL;
+
+    for (size_t i = 0; i < len; i += 2) {
+        int hi, lo;
+
+        if (i == 8 || i == 13 || i == 18 || i == 23) {
+            if (str[i++] != '-')
+                return -EINVAL;
+        }
+
+        hi = unhex(str[i]);
+        lo = unhex(str[i + 1]);
+        if (hi < 0 || lo < 0)
+            return -EINVAL;
+
+        uuid[n++] = hi << 4 | lo;
+    }
+
+    return 0;
+}
+
+/*
+ * A minimal JSON reader. It only understands the token layout above, but
+ * skips over any other members, which cryptsetup or other tools may add.
+ *
+ * The text comes from crypt_token_json_get(), so libcryptsetup has already
+ * parsed it with json-c when loading the header and printed it back out.
+ * The reader is strict anyway, and never reads past the terminating NUL
+ * or nests deeper than MAX_DEPTH.
+ */
+
+static const char *
+skip_ws(const char *p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+        p++;
+
+    return p;
+}
+
+/* Returns the end of the string at p and its (still escaped) contents. */
+static const char *
+parse_string(const char *p, const char **str, size_t *len)
+{
+    if (*p != '"')
+        return NULL;
+
+    *str = ++p;
+    for (; *p != '"'; p++) {
+        /* This includes the terminating NUL. */
+        if ((unsigned char) *p < 0x20)
+            return NULL;
+
+        if (*p != '\\')
+            continue;
+
+        if (*++p == 'u') {
+            for (int i = 0; i < 4; i++) {
+                if (unhex(*++p) < 0)
+                    return NULL;
+            }
+        } else if (*p == '\0' || !strchr("\"\\/bfnrt", *p)) {
+            return NULL;
+        }
+    }
+
+    *len = p - *str;
+    return p + 1;
+}
+
+typedef const char *(*member_f)(const char *key, size_t len, const char *p,
+                                void *ctx);
+
+static const char *skip_value(const char *p, int depth);
+
+/*
+ * Calls member() for each member of an object or, without a key, for each
+ * element of an array. The callback returns the end of the value.
+ */
+static const char *
+parse_container(const char *p, member_f member, void *ctx, int depth)
+{
+    char close = 0;
+
+    switch (*p) {
+    case '{': close = '}'; break;
+    case '[': close = ']'; break;
+    default: return NULL;
+    }
+
+    if (depth > MAX_DEPTH)
+        return NULL;
+
+    p = skip_ws(p + 1);
+    if (*p == close)
+        return p + 1;
+
+    for (;;) {
+        const char *key = NULL;
+        size_t len = 0;
+
+        if (close == '}') {
+            p = parse_string(p, &key, &len);
+            if (!p)
+                return NULL;
+
+            p = skip_ws(p);
+            if (*p++ != ':')
+                return NULL;
+        }
+
+        p = skip_ws(p);
+        p = member ? member(key, len, p, ctx) : skip_value(p, depth + 1);
+        if (!p)
+            return NULL;
+
+        p = skip_ws(p);
+        if (*p == close)
+            return p + 1;
+
+        if (*p++ != ',')
+            return NULL;
+
+        p = skip_ws(p);
+    }
+}
+
+static const char *
+skip_value(const char *p, int depth)
+{
+    const char *str = NULL;
+    char *end = NULL;
+    size_t len = 0;
+
+    switch (*p) {
+    case '"': return parse_string(p, &str, &len);
+    case '{': return parse_container(p, NULL, NULL, depth);
+    case '[': return parse_container(p, NULL, NULL, depth);
+    }
+
+    for (size_t i = 0; i < sizeof(LITERALS) / sizeof(*LITERALS); i++) {
+        len = strlen(LITERALS[i]);
+        if (strncmp(p, LITERALS[i], len) == 0)
+            return p + len;
+    }
+
+    /* Numbers; strtod() alone would also skip spaces and accept "inf". */
+    if (*p != '-' && (*p < '0' || *p > '9'))
+        return NULL;
+
+    strtod(p, &end);
+    return end > p ? end : NULL;
+}
+
+static bool
+is_key(const char *key, size_t len, const char *name)
+{
+    return len == strlen(name) && memcmp(key, name, len) == 0;
+}
+
+struct slot {
+    luks2_slot_t *slots;
+    size_t n;
+    long slot;
+    const char *uuid;
+    size_t uuidlen;
+    const char *data;
+    size_t datalen;
+    int err;
+};
+
+static const char *
+slot_member(const char *key, size_t len, const char *p, void *ctx)
+{
+    struct slot *s = ctx;
+    char *end = NULL;
+
+    if (is_key(key, len, "slot")) {
+        if (*p < '0' || *p > '9')
+            return NULL;
+
+        s->slot = strtol(p, &end, 10);
+        return end > p ? end : NULL;
+    }
+
+    if (is_key(key, len, "uuid"))
+        return parse_string(p, &s->uuid, &s->uuidlen);
+
+    if (is_key(key, len, "data"))
+        return parse_string(p, &s->data, &s->datalen);
+
+    return skip_value(p, 3);
+}
+
+static const char *
+slots_element(const char *key, size_t len, const char *p, void *ctx)
+{
+    struct slot *s = ctx;
+    luks2_slot_t *o = NULL;
+
+    s->slot = -1;
+    s->uuid = s->data = NULL;
+    p = parse_container(p, slot_member, s, 2);
+    if (!p)
+        return NULL;
+
+    if (s->slot < 0 || (size_t) s->slot >= s->n || !s->uuid || !s->data) {
+        s->err = -EINVAL;
+        return NULL;
+    }
+
+    o = &s->slots[s->slot];
+    if (o->data) {
+        s->err = -EINVAL;
+        return NULL;
+    }
+
+    s->err = read_uuid(s->uuid, s->uuidlen, o->uuid);
+    if (s->err == 0)
+        s->err = read_b64(s->data, s->datalen, &o->data, &o->size);
+
+    return s->err == 0 ? p : NULL;
+}
+
+static const char *
+token_member(const char *key, size_t len, const char *p, void *ctx)
+{
+    if (is_key(key, len, "slots") && *p == '[')
+        return parse_container(p, slots_element, ctx, 1);
+
+    return skip_value(p, 1);
+}
+
+bool
+luks2_supported(struct crypt_device *cd)
+{
+    const char *type = crypt_get_type(cd);
+    return type && strcmp(type, CRYPT_LUKS2) == 0;
+}
+
+int
+luks2_find(struct crypt_device *cd)
+{
+    for (int i = 0; i < crypt_token_max(CRYPT_LUKS2); i++) {
+        const char *type = NULL;
+
+        switch (crypt_token_status(cd, i, &type)) {
+        case CRYPT_TOKEN_EXTERNAL_UNKNOWN:
+        case CRYPT_TOKEN_EXTERNAL:
+            if (type && strcmp(type, LUKS2_TOKEN_TYPE) == 0)
+                return i;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    return -ENOENT;
+}
+
+int
+luks2_parse(const char *json, luks2_slot_t slots[], size_t n)
+{
+    struct slot s = { .slots = slots, .n = n };
+    const char *p = NULL;
+
+    memset(slots, 0, n * sizeof(*slots));
+    p = parse_container(skip_ws(json), token_member, &s, 0);
+    if (!p || *skip_ws(p) != '\0') {
+        luks2_free(slots, n);
+        return s.err < 0 ? s.err : -EINVAL;
+    }
+
+    return 0;
+}
+
+int
+luks2_read(struct crypt_device *cd, int token, luks2_slot_t slots[], size_t n)
+{
+    const char *json = NULL;
+    int r = 0;
+
+    r = crypt_token_json_get(cd, token, &json);
+    if (r < 0)
+        return r;
+
+    return luks2_parse(json, slots, n);
+}
+
+int
+luks2_write(struct crypt_device *cd, int token,
+            const luks2_slot_t slots[], size_t n)
+{
+    const char *sep = "";
+    size_t size = 0;
+    char *json = NULL;
+    FILE *f = NULL;
+    int r = 0;
+
+    f = open_memstream(&json, &size);
+    if (!f)
+        return -errno;
+
+    fprintf(f, "{\"type\":\"" LUKS2_TOKEN_TYPE "\",\"keyslots\":[],"
+            "\"slots\":[");
+
+    for (size_t i = 0; i < n; i++) {
+        const uint8_t *u = slots[i].uuid;
+
+        if (memcmp(u, (uint8_t[16]) {}, 16) == 0)
+            continue;
+
+        fprintf(f, "%s{\"slot\":%zu,\"uuid\":\"%02x%02x%02x%02x-%02x%02x-"
+                "%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x\",\"data\":\"",
+                sep, i, u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7],
+                u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+        write_b64(f, slots[i].data, slots[i].size);
+        fprintf(f, "\"}");
+        sep = ",";
+    }
+
+    fprintf(f, "]}");
+    if (fclose(f) != 0) {
+        free(json);
+        return -ENOMEM;
+    }
+
+    r = crypt_token_json_set(cd, token, json);
+    memset(json, 0, size);
+    free(json);
+    return r;
+}
+
+int
+luks2_remove(struct crypt_device *cd, int token)
+{
+    return crypt_token_json_set(cd, token, NULL);
+}
+
+#else
+
+int
+luks2_parse(const char *json, luks2_slot_t slots[], size_t n)
+{
+    return -ENOTSUP;
+}
+
+bool
+luks2_supported(struct crypt_device *cd)
+{
+    return false;
+}
+
+int
+luks2_find(struct crypt_device *cd)
+{
+    return -ENOTSUP;
+}
+
+int
+luks2_read(struct crypt_device *cd, int token, luks2_slot_t slots[], size_t n)
+{
+    return -ENOTSUP;
+}
+
+int
+luks2_write(struct crypt_device *cd, int token,
+            const luks2_slot_t slots[], size_t n)
+{
+    return -ENOTSUP;
+}
+
+int
+luks2_remove(struct crypt_device *cd, int token)
+{
+    return -ENOTSUP;
+}
+
+#endif
+
+void
+luks2_free(luks2_slot_t slots[], size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (slots[i].data) {
+            memset(slots[i].data, 0, slots[i].size);
+            free(slots[i].data);
+        }
+
+        memset(&slots[i], 0, sizeof(slots[i]));
+    }
+}
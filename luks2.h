@@ -0,0 +1,79 @@
+/* vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab smarttab colorcolumn=80: */
+/*
+ * Copyright (c) 2016 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <libcryptsetup.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * On LUKSv2 devices, all slots are kept in a single token of this type, so
+ * that they can be read with one JSON read:
+ *
+ *   {"type":"luksmeta","keyslots":[],
+ *    "slots":[{"slot":0,"uuid":"...","data":"<base64>"},...]}
+ */
+#define LUKS2_TOKEN_TYPE "luksmeta"
+
+/* A slot stored in the token. Empty slots have a zero UUID. */
+typedef struct {
+    uint8_t uuid[16];
+    uint8_t *data;
+    size_t size;
+} luks2_slot_t;
+
+/* Returns true for LUKSv2 devices, if LUKSv2 support is compiled in. */
+bool
+luks2_supported(struct crypt_device *cd);
+
+/* Returns the number of the luksmeta token or -ENOENT if there is none. */
+int
+luks2_find(struct crypt_device *cd);
+
+/*
+ * Parses the JSON of a token into n slots. Returns zero, -EINVAL if the
+ * token is malformed or another negative errno value.
+ */
+int
+luks2_parse(const char *json, luks2_slot_t slots[], size_t n);
+
+/*
+ * Reads and parses the given token into n slots. Returns zero, -EINVAL if
+ * the token is malformed or another negative errno value.
+ */
+int
+luks2_read(struct crypt_device *cd, int token, luks2_slot_t slots[], size_t n);
+
+/*
+ * Replaces the given token (or creates one if token is CRYPT_ANY_TOKEN)
+ * with n slots. Returns the token number or a negative errno value.
+ */
+int
+luks2_write(struct crypt_device *cd, int token,
+            const luks2_slot_t slots[], size_t n);
+
+/* Removes the given token. */
+int
+luks2_remove(struct crypt_device *cd, int token);
+
+/* Zeroes and frees the data of n slots. */
+void
+luks2_free(luks2_slot_t slots[], size_t n);
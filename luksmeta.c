@@ -17,15 +17,22 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "lmd.h"
 #include "luksmeta.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <unistd.h>
+
+#define LUKS_NSLOTS 8
 
 #define UUID_TMPL \
     "%02hhx%02hhx%02hhx%02hhx-" \
@@ -42,7 +49,13 @@ struct options {
     bool have_uuid;
     bool force;
     bool nuke;
+    bool packed;
+    bool compress;
     int slot;
+    int jobs;
+    bool json;
+    const char *from;
+    const char *socket;
 };
 
 #define LUKSMETA_LIBCRYPTSETUP_LOG_LEVEL CRYPT_LOG_ERROR
@@ -127,7 +140,8 @@ cmd_init(const struct options *opts, struct crypt_device *cd)
             return r;
     }
 
-    r = luksmeta_init(cd);
+    r = luksmeta_init_version(cd, opts->packed ? LUKSMETA_VERSION_3
+                                               : LUKSMETA_VERSION_1);
     switch (r) {
     case 0: /* fallthrough */
     case -EALREADY:
@@ -148,9 +162,9 @@ cmd_init(const struct options *opts, struct crypt_device *cd)
 }
 
 static const char *
-status(struct crypt_device *cd, int keyslot)
+keyslot_name(crypt_keyslot_info info)
 {
-    switch (crypt_keyslot_status(cd, keyslot)) {
+    switch (info) {
     case CRYPT_SLOT_INVALID: return "invalid";
     case CRYPT_SLOT_INACTIVE: return "inactive";
     case CRYPT_SLOT_ACTIVE: return "active";
@@ -159,6 +173,12 @@ status(struct crypt_device *cd, int keyslot)
     }
 }
 
+static const char *
+status(struct crypt_device *cd, int keyslot)
+{
+    return keyslot_name(crypt_keyslot_status(cd, keyslot));
+}
+
 static int
 cmd_show(const struct options *opts, struct crypt_device *cd)
 {
@@ -206,44 +226,74 @@ cmd_show(const struct options *opts, struct crypt_device *cd)
     return EX_OK;
 }
 
+/* Reads all of standard input. Returns EX_OK or an exit code. */
 static int
-cmd_save(const struct options *opts, struct crypt_device *cd)
+read_input(uint8_t **in, size_t *inl)
 {
-    uint8_t *in = NULL;
-    size_t inl = 0;
-    int r = 0;
-
-    if (!opts->have_uuid) {
-        fprintf(stderr, "UUID required\n");
-        return EX_USAGE;
-    }
+    *in = NULL;
+    *inl = 0;
 
     while (!feof(stdin)) {
         uint8_t *tmp = NULL;
+        size_t r = 0;
 
-        tmp = realloc(in, inl + 4096);
+        tmp = realloc(*in, *inl + 4096);
         if (!tmp) {
             fprintf(stderr, "Out of memory\n");
-            free(in);
+            free(*in);
             return EX_OSERR;
         }
 
-        in = tmp;
-        r = fread(&in[inl], 1, 4096, stdin);
-        inl += r;
-        if (r < 4096 && (ferror(stdin) || inl == 0)) {
+        *in = tmp;
+        r = fread(&(*in)[*inl], 1, 4096, stdin);
+        *inl += r;
+        if (r < 4096 && (ferror(stdin) || *inl == 0)) {
             fprintf(stderr, "Error reading from standard input\n");
-            free(in);
+            free(*in);
             return EX_NOINPUT;
         }
     }
 
-    if (!in) {
+    if (!*in) {
         fprintf(stderr, "No data on standard input\n");
         return EX_NOINPUT;
     }
 
-    r = luksmeta_save(cd, opts->slot, opts->uuid, in, inl);
+    return EX_OK;
+}
+
+static int
+cmd_save(const struct options *opts, struct crypt_device *cd)
+{
+    uint8_t *in = NULL;
+    size_t inl = 0;
+    int r = 0;
+
+    if (!opts->have_uuid) {
+        fprintf(stderr, "UUID required\n");
+        return EX_USAGE;
+    }
+
+    r = read_input(&in, &inl);
+    if (r != EX_OK)
+        return r;
+
+    if (opts->compress) {
+        luksmeta_t *lm = NULL;
+
+        r = luksmeta_open(cd, O_RDWR, &lm);
+        if (r == 0)
+            r = luksmeta_handle_save(lm, opts->slot, opts->uuid, in, inl,
+                                     LUKSMETA_SAVE_COMPRESS);
+        if (r >= 0) {
+            int f = luksmeta_flush(lm);
+            r = f < 0 ? f : r;
+        }
+        luksmeta_close(lm);
+    } else {
+        r = luksmeta_save(cd, opts->slot, opts->uuid, in, inl);
+    }
+
     memset(in, 0, inl);
     free(in);
     switch (r) {
@@ -287,14 +337,30 @@ static int
 cmd_load(const struct options *opts, struct crypt_device *cd)
 {
     luksmeta_uuid_t uuid = {};
+    luksmeta_t *lm = NULL;
+    int slot = opts->slot;
     int r = 0;
 
-    if (opts->slot < 0) {
-        fprintf(stderr, "Slot required\n");
+    if (slot < 0 && !opts->have_uuid) {
+        fprintf(stderr, "Slot or UUID required\n");
         return EX_USAGE;
     }
 
-    r = luksmeta_load(cd, opts->slot, uuid, NULL, 0);
+    r = luksmeta_open(cd, O_RDONLY, &lm);
+
+    /* Without a slot, use the first slot holding the UUID. */
+    if (r >= 0 && slot < 0) {
+        r = luksmeta_handle_find(lm, opts->uuid, &slot, 1);
+        if (r == 0) {
+            fprintf(stderr, "No slot contains the given UUID (" UUID_TMPL
+                    ")\n", UUID_ARGS(opts->uuid));
+            luksmeta_close(lm);
+            return EX_UNAVAILABLE;
+        }
+    }
+
+    if (r >= 0)
+        r = luksmeta_handle_load(lm, slot, uuid, NULL, 0);
     if (r >= 0) {
         uint8_t *out = NULL;
 
@@ -305,16 +371,18 @@ cmd_load(const struct options *opts, struct crypt_device *cd)
                     "SLOT: " UUID_TMPL "\n",
                     UUID_ARGS(opts->uuid),
                     UUID_ARGS(uuid));
+            luksmeta_close(lm);
             return EX_DATAERR;
         }
 
         out = malloc(r);
         if (!out) {
             fprintf(stderr, "Out of memory!\n");
+            luksmeta_close(lm);
             return EX_OSERR;
         }
 
-        r = luksmeta_load(cd, opts->slot, uuid, out, r);
+        r = luksmeta_handle_load(lm, slot, uuid, out, r);
         if (r >= 0) {
             fwrite(out, 1, r, stdout);
             memset(out, 0, r);
@@ -323,6 +391,8 @@ cmd_load(const struct options *opts, struct crypt_device *cd)
         free(out);
     }
 
+    luksmeta_close(lm);
+
     switch (r) {
     case -ENOENT:
         fprintf(stderr, "Device is not initialized (%s)\n", opts->device);
@@ -333,11 +403,11 @@ cmd_load(const struct options *opts, struct crypt_device *cd)
         return EX_OSFILE;
 
     case -EBADSLT:
-        fprintf(stderr, "The specified slot is invalid (%d)\n", opts->slot);
+        fprintf(stderr, "The specified slot is invalid (%d)\n", slot);
         return EX_USAGE;
 
     case -ENODATA:
-        fprintf(stderr, "The specified slot is empty (%d)\n", opts->slot);
+        fprintf(stderr, "The specified slot is empty (%d)\n", slot);
         return EX_UNAVAILABLE;
 
     default:
@@ -348,35 +418,74 @@ cmd_load(const struct options *opts, struct crypt_device *cd)
     }
 }
 
+/* Wipes every slot holding the UUID, using a single handle. */
 static int
-cmd_wipe(const struct options *opts, struct crypt_device *cd)
+wipe_uuid(const struct options *opts, struct crypt_device *cd)
 {
-    luksmeta_uuid_t uuid = {};
+    luksmeta_t *lm = NULL;
+    int slot = 0;
     int r = 0;
 
-    if (opts->slot < 0) {
-        fprintf(stderr, "Slot required\n");
-        return EX_USAGE;
+    r = luksmeta_open(cd, O_RDWR, &lm);
+    while (r >= 0) {
+        r = luksmeta_handle_find(lm, opts->uuid, &slot, 1);
+        if (r <= 0)
+            break;
+
+        r = luksmeta_handle_wipe(lm, slot, opts->uuid);
     }
 
-    if (!opts->force) {
-        int c = 'X';
+    if (r == 0)
+        r = luksmeta_flush(lm);
+    luksmeta_close(lm);
+    return r;
+}
 
-        fprintf(stderr,
-            "You are about to wipe a slot. This operation is unrecoverable.\n"
-            "A backup is advised before proceeding.\n\n");
+/* Asks for confirmation before wiping, unless forced. */
+static bool
+confirm_wipe(const struct options *opts, const char *name)
+{
+    int c = 'X';
 
-        while (!strchr("YyNn", c)) {
+    if (opts->force)
+        return true;
+
+    fprintf(stderr,
+        "You are about to wipe a slot. This operation is unrecoverable.\n"
+        "A backup is advised before proceeding.\n\n");
+
+    while (!strchr("YyNn", c)) {
+        if (opts->slot < 0) {
+            fprintf(stderr, "Do you wish to erase all slots with UUID "
+                    UUID_TMPL " on %s? [yn] ", UUID_ARGS(opts->uuid), name);
+        } else {
             fprintf(stderr, "Do you wish to erase slot %d on %s? [yn] ",
-                    opts->slot, crypt_get_device_name(cd));
-            c = getc(stdin);
+                    opts->slot, name);
         }
+        c = getc(stdin);
+    }
 
-        if (strchr("Nn", c))
-            return EX_NOPERM;
+    return !strchr("Nn", c);
+}
+
+static int
+cmd_wipe(const struct options *opts, struct crypt_device *cd)
+{
+    luksmeta_uuid_t uuid = {};
+    int r = 0;
+
+    if (opts->slot < 0 && !opts->have_uuid) {
+        fprintf(stderr, "Slot or UUID required\n");
+        return EX_USAGE;
     }
 
-    r = luksmeta_wipe(cd, opts->slot, opts->have_uuid ? opts->uuid : NULL);
+    if (!confirm_wipe(opts, crypt_get_device_name(cd)))
+        return EX_NOPERM;
+
+    if (opts->slot < 0)
+        r = wipe_uuid(opts, cd);
+    else
+        r = luksmeta_wipe(cd, opts->slot, opts->have_uuid ? opts->uuid : NULL);
     switch (r) {
     case -EALREADY:
         return EX_OK;
@@ -419,17 +528,623 @@ cmd_wipe(const struct options *opts, struct crypt_device *cd)
     }
 }
 
-static const char *sopts = "hfnd:u:s:";
+static int
+cmd_compact(const struct options *opts, struct crypt_device *cd)
+{
+    uint64_t moved = 0;
+    int r = 0;
+
+    r = luksmeta_compact(cd, &moved);
+    switch (r) {
+    case -ENOENT:
+        fprintf(stderr, "Device is not initialized (%s)\n", opts->device);
+        return EX_OSFILE;
+
+    case -EINVAL:
+        fprintf(stderr, "LUKSMeta data appears corrupt (%s)\n", opts->device);
+        return EX_OSFILE;
+
+    default:
+        if (r < 0) {
+            fprintf(stderr, "An unknown error occurred\n");
+            return EX_OSERR;
+        }
+
+        fprintf(stdout, "%" PRIu64 "\n", moved);
+        return EX_OK;
+    }
+}
+
+static int
+cmd_upgrade(const struct options *opts, struct crypt_device *cd)
+{
+    int r = 0;
+
+    /* Newer layouts are packed already and cannot be upgraded to 3. */
+    r = luksmeta_version(cd);
+    if (r >= 0 && r < LUKSMETA_VERSION_3 && !opts->force) {
+        int c = 'X';
+
+        fprintf(stderr,
+            "You are about to convert the LUKSMeta storage to the packed\n"
+            "layout. Older versions of luksmeta cannot read this layout.\n"
+            "A backup is advised before proceeding.\n\n");
+
+        while (!strchr("YyNn", c)) {
+            fprintf(stderr, "Do you wish to upgrade %s? [yn] ",
+                    crypt_get_device_name(cd));
+            c = getc(stdin);
+        }
+
+        if (strchr("Nn", c))
+            return EX_NOPERM;
+    }
+
+    if (r >= 0 && r < LUKSMETA_VERSION_3)
+        r = luksmeta_upgrade(cd, LUKSMETA_VERSION_3);
+    if (r >= 0 || r == -EALREADY)
+        r = luksmeta_compact(cd, NULL);
+
+    switch (r) {
+    case 0:
+        return EX_OK;
+
+    case -ENOENT:
+        fprintf(stderr, "Device is not initialized (%s)\n", opts->device);
+        return EX_OSFILE;
+
+    case -EINVAL:
+        fprintf(stderr, "LUKSMeta data appears corrupt (%s)\n", opts->device);
+        return EX_OSFILE;
+
+    default:
+        fprintf(stderr, "Error while upgrading device (%s): %s\n",
+                opts->device, strerror(-r));
+        return EX_OSERR;
+    }
+}
+
+/*
+ * Sends a request for the device to luksmetad and receives the reply. The
+ * data of the reply is returned in an allocated buffer.
+ */
+static int
+remote(const struct options *opts, uint8_t op, const void *data, size_t size,
+       lmd_reply_t *rep, uint8_t **out)
+{
+    lmd_request_t req = { .op = op, .slot = opts->slot, .datalen = size };
+    size_t pathlen = strlen(opts->device);
+    int fd = -1;
+    int r = 0;
+
+    if (pathlen > LMD_MAX_PATH || size > LMD_MAX_DATA)
+        return -E2BIG;
+
+    req.pathlen = pathlen;
+    if (opts->have_uuid)
+        memcpy(req.uuid, opts->uuid, sizeof(req.uuid));
+
+    fd = lmd_connect(opts->socket);
+    if (fd < 0)
+        return fd;
+
+    r = lmd_send(fd, &req, sizeof(req), NULL);
+    if (r == 0)
+        r = lmd_send(fd, opts->device, pathlen, NULL);
+    if (r == 0)
+        r = lmd_send(fd, data, size, NULL);
+    if (r == 0)
+        r = lmd_recv(fd, rep, sizeof(*rep), NULL);
+    if (r == 0 && rep->datalen > LMD_MAX_DATA)
+        r = -EPROTO;
+    if (r == 0) {
+        *out = malloc(rep->datalen > 0 ? rep->datalen : 1);
+        r = *out ? lmd_recv(fd, *out, rep->datalen, NULL) : -ENOMEM;
+    }
+
+    close(fd);
+    return r;
+}
+
+/* Reports a failure returned by luksmetad and returns the exit code. */
+static int
+remote_error(const struct options *opts, const lmd_reply_t *rep)
+{
+    switch (rep->status) {
+    case -ENOENT:
+        fprintf(stderr, "Device is not initialized (%s)\n", opts->device);
+        return EX_OSFILE;
+
+    case -EINVAL:
+        fprintf(stderr, "LUKSMeta data appears corrupt (%s)\n", opts->device);
+        return EX_OSFILE;
+
+    case -EBADSLT:
+        fprintf(stderr, "The specified slot is invalid (%d)\n", opts->slot);
+        return EX_USAGE;
+
+    case -ENODATA:
+        if (opts->slot < 0) {
+            fprintf(stderr, "No slot contains the given UUID (" UUID_TMPL
+                    ")\n", UUID_ARGS(opts->uuid));
+        } else {
+            fprintf(stderr, "The specified slot is empty (%d)\n", opts->slot);
+        }
+        return EX_UNAVAILABLE;
+
+    case -EKEYREJECTED:
+        fprintf(stderr,
+                "The given UUID does not match the slot UUID:\n"
+                "UUID: " UUID_TMPL "\n"
+                "SLOT: " UUID_TMPL "\n",
+                UUID_ARGS(opts->uuid), UUID_ARGS(rep->uuid));
+        return EX_DATAERR;
+
+    case -EALREADY:
+        fprintf(stderr, "Will not overwrite existing slot (%d)\n", opts->slot);
+        return EX_UNAVAILABLE;
+
+    case -ENOSPC:
+        fprintf(stderr, "Insufficient space in the LUKS header (%s)\n",
+                opts->device);
+        return EX_CANTCREAT;
+
+    default:
+        fprintf(stderr, "luksmetad failed (%s): %s\n",
+                opts->device, strerror(-rep->status));
+        return EX_OSERR;
+    }
+}
+
+/* Performs show, load, save or wipe through luksmetad. */
+static int
+cmd_remote(const struct options *opts, const char *cmd)
+{
+    const lmd_slot_t *slots = NULL;
+    lmd_reply_t rep = {};
+    uint8_t *out = NULL;
+    uint8_t *in = NULL;
+    size_t inl = 0;
+    uint8_t op = 0;
+    int ret = EX_OK;
+    int r = 0;
+
+    if (strcmp(cmd, "show") == 0) {
+        op = LMD_SHOW;
+    } else if (strcmp(cmd, "load") == 0) {
+        if (opts->slot < 0 && !opts->have_uuid) {
+            fprintf(stderr, "Slot or UUID required\n");
+            return EX_USAGE;
+        }
+        op = LMD_LOAD;
+    } else if (strcmp(cmd, "save") == 0) {
+        if (!opts->have_uuid) {
+            fprintf(stderr, "UUID required\n");
+            return EX_USAGE;
+        }
+
+        if (opts->compress) {
+            fprintf(stderr, "Compression is not available via luksmetad\n");
+            return EX_USAGE;
+        }
+
+        ret = read_input(&in, &inl);
+        if (ret != EX_OK)
+            return ret;
+        op = LMD_SAVE;
+    } else if (strcmp(cmd, "wipe") == 0) {
+        if (opts->slot < 0 && !opts->have_uuid) {
+            fprintf(stderr, "Slot or UUID required\n");
+            return EX_USAGE;
+        }
+
+        if (!confirm_wipe(opts, opts->device))
+            return EX_NOPERM;
+        op = LMD_WIPE;
+    } else {
+        fprintf(stderr, "Only show, load, save and wipe use luksmetad\n");
+        return EX_USAGE;
+    }
+
+    r = remote(opts, op, in, inl, &rep, &out);
+    if (in)
+        memset(in, 0, inl);
+    free(in);
+    if (r < 0) {
+        fprintf(stderr, "Unable to talk to luksmetad (%s): %s\n",
+                opts->socket, strerror(-r));
+        free(out);
+        return EX_UNAVAILABLE;
+    }
+
+    if (rep.status < 0 && !(op == LMD_WIPE && rep.status == -EALREADY))
+        ret = remote_error(opts, &rep);
+    else if (op == LMD_LOAD)
+        fwrite(out, 1, rep.datalen, stdout);
+    else if (op == LMD_SAVE && opts->slot < 0)
+        fprintf(stdout, "%d\n", rep.status);
+
+    slots = (const lmd_slot_t *) out;
+    for (int i = 0; op == LMD_SHOW && ret == EX_OK && i < LUKS_NSLOTS; i++) {
+        const char *state = keyslot_name(slots[i].keyslot);
+
+        if (opts->slot >= 0 && i != opts->slot)
+            continue;
+
+        if (slots[i].status == -ENODATA) {
+            if (opts->slot < 0)
+                fprintf(stdout, "%d %8s %s\n", i, state, "empty");
+        } else if (slots[i].status < 0) {
+            fprintf(stderr, "%d %8s %s\n", i, state, "unknown error");
+        } else {
+            if (opts->slot < 0)
+                fprintf(stdout, "%d %8s ", i, state);
+
+            fprintf(stdout, UUID_TMPL "\n", UUID_ARGS(slots[i].uuid));
+        }
+    }
+
+    if (out)
+        memset(out, 0, rep.datalen);
+    free(out);
+    return ret;
+}
+
+static const char *sopts = "hcfnpJd:u:s:j:F:S:";
 static const struct option lopts[] = {
-    { "help",                      .val = 'h' },
-    { "nuke",   no_argument,       .val = 'n' },
-    { "force",  no_argument,       .val = 'f' },
-    { "device", required_argument, .val = 'd' },
-    { "uuid",   required_argument, .val = 'u' },
-    { "slot",   required_argument, .val = 's' },
+    { "help",                        .val = 'h' },
+    { "nuke",     no_argument,       .val = 'n' },
+    { "force",    no_argument,       .val = 'f' },
+    { "packed",   no_argument,       .val = 'p' },
+    { "compress", no_argument,       .val = 'c' },
+    { "device",   required_argument, .val = 'd' },
+    { "uuid",     required_argument, .val = 'u' },
+    { "slot",     required_argument, .val = 's' },
+    { "jobs",     required_argument, .val = 'j' },
+    { "json",     no_argument,       .val = 'J' },
+    { "from-file", required_argument, .val = 'F' },
+    { "socket",   required_argument, .val = 'S' },
     {}
 };
 
+#define SCAN_MAX_JOBS 64
+
+typedef struct {
+    const char *device;
+    struct crypt_device *cd;      /* Loaded, until the slots are read */
+    const char *stage;            /* What failed, if error is set */
+    int error;                    /* Zero or negative errno value */
+    const char *keyslots[LUKS_NSLOTS];
+    luksmeta_slot_t slots[LUKS_NSLOTS];
+} scan_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    scan_t *scans;
+    size_t nscans;
+    size_t next;                  /* Index of the next device to scan */
+} scan_queue_t;
+
+static void
+scan_log(int level, const char *msg, void *usrptr)
+{
+    /* Failures are reported per device instead. */
+}
+
+/* Loads the LUKS header of a device, keeping the handle for scan_slots(). */
+static void
+scan_device(scan_t *s)
+{
+    s->stage = "open";
+    s->error = crypt_init(&s->cd, s->device);
+    if (s->error < 0)
+        return;
+
+    crypt_set_log_callback(s->cd, scan_log, NULL);
+
+    s->stage = "LUKS header";
+    s->error = crypt_load(s->cd, NULL, NULL);
+    if (s->error < 0) {
+        crypt_free(s->cd);
+        s->cd = NULL;
+        return;
+    }
+
+    for (int i = 0; i < LUKS_NSLOTS; i++)
+        s->keyslots[i] = status(s->cd, i);
+}
+
+/*
+ * Reads the slots of all loaded devices with one batch, so that the reads
+ * of all devices are in flight together.
+ */
+static int
+scan_slots(scan_t *scans, size_t n)
+{
+    luksmeta_batch_t *batch = NULL;
+    size_t nbatch = 0;
+
+    batch = calloc(n > 0 ? n : 1, sizeof(*batch));
+    if (!batch)
+        return -errno;
+
+    for (size_t i = 0; i < n; i++) {
+        if (scans[i].cd) {
+            batch[nbatch++] = (luksmeta_batch_t) {
+                scans[i].cd, scans[i].slots, LUKS_NSLOTS
+            };
+        }
+    }
+
+    luksmeta_load_batch(batch, nbatch);
+
+    for (size_t i = 0, j = 0; i < n; i++) {
+        scan_t *s = &scans[i];
+
+        if (!s->cd)
+            continue;
+
+        if (batch[j].status < 0) {
+            s->stage = "luksmeta";
+            s->error = batch[j].status;
+        }
+        j++;
+
+        /* Only the sizes are reported. */
+        for (int k = 0; k < LUKS_NSLOTS; k++) {
+            if (s->slots[k].data)
+                memset(s->slots[k].data, 0, s->slots[k].size);
+            free(s->slots[k].data);
+            s->slots[k].data = NULL;
+        }
+
+        crypt_free(s->cd);
+        s->cd = NULL;
+    }
+
+    free(batch);
+    return 0;
+}
+
+static void *
+scan_worker(void *arg)
+{
+    scan_queue_t *q = arg;
+
+    for (;;) {
+        size_t i;
+
+        pthread_mutex_lock(&q->lock);
+        i = q->next < q->nscans ? q->next++ : q->nscans;
+        pthread_mutex_unlock(&q->lock);
+
+        if (i >= q->nscans)
+            return NULL;
+
+        scan_device(&q->scans[i]);
+    }
+}
+
+static void
+print_json_string(const char *str)
+{
+    putchar('"');
+    for (; *str; str++) {
+        unsigned char c = *str;
+
+        if (c == '"' || c == '\\')
+            printf("\\%c", c);
+        else if (c < 0x20)
+            printf("\\u%04x", c);
+        else
+            putchar(c);
+    }
+    putchar('"');
+}
+
+static void
+print_scan_json(const scan_t *scans, size_t n)
+{
+    printf("[");
+    for (size_t i = 0; i < n; i++) {
+        const scan_t *s = &scans[i];
+
+        printf("%s{\"device\":", i > 0 ? "," : "");
+        print_json_string(s->device);
+
+        if (s->error < 0) {
+            printf(",\"error\":");
+            print_json_string(strerror(-s->error));
+            printf(",\"stage\":\"%s\"}", s->stage);
+            continue;
+        }
+
+        printf(",\"slots\":[");
+        for (int j = 0; j < LUKS_NSLOTS; j++) {
+            const luksmeta_slot_t *o = &s->slots[j];
+
+            printf("%s{\"slot\":%d,\"keyslot\":\"%s\"", j > 0 ? "," : "",
+                   j, s->keyslots[j]);
+
+            if (o->status != -ENODATA) {
+                printf(",\"uuid\":\"" UUID_TMPL "\"", UUID_ARGS(o->uuid));
+                if (o->status >= 0)
+                    printf(",\"length\":%d", o->status);
+                printf(",\"valid\":%s", o->status >= 0 ? "true" : "false");
+            }
+
+            printf("}");
+        }
+        printf("]}");
+    }
+    printf("]\n");
+}
+
+static void
+print_scan_table(const scan_t *scans, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        const scan_t *s = &scans[i];
+
+        if (s->error < 0) {
+            printf("%s error %s: %s\n", s->device, s->stage,
+                   strerror(-s->error));
+            continue;
+        }
+
+        for (int j = 0; j < LUKS_NSLOTS; j++) {
+            const luksmeta_slot_t *o = &s->slots[j];
+
+            printf("%s %d %8s ", s->device, j, s->keyslots[j]);
+
+            if (o->status == -ENODATA)
+                printf("empty\n");
+            else if (o->status < 0)
+                printf(UUID_TMPL " - invalid\n", UUID_ARGS(o->uuid));
+            else
+                printf(UUID_TMPL " %d valid\n", UUID_ARGS(o->uuid), o->status);
+        }
+    }
+}
+
+/* Appends the devices listed in a file, one per line, to the list. */
+static int
+read_devices(const char *path, char ***devs, size_t *ndevs)
+{
+    FILE *file = NULL;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int r = 0;
+
+    file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!file)
+        return -errno;
+
+    while ((len = getline(&line, &size, file)) >= 0) {
+        char **tmp = NULL;
+
+        while (len > 0 && strchr("\r\n \t", line[len - 1]))
+            line[--len] = '\0';
+
+        if (len == 0 || line[0] == '#')
+            continue;
+
+        tmp = realloc(*devs, (*ndevs + 1) * sizeof(*tmp));
+        if (!tmp)
+            break;
+
+        *devs = tmp;
+        (*devs)[(*ndevs)++] = line;
+        line = NULL;
+        size = 0;
+    }
+
+    /* A read error must not pass for the end of a truncated list. */
+    if (len >= 0)
+        r = -ENOMEM;
+    else if (ferror(file))
+        r = errno > 0 ? -errno : -EIO;
+
+    free(line);
+    if (file != stdin)
+        fclose(file);
+
+    return r;
+}
+
+static int
+cmd_scan(const struct options *opts, int argc, char *argv[])
+{
+    pthread_t threads[SCAN_MAX_JOBS] = {};
+    scan_queue_t q = { PTHREAD_MUTEX_INITIALIZER };
+    size_t nfiles = 0;
+    char **devs = NULL;
+    size_t ndevs = 0;
+    size_t jobs = 0;
+    int ret = EX_OK;
+    int r = 0;
+
+    if (opts->from) {
+        r = read_devices(opts->from, &devs, &ndevs);
+        nfiles = ndevs;
+        if (r < 0) {
+            fprintf(stderr, "Unable to read device list (%s): %s\n",
+                    opts->from, strerror(-r));
+            ret = EX_NOINPUT;
+            goto egress;
+        }
+    }
+
+    if (ndevs + argc == 0 && !opts->device) {
+        fprintf(stderr, "No devices given\n");
+        return EX_USAGE;
+    }
+
+    q.nscans = ndevs + argc + (opts->device ? 1 : 0);
+    q.scans = calloc(q.nscans > 0 ? q.nscans : 1, sizeof(*q.scans));
+    if (!q.scans) {
+        fprintf(stderr, "Out of memory!\n");
+        ret = EX_OSERR;
+        goto egress;
+    }
+
+    for (size_t i = 0; i < ndevs; i++)
+        q.scans[i].device = devs[i];
+    for (int i = 0; i < argc; i++)
+        q.scans[ndevs + i].device = argv[i];
+    if (opts->device)
+        q.scans[q.nscans - 1].device = opts->device;
+
+    /* Scanning is I/O bound, so use more threads than CPUs by default. */
+    jobs = opts->jobs > 0 ? (size_t) opts->jobs : 16;
+    if (jobs > SCAN_MAX_JOBS)
+        jobs = SCAN_MAX_JOBS;
+    if (jobs > q.nscans)
+        jobs = q.nscans;
+
+    for (size_t i = 0; i < jobs; i++) {
+        r = pthread_create(&threads[i], NULL, scan_worker, &q);
+        if (r != 0) {
+            jobs = i;
+            break;
+        }
+    }
+
+    /* If no thread could be started, scan from this one. */
+    if (jobs == 0)
+        scan_worker(&q);
+
+    for (size_t i = 0; i < jobs; i++)
+        pthread_join(threads[i], NULL);
+
+    r = scan_slots(q.scans, q.nscans);
+    if (r < 0) {
+        fprintf(stderr, "Unable to read slots: %s\n", strerror(-r));
+        ret = EX_OSERR;
+        goto egress;
+    }
+
+    if (opts->json)
+        print_scan_json(q.scans, q.nscans);
+    else
+        print_scan_table(q.scans, q.nscans);
+
+    for (size_t i = 0; i < q.nscans; i++) {
+        if (q.scans[i].error < 0)
+            ret = EX_UNAVAILABLE;
+    }
+
+egress:
+    for (size_t i = 0; q.scans && i < q.nscans; i++)
+        crypt_free(q.scans[i].cd);
+    for (size_t i = 0; i < nfiles; i++)
+        free(devs[i]);
+    free(devs);
+    free(q.scans);
+    return ret;
+}
+
 static const struct {
     int (*func)(const struct options *opts, struct crypt_device *cd);
     const char *name;
@@ -441,6 +1156,8 @@ static const struct {
     { cmd_save, "save", },
     { cmd_load, "load", },
     { cmd_wipe, "wipe", },
+    { cmd_compact, "compact", },
+    { cmd_upgrade, "upgrade", },
     {}
 };
 
@@ -455,6 +1172,17 @@ main(int argc, char *argv[])
         case 'd': o.device = optarg; break;
         case 'n': o.nuke = true; break;
         case 'f': o.force = true; break;
+        case 'p': o.packed = true; break;
+        case 'c': o.compress = true; break;
+        case 'J': o.json = true; break;
+        case 'F': o.from = optarg; break;
+        case 'S': o.socket = optarg; break;
+        case 'j':
+            if (sscanf(optarg, "%d", &o.jobs) != 1 || o.jobs < 1) {
+                fprintf(stderr, "Invalid number of jobs (%s)\n", optarg);
+                return EX_USAGE;
+            }
+            break;
         case 'u':
             if (sscanf(optarg, UUID_TMPL, UUID_ARGS(&o.uuid)) != 16) {
                 fprintf(stderr, "Invalid UUID (%s)\n", optarg);
@@ -473,6 +1201,10 @@ main(int argc, char *argv[])
         }
     }
 
+    /* Scanning takes any number of devices. */
+    if (optind < argc && strcmp(argv[optind], "scan") == 0)
+        return cmd_scan(&o, argc - optind - 1, &argv[optind + 1]);
+
     if (argc > 1 && !o.device) {
         fprintf(stderr, "Device must be specified\n\n");
         goto usage;
@@ -481,6 +1213,9 @@ main(int argc, char *argv[])
     if (optind != argc - 1)
         goto usage;
 
+    if (o.socket)
+        return cmd_remote(&o, argv[optind]);
+
     for (size_t i = 0; argc > 1 && commands[i].name; i++) {
         struct crypt_device *cd = NULL;
         const char *type = NULL;
@@ -500,7 +1235,7 @@ main(int argc, char *argv[])
 
         r = crypt_load(cd, NULL, NULL);
         if (r != 0) {
-            fprintf(stderr, "Unable to read LUKSv1 header (%s): %s\n",
+            fprintf(stderr, "Unable to read LUKS header (%s): %s\n",
                     o.device, strerror(-r));
             crypt_free(cd);
             return EX_IOERR;
@@ -514,8 +1249,12 @@ main(int argc, char *argv[])
             return EX_OSFILE;
         }
 
+#ifdef HAVE_LUKS2
+        if (strcmp(type, CRYPT_LUKS1) != 0 && strcmp(type, CRYPT_LUKS2) != 0) {
+#else
         if (strcmp(type, CRYPT_LUKS1) != 0) {
-            fprintf(stderr, "%s (%s) is not a LUKSv1 device\n", o.device, type);
+#endif
+            fprintf(stderr, "%s (%s) is not a LUKS device\n", o.device, type);
             crypt_free(cd);
             return EX_OSFILE;
         }
@@ -531,10 +1270,14 @@ usage:
     fprintf(stderr,
             "Usage: luksmeta test -d DEVICE\n"
             "   or: luksmeta nuke -d DEVICE [-f]\n"
-            "   or: luksmeta init -d DEVICE [-f] [-n]\n"
+            "   or: luksmeta init -d DEVICE [-f] [-n] [-p]\n"
             "   or: luksmeta show -d DEVICE [-s SLOT]\n"
-            "   or: luksmeta save -d DEVICE [-s SLOT]  -u UUID  < DATA\n"
-            "   or: luksmeta load -d DEVICE  -s SLOT  [-u UUID] > DATA\n"
-            "   or: luksmeta wipe -d DEVICE  -s SLOT  [-u UUID] [-f]\n");
+            "   or: luksmeta save -d DEVICE [-s SLOT]  -u UUID  [-c] < DATA\n"
+            "   or: luksmeta load -d DEVICE [-s SLOT] [-u UUID] > DATA\n"
+            "   or: luksmeta wipe -d DEVICE [-s SLOT] [-u UUID] [-f]\n"
+            "   or: luksmeta compact -d DEVICE\n"
+            "   or: luksmeta upgrade -d DEVICE [-f]\n"
+            "   or: luksmeta scan [-j JOBS] [-J] [-F FILE] [DEVICE...]\n"
+            "   or: luksmeta {show|save|load|wipe} -S SOCKET -d DEVICE ...\n");
     return EX_USAGE;
 }
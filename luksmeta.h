@@ -27,6 +27,48 @@ extern "C" {
 
 typedef uint8_t luksmeta_uuid_t[16];
 
+typedef struct luksmeta luksmeta_t;
+
+typedef enum {
+    LUKSMETA_ZERO_NONE = 0,       /* Nothing was zeroed */
+    LUKSMETA_ZERO_BLKZEROOUT,     /* The BLKZEROOUT ioctl (block devices) */
+    LUKSMETA_ZERO_FALLOCATE,      /* fallocate() (regular files) */
+    LUKSMETA_ZERO_WRITE,          /* Writing zeroes */
+} luksmeta_zero_t;
+
+enum {
+    LUKSMETA_SAVE_FIRST_FIT = 0,  /* Use the lowest free extent (default) */
+    LUKSMETA_SAVE_BEST_FIT,       /* Use the smallest free extent that fits */
+    LUKSMETA_SAVE_WORST_FIT,      /* Use the largest free extent */
+    LUKSMETA_SAVE_COMPRESS = 0x100, /* Compress the data if it helps */
+};
+
+enum {
+    LUKSMETA_VERSION_1 = 1,       /* Slot data is aligned to 4096 bytes */
+    LUKSMETA_VERSION_2 = 2,       /* Slot data is packed at 64 bytes */
+    LUKSMETA_VERSION_3 = 3,       /* As 2, with two copies of the header */
+    LUKSMETA_VERSION_4 = 4,       /* As 3, with a table of entries */
+};
+
+typedef struct {
+    luksmeta_uuid_t uuid; /* UUID of the metadata (output) */
+    void *data;           /* Output buffer or NULL to allocate one */
+    size_t size;          /* Size of data */
+    int status;           /* Metadata length or negative errno (output) */
+} luksmeta_slot_t;
+
+typedef struct {
+    struct crypt_device *cd; /* Loaded crypt device handle */
+    luksmeta_slot_t *slots;  /* Slots as for luksmeta_load_all() */
+    size_t nslots;           /* Number of elements in slots */
+    int status;              /* Result of the load of the device (output) */
+} luksmeta_batch_t;
+
+typedef struct {
+    uint64_t hits;   /* Headers taken from the cache */
+    uint64_t misses; /* Headers read and parsed while the cache was enabled */
+} luksmeta_cache_stats_t;
+
 /**
  * Checks for the existence of a valid LUKSMeta header on a LUKSv1 device
  *
@@ -42,12 +84,27 @@ luksmeta_test(struct crypt_device *cd);
 /**
  * Zeroes the entire LUKSMeta storage space.
  *
+ * On LUKSv2 devices, the luksmeta token is removed instead.
+ *
  * @param cd crypt device handle
  * @return Zero on success or negative errno value otherwise.
  */
 int
 luksmeta_nuke(struct crypt_device *cd);
 
+/**
+ * Zeroes the entire LUKSMeta storage space and reports how it was done.
+ *
+ * The cheapest available method is used: the BLKZEROOUT ioctl on block
+ * devices, fallocate() on regular files and writing zeroes otherwise.
+ *
+ * @param cd crypt device handle
+ * @param strategy the method used (output, may be NULL)
+ * @return Zero on success or negative errno value otherwise.
+ */
+int
+luksmeta_nuke_strategy(struct crypt_device *cd, luksmeta_zero_t *strategy);
+
 /**
  * Initializes metadata storage on a LUKSv1 device
  *
@@ -60,6 +117,66 @@ luksmeta_nuke(struct crypt_device *cd);
 int
 luksmeta_init(struct crypt_device *cd);
 
+/**
+ * Initializes metadata storage on a LUKSv1 device using the given layout
+ *
+ * Version 1 stores each slot on pages of its own. Version 2 packs the slots
+ * at a much finer granularity, right after the header, so that small slots
+ * can all be read with a single read. Version 3 additionally keeps two
+ * copies of the header which are written alternately, so that readers
+ * always find an intact header, even while it is being rewritten. Version 4
+ * adds a table of entries, so that any number of metadata items (up to a
+ * limit of 112) can be stored per keyslot, see luksmeta_entry_save().
+ * Versions 2 and later cannot be read by releases of this library which
+ * predate them.
+ *
+ * On LUKSv2 devices, the slots are kept in a LUKSv2 token instead and the
+ * version is ignored.
+ *
+ * @param cd crypt device handle
+ * @param version one of the LUKSMETA_VERSION_* values
+ * @return Zero on success or negative errno value otherwise.
+ *
+ * @note This function returns -EINVAL if the version is unknown.
+ * @note This function returns -EALREADY if a valid header already exists.
+ * @note This function returns -ENOSPC if there is insufficient space.
+ */
+int
+luksmeta_init_version(struct crypt_device *cd, int version);
+
+/**
+ * Gets the layout version of the metadata storage on a LUKSv1 device
+ *
+ * @param cd crypt device handle
+ * @return One of the LUKSMETA_VERSION_* values or negative errno value.
+ *
+ * @note This function returns -ENOENT if the device has no luksmeta header.
+ * @note This function returns -EINVAL if the header is corrupted.
+ * @note This function returns -ENOTSUP for LUKSv2 devices.
+ */
+int
+luksmeta_version(struct crypt_device *cd);
+
+/**
+ * Converts the metadata storage to a newer layout version
+ *
+ * Slot data stays where it is, unless it is in the way of a header copy,
+ * in which case it is moved first. Call luksmeta_compact() afterwards to
+ * pack existing slots using the new layout.
+ *
+ * @param cd crypt device handle
+ * @param version one of the LUKSMETA_VERSION_* values
+ * @return Zero on success or negative errno value otherwise.
+ *
+ * @note This function returns -ENOENT if the device has no luksmeta header.
+ * @note This function returns -EINVAL if the header is corrupted.
+ * @note This function returns -EINVAL if the version is unknown or older.
+ * @note This function returns -EALREADY if the version is already in use.
+ * @note This function returns -ENOSPC if slots cannot be moved out of the way.
+ */
+int
+luksmeta_upgrade(struct crypt_device *cd, int version);
+
 /**
  * Gets metadata from the specified slot
  *
@@ -83,6 +200,54 @@ int
 luksmeta_load(struct crypt_device *cd, int slot,
               luksmeta_uuid_t uuid, void *buf, size_t size);
 
+/**
+ * Gets metadata from all slots at once
+ *
+ * The header is read once and the payloads of all occupied slots are read
+ * with as few (vectored) reads as possible. For each of the first nslots
+ * slots, the UUID is stored and the payload is read into the provided
+ * buffer. If the data member is NULL, a buffer is allocated with malloc()
+ * and must be released by the caller with free().
+ *
+ * The status member of each slot is set to the length of the metadata or to
+ * one of the following negative errno values:
+ *
+ *   -ENODATA if the slot is empty.
+ *   -E2BIG if the provided buffer is too small.
+ *   -EINVAL if the slot data is corrupted.
+ *   -ENOMEM if a buffer could not be allocated.
+ *
+ * @param cd crypt device handle
+ * @param slots array of slots (input/output)
+ * @param nslots number of elements in slots
+ * @return The number of non-empty slots or negative errno value.
+ *
+ * @note This function returns -ENOENT if the device has no luksmeta header.
+ * @note This function returns -EINVAL if the header is corrupted.
+ * @note On failure, all buffers allocated by this function are released.
+ */
+int
+luksmeta_load_all(struct crypt_device *cd,
+                  luksmeta_slot_t slots[], size_t nslots);
+
+/**
+ * Gets metadata from all slots of several devices at once
+ *
+ * This is equivalent to calling luksmeta_load_all() on each device and
+ * storing its result in the status member. However, if io_uring is
+ * available, the reads of many devices are in flight together: the headers
+ * of all devices are requested at once and the slots of each device as soon
+ * as its header has arrived. Reading N devices then takes about two device
+ * round trips rather than N times as many. Otherwise, the devices are read
+ * one after another.
+ *
+ * @param batch array of devices (input/output)
+ * @param n number of elements in batch
+ * @return The number of devices which were read successfully.
+ */
+int
+luksmeta_load_batch(luksmeta_batch_t batch[], size_t n);
+
 /**
  * Sets metadata to the specified slot
  *
@@ -126,6 +291,432 @@ luksmeta_save(struct crypt_device *cd, int slot,
 int
 luksmeta_wipe(struct crypt_device *cd, int slot, const luksmeta_uuid_t uuid);
 
+/**
+ * Replaces the metadata in the specified slot
+ *
+ * The new data is written to free space and committed with a single header
+ * update, after which the old data is erased. The slot holds either the old
+ * or the new data at all times. The old data is erased without waiting for
+ * it to reach the disk since it is no longer referenced.
+ *
+ * @param cd crypt device handle
+ * @param slot requested metadata slot
+ * @param uuid UUID of the new metadata
+ * @param buf input buffer for metadata
+ * @param size size of buf
+ * @return The slot number to which data was written or negative errno value.
+ *
+ * @note This function returns -ENOENT if the device has no luksmeta header.
+ * @note This function returns -EINVAL if the header is corrupted.
+ * @note This function returns -EBADSLT if the specified slot is invalid.
+ * @note This function returns -EKEYREJECTED if the uuid is invalid/reserved.
+ * @note This function returns -ENODATA if the specified slot is empty.
+ * @note This function returns -ENOSPC if there is insufficient free space
+ *       for the new data alongside the old.
+ */
+int
+luksmeta_update(struct crypt_device *cd, int slot,
+                const luksmeta_uuid_t uuid, const void *buf, size_t size);
+
+/**
+ * Moves slot data together to merge the free space
+ *
+ * Slots are moved towards the start of the storage area, in order, so that
+ * the free space forms one large extent at the end. Each move copies the
+ * data to free space, updates the header and only then erases the old copy,
+ * so an interruption never loses data. A slot which can only be moved onto
+ * itself is moved through free space elsewhere or, if there is none, left
+ * where it is.
+ *
+ * @param cd crypt device handle
+ * @param moved number of bytes of slot data moved (output, may be NULL)
+ * @return Zero on success or negative errno value otherwise.
+ *
+ * @note This function returns -ENOENT if the device has no luksmeta header.
+ * @note This function returns -EINVAL if the header is corrupted.
+ */
+int
+luksmeta_compact(struct crypt_device *cd, uint64_t *moved);
+
+/**
+ * Finds the slots holding metadata with the specified UUID
+ *
+ * All slots are searched using a single read of the header, in ascending
+ * order. At most n slot numbers are stored, but the total number of
+ * matching slots is returned.
+ *
+ * @param cd crypt device handle
+ * @param uuid UUID of the metadata
+ * @param slots array of slot numbers (output)
+ * @param n number of elements in slots
+ * @return The number of matching slots or negative errno value.
+ *
+ * @note This function returns -ENOENT if the device has no luksmeta header.
+ * @note This function returns -EINVAL if the header is corrupted.
+ * @note This function returns -EKEYREJECTED if the uuid is invalid/reserved.
+ */
+int
+luksmeta_find(struct crypt_device *cd, const luksmeta_uuid_t uuid,
+              int slots[], size_t n);
+
+/**
+ * Stores metadata as an entry of the specified keyslot
+ *
+ * Unlike slots, entries are identified by the keyslot they belong to and
+ * their UUID, so each keyslot can have several entries. Entries are listed
+ * in a table of their own, sorted by keyslot and UUID, which is found via
+ * the header. This requires a version 4 layout.
+ *
+ * @param cd crypt device handle
+ * @param keyslot the LUKS keyslot the entry belongs to
+ * @param uuid UUID of the metadata
+ * @param buf input buffer for metadata
+ * @param size size of buf
+ * @return Zero on success or negative errno value otherwise.
+ *
+ * @note This function returns -ENOENT if the device has no luksmeta header.
+ * @note This function returns -EINVAL if the header is corrupted.
+ * @note This function returns -ENOTSUP if the layout predates version 4.
+ * @note This function returns -EBADSLT if the specified keyslot is invalid.
+ * @note This function returns -EKEYREJECTED if the uuid is invalid/reserved.
+ * @note This function returns -EALREADY if the entry already exists.
+ * @note This function returns -ENOSPC if there is insufficient space or
+ *       the table is full.
+ */
+int
+luksmeta_entry_save(struct crypt_device *cd, int keyslot,
+                    const luksmeta_uuid_t uuid, const void *buf, size_t size);
+
+/**
+ * Gets metadata from the specified entry
+ *
+ * If buf is NULL, this function returns the size of the metadata only.
+ *
+ * @param cd crypt device handle
+ * @param keyslot the LUKS keyslot the entry belongs to
+ * @param uuid UUID of the metadata
+ * @param buf output buffer for metadata
+ * @param size size of buf
+ * @return The number of bytes in the metadata or negative errno value.
+ *
+ * @note This function returns -ENOENT if the device has no luksmeta header.
+ * @note This function returns -EINVAL if the header or entry is corrupted.
+ * @note This function returns -EBADSLT if the specified keyslot is invalid.
+ * @note This function returns -ENODATA if there is no such entry.
+ * @note This function returns -E2BIG if buf is too small.
+ */
+int
+luksmeta_entry_load(struct crypt_device *cd, int keyslot,
+                    const luksmeta_uuid_t uuid, void *buf, size_t size);
+
+/**
+ * Deletes the specified entry
+ *
+ * @param cd crypt device handle
+ * @param keyslot the LUKS keyslot the entry belongs to
+ * @param uuid UUID of the metadata
+ * @return Zero on success or negative errno value otherwise.
+ *
+ * @note This function returns -ENOENT if the device has no luksmeta header.
+ * @note This function returns -EINVAL if the header is corrupted.
+ * @note This function returns -EBADSLT if the specified keyslot is invalid.
+ * @note This function returns -EALREADY if there is no such entry.
+ */
+int
+luksmeta_entry_wipe(struct crypt_device *cd, int keyslot,
+                    const luksmeta_uuid_t uuid);
+
+/**
+ * Lists the UUIDs of the entries of the specified keyslot
+ *
+ * The UUIDs are returned in ascending order. At most n of them are stored,
+ * but the total number is returned, so a short array can be used to find
+ * the required size.
+ *
+ * @param cd crypt device handle
+ * @param keyslot the LUKS keyslot the entries belong to
+ * @param uuids array of UUIDs (output)
+ * @param n number of elements in uuids
+ * @return The number of entries or negative errno value.
+ *
+ * @note This function returns -ENOENT if the device has no luksmeta header.
+ * @note This function returns -EINVAL if the header is corrupted.
+ * @note This function returns -EBADSLT if the specified keyslot is invalid.
+ */
+int
+luksmeta_entry_list(struct crypt_device *cd, int keyslot,
+                    luksmeta_uuid_t uuids[], size_t n);
+
+/**
+ * Enables or disables the process-wide header cache
+ *
+ * The cache is disabled by default. While it is enabled, luksmeta_open()
+ * and luksmeta_open_image(), and so all functions taking a crypt device
+ * except luksmeta_load_batch(), remember the parsed header and entry table
+ * of each LUKSv1 device or image. Entries are keyed by the device number or
+ * inode and, for crypt devices, by the UUID and data offset of the LUKSv1
+ * header. Opening a cached device again only rereads the bytes holding the
+ * header and compares their checksum, rather than querying the keyslot
+ * areas and parsing the header and entry table; for images, the LUKSv1
+ * header is checked as well. An image in a regular file is trusted as long
+ * as the modification time and size of the file are unchanged, so changes
+ * made to it by other means within the timestamp granularity of its file
+ * system may be missed. Every header write made by this library
+ * removes the entries of the device. LUKSv2 devices are never cached. The
+ * 64 most recently used devices are kept.
+ *
+ * Disabling the cache empties it; enabling it resets the counters.
+ *
+ * @param enable nonzero to enable the cache, zero to disable it
+ */
+void
+luksmeta_cache_enable(int enable);
+
+/**
+ * Gets the hit and miss counters of the header cache
+ *
+ * @param stats the counters (output)
+ */
+void
+luksmeta_cache_stats(luksmeta_cache_stats_t *stats);
+
+/**
+ * Opens a handle to the LUKSMeta storage on a LUKSv1 device
+ *
+ * The device geometry is queried and the header is read and validated once.
+ * Operations on the handle reuse the open file descriptor and the parsed
+ * header. The cached header is only updated by operations on the handle, so
+ * changes made through other handles will not be seen.
+ *
+ * On LUKSv1 devices, the handle holds a flock() on the device until it is
+ * closed: a shared lock for O_RDONLY and an exclusive one for O_RDWR. So
+ * readers run in parallel, while a writer waits for all other handles, in
+ * this or any other process, and then excludes them. Keep O_RDWR handles
+ * open only as long as needed. A thread which holds an O_RDWR handle and
+ * opens another handle on the same device (this includes all functions
+ * taking a crypt device), or which holds an O_RDONLY handle and opens an
+ * O_RDWR one, would wait for itself forever; this fails with -EDEADLK
+ * instead. If O_NONBLOCK is added to the flags, the function does not wait
+ * for other processes either. On LUKSv2 devices, writers reread the token
+ * before each change instead, and libcryptsetup locks the token itself.
+ *
+ * @param cd crypt device handle
+ * @param flags O_RDONLY or O_RDWR, optionally with O_NONBLOCK
+ * @param lm the new handle (output)
+ * @return Zero on success or negative errno value otherwise.
+ *
+ * @note This function returns -ENOENT if the device has no luksmeta header.
+ * @note This function returns -EINVAL if the header is corrupted.
+ * @note This function returns -EDEADLK if the calling thread holds a
+ *       conflicting handle.
+ * @note This function returns -EAGAIN if O_NONBLOCK is given and another
+ *       process holds a conflicting handle.
+ */
+int
+luksmeta_open(struct crypt_device *cd, int flags, luksmeta_t **lm);
+
+/**
+ * Opens a handle to the LUKSMeta storage in a LUKSv1 header image
+ *
+ * The image may be a whole device, a header backup or a copy of one, for
+ * instance in a memfd. The LUKSv1 header is parsed directly, without
+ * libcryptsetup, to locate the storage area. The file descriptor is
+ * duplicated, so the caller may close it; the handle can modify the image
+ * if the descriptor was opened for writing. The image is locked as by
+ * luksmeta_open(): shared if the descriptor is read-only and exclusively
+ * otherwise. Since the duplicate shares the lock with the caller's
+ * descriptor, the lock lasts until both are closed.
+ *
+ * @param fd file descriptor of the image
+ * @param lm the new handle (output)
+ * @return Zero on success or negative errno value otherwise.
+ *
+ * @note This function returns -ENOTSUP if the image is not LUKSv1.
+ * @note This function returns -ENOSPC if the image has no header gap.
+ * @note This function returns -ENOENT if the image has no luksmeta header.
+ * @note This function returns -EINVAL if the header is corrupted.
+ */
+int
+luksmeta_open_image(int fd, luksmeta_t **lm);
+
+/**
+ * Makes the last header written through a handle durable
+ *
+ * With layout version 3 and later, header writes are not flushed until the
+ * next change is made or the handle is closed. Since luksmeta_close() cannot
+ * report an error, callers which must know that a change survives a crash
+ * should call this function first.
+ *
+ * @param lm LUKSMeta handle
+ * @return Zero on success or negative errno value otherwise.
+ */
+int
+luksmeta_flush(luksmeta_t *lm);
+
+/**
+ * Closes a handle returned by luksmeta_open()
+ *
+ * With layout version 3, the last header written through the handle may
+ * not be durable until the handle is closed (or the next change is made).
+ * Until then, a crash reverts the device to the previous header. Errors
+ * of this final flush are lost; see luksmeta_flush().
+ *
+ * @param lm LUKSMeta handle (may be NULL)
+ */
+void
+luksmeta_close(luksmeta_t *lm);
+
+/**
+ * Gets metadata from the specified slot using an open handle
+ *
+ * @see luksmeta_load()
+ */
+int
+luksmeta_handle_load(luksmeta_t *lm, int slot,
+                     luksmeta_uuid_t uuid, void *buf, size_t size);
+
+/**
+ * Gets metadata from all slots at once using an open handle
+ *
+ * @see luksmeta_load_all()
+ */
+int
+luksmeta_handle_load_all(luksmeta_t *lm,
+                         luksmeta_slot_t slots[], size_t nslots);
+
+/**
+ * Sets metadata to the specified slot using an open handle
+ *
+ * The handle must have been opened with O_RDWR. The flags select where the
+ * data is placed in the free space (one of the LUKSMETA_SAVE_*_FIT values).
+ * Placing data in the smallest free extent that fits keeps large extents
+ * available for later, larger saves.
+ *
+ * If LUKSMETA_SAVE_COMPRESS is also set, the data is compressed with zstd
+ * or zlib, whichever was available at build time. The data is stored
+ * uncompressed if compression does not make it smaller or the device uses
+ * layout version 1, whose older readers would not know to decompress it.
+ * Loading decompresses transparently.
+ *
+ * @see luksmeta_save()
+ * @note This function returns -EINVAL if flags is invalid.
+ */
+int
+luksmeta_handle_save(luksmeta_t *lm, int slot, const luksmeta_uuid_t uuid,
+                     const void *buf, size_t size, int flags);
+
+/**
+ * Replaces the metadata in the specified slot using an open handle
+ *
+ * The handle must have been opened with O_RDWR. The flags select where the
+ * new data is placed, as for luksmeta_handle_save().
+ *
+ * @see luksmeta_update()
+ * @note This function returns -EINVAL if flags is invalid.
+ */
+int
+luksmeta_handle_update(luksmeta_t *lm, int slot, const luksmeta_uuid_t uuid,
+                       const void *buf, size_t size, int flags);
+
+/**
+ * Moves slot data together to merge the free space using an open handle
+ *
+ * The handle must have been opened with O_RDWR.
+ *
+ * @see luksmeta_compact()
+ */
+int
+luksmeta_handle_compact(luksmeta_t *lm, uint64_t *moved);
+
+/**
+ * Converts the metadata storage to a newer layout using an open handle
+ *
+ * The handle must have been opened with O_RDWR.
+ *
+ * @see luksmeta_upgrade()
+ */
+int
+luksmeta_handle_upgrade(luksmeta_t *lm, int version);
+
+/**
+ * Deletes metadata from the specified slot using an open handle
+ *
+ * The handle must have been opened with O_RDWR.
+ *
+ * @see luksmeta_wipe()
+ */
+int
+luksmeta_handle_wipe(luksmeta_t *lm, int slot, const luksmeta_uuid_t uuid);
+
+/**
+ * Finds the slots holding metadata with the specified UUID using a handle
+ *
+ * @see luksmeta_find()
+ */
+int
+luksmeta_handle_find(luksmeta_t *lm, const luksmeta_uuid_t uuid,
+                     int slots[], size_t n);
+
+/**
+ * Identifies the state of the metadata as seen by an open handle
+ *
+ * The stamp changes whenever the metadata does, so a cache of the slots of
+ * a device remains valid as long as a freshly opened handle yields the same
+ * stamp. On LUKSv1, the stamp is derived from the header, which carries a
+ * checksum of every slot and the generation of version 3 and later layouts.
+ * On LUKSv2, it is a checksum of the token.
+ *
+ * @param lm handle
+ * @param stamp the stamp (output)
+ * @return Zero on success or negative errno value otherwise.
+ */
+int
+luksmeta_handle_stamp(luksmeta_t *lm, uint64_t *stamp);
+
+/**
+ * Stores metadata as an entry using an open handle
+ *
+ * The handle must have been opened with O_RDWR. The flags select the
+ * placement of the data, as for luksmeta_handle_save().
+ *
+ * @see luksmeta_entry_save()
+ */
+int
+luksmeta_handle_entry_save(luksmeta_t *lm, int keyslot,
+                           const luksmeta_uuid_t uuid,
+                           const void *buf, size_t size, int flags);
+
+/**
+ * Gets metadata from the specified entry using an open handle
+ *
+ * Entries are found with a binary search of the table cached by the handle.
+ *
+ * @see luksmeta_entry_load()
+ */
+int
+luksmeta_handle_entry_load(luksmeta_t *lm, int keyslot,
+                           const luksmeta_uuid_t uuid, void *buf, size_t size);
+
+/**
+ * Deletes the specified entry using an open handle
+ *
+ * The handle must have been opened with O_RDWR.
+ *
+ * @see luksmeta_entry_wipe()
+ */
+int
+luksmeta_handle_entry_wipe(luksmeta_t *lm, int keyslot,
+                           const luksmeta_uuid_t uuid);
+
+/**
+ * Lists the UUIDs of the entries of the specified keyslot using a handle
+ *
+ * @see luksmeta_entry_list()
+ */
+int
+luksmeta_handle_entry_list(luksmeta_t *lm, int keyslot,
+                           luksmeta_uuid_t uuids[], size_t n);
+
 #ifdef __cplusplus
 }
 #endif
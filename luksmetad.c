@@ -0,0 +1,627 @@
+/* vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab smarttab colorcolumn=80: */
+/*
+ * Copyright (c) 2016 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "lmd.h"
+
+#include <linux/netlink.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LUKS_NSLOTS 8
+#define MAX_CLIENTS 64
+#define CLIENT_TIMEOUT 5  /* Seconds to receive a request or send a reply */
+#define LOCK_RETRY 10     /* Milliseconds between attempts to lock a device */
+
+/* A device whose LUKS header and slots are kept in memory */
+typedef struct device {
+    struct device *next;
+    char *path;
+    dev_t rdev;                 /* Block devices only, to match uevents */
+    struct crypt_device *cd;    /* Loaded LUKS header */
+    bool cached;                /* The slots match the stamp */
+    uint64_t stamp;             /* See luksmeta_handle_stamp() */
+    luksmeta_slot_t slots[LUKS_NSLOTS];
+} device_t;
+
+static device_t *devices;
+static struct timespec deadline; /* Of the request being served */
+static volatile sig_atomic_t quit;
+
+static void
+quiet(int level, const char *msg, void *usrptr)
+{
+    /* Errors are returned to the clients instead. */
+}
+
+/* Forgets the cached slots of a device. */
+static void
+forget(device_t *d)
+{
+    for (int i = 0; i < LUKS_NSLOTS; i++) {
+        if (d->slots[i].data)
+            memset(d->slots[i].data, 0, d->slots[i].size);
+        free(d->slots[i].data);
+    }
+
+    memset(d->slots, 0, sizeof(d->slots));
+    d->cached = false;
+}
+
+/* Forgets a device entirely. */
+static void
+drop(device_t **d)
+{
+    device_t *tmp = *d;
+
+    *d = tmp->next;
+    forget(tmp);
+    crypt_free(tmp->cd);
+    free(tmp->path);
+    free(tmp);
+}
+
+/* Finds a device in the cache or adds it, loading its LUKS header. */
+static int
+lookup(const char *path, device_t **out)
+{
+    struct stat st = {};
+    device_t *d = NULL;
+    int r = 0;
+
+    for (d = devices; d; d = d->next) {
+        if (strcmp(d->path, path) == 0) {
+            *out = d;
+            return 0;
+        }
+    }
+
+    if (stat(path, &st) < 0)
+        return -errno;
+
+    d = calloc(1, sizeof(*d));
+    if (!d)
+        return -errno;
+
+    d->path = strdup(path);
+    if (!d->path) {
+        free(d);
+        return -ENOMEM;
+    }
+
+    if (S_ISBLK(st.st_mode))
+        d->rdev = st.st_rdev;
+
+    r = crypt_init(&d->cd, path);
+    if (r == 0) {
+        crypt_set_log_callback(d->cd, quiet, NULL);
+        r = crypt_load(d->cd, NULL, NULL);
+    }
+    if (r < 0) {
+        crypt_free(d->cd);
+        free(d->path);
+        free(d);
+        return r;
+    }
+
+    d->next = devices;
+    devices = d;
+    *out = d;
+    return 0;
+}
+
+/*
+ * Opens a handle to a device. Waiting for the lock of another process (say,
+ * luksmeta asking for confirmation) would stall every client, so the lock
+ * is only tried, again and again until the deadline of the request.
+ */
+static int
+open_handle(device_t *d, int flags, luksmeta_t **lm)
+{
+    static const struct timespec pause = { .tv_nsec = LOCK_RETRY * 1000000 };
+    struct timespec now = {};
+    int r = 0;
+
+    while ((r = luksmeta_open(d->cd, flags | O_NONBLOCK, lm)) == -EAGAIN) {
+        if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+            return -errno;
+
+        if (now.tv_sec > deadline.tv_sec ||
+            (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))
+            return -EAGAIN;
+
+        nanosleep(&pause, NULL);
+    }
+
+    return r;
+}
+
+/*
+ * Brings the cached slots of a device up to date.
+ *
+ * Opening a handle reads just the luksmeta header, whose stamp tells if
+ * the slots have changed. Only then are they read again. The LUKSv2 header
+ * is reloaded first, since the token lives in it.
+ */
+static int
+refresh(device_t *d)
+{
+    luksmeta_t *lm = NULL;
+    uint64_t stamp = 0;
+    int r = 0;
+
+    if (strcmp(crypt_get_type(d->cd), CRYPT_LUKS1) != 0) {
+        r = crypt_load(d->cd, NULL, NULL);
+        if (r < 0)
+            return r;
+    }
+
+    r = open_handle(d, O_RDONLY, &lm);
+    if (r == 0)
+        r = luksmeta_handle_stamp(lm, &stamp);
+    if (r == 0 && (!d->cached || stamp != d->stamp)) {
+        forget(d);
+        r = luksmeta_handle_load_all(lm, d->slots, LUKS_NSLOTS);
+        d->cached = r >= 0;
+        d->stamp = stamp;
+    }
+
+    luksmeta_close(lm);
+    if (r < 0)
+        forget(d);
+
+    return r < 0 ? r : 0;
+}
+
+/* Returns the first slot holding the UUID or -ENODATA. */
+static int
+first(const device_t *d, const luksmeta_uuid_t uuid)
+{
+    for (int i = 0; i < LUKS_NSLOTS; i++) {
+        if (d->slots[i].status != -ENODATA &&
+            memcmp(d->slots[i].uuid, uuid, sizeof(luksmeta_uuid_t)) == 0)
+            return i;
+    }
+
+    return -ENODATA;
+}
+
+static bool
+uuid_given(const lmd_request_t *req)
+{
+    static const luksmeta_uuid_t zero = {};
+    return memcmp(req->uuid, zero, sizeof(zero)) != 0;
+}
+
+static int
+do_load(device_t *d, const lmd_request_t *req, lmd_reply_t *rep,
+        const void **out)
+{
+    const luksmeta_slot_t *s = NULL;
+    int slot = req->slot;
+    int r = 0;
+
+    if (slot < 0 && !uuid_given(req))
+        return -EINVAL;
+
+    if (slot >= LUKS_NSLOTS)
+        return -EBADSLT;
+
+    r = refresh(d);
+    if (r < 0)
+        return r;
+
+    if (slot < 0) {
+        slot = first(d, req->uuid);
+        if (slot < 0)
+            return slot;
+    }
+
+    s = &d->slots[slot];
+    memcpy(rep->uuid, s->uuid, sizeof(rep->uuid));
+    if (s->status < 0)
+        return s->status;
+
+    if (uuid_given(req) && memcmp(req->uuid, s->uuid, sizeof(s->uuid)) != 0)
+        return -EKEYREJECTED;
+
+    *out = s->data;
+    rep->datalen = s->status;
+    return s->status;
+}
+
+static int
+do_show(device_t *d, lmd_slot_t slots[LUKS_NSLOTS], lmd_reply_t *rep)
+{
+    int count = 0;
+    int r = 0;
+
+    /* Reload the LUKS header, as the keyslots may have changed. */
+    r = crypt_load(d->cd, NULL, NULL);
+    if (r == 0)
+        r = refresh(d);
+    if (r < 0)
+        return r;
+
+    for (int i = 0; i < LUKS_NSLOTS; i++) {
+        memcpy(slots[i].uuid, d->slots[i].uuid, sizeof(slots[i].uuid));
+        slots[i].status = d->slots[i].status;
+        slots[i].keyslot = crypt_keyslot_status(d->cd, i);
+        if (d->slots[i].status != -ENODATA)
+            count++;
+    }
+
+    rep->datalen = LUKS_NSLOTS * sizeof(lmd_slot_t);
+    return count;
+}
+
+static int
+do_find(device_t *d, const lmd_request_t *req, int32_t slots[LUKS_NSLOTS],
+        lmd_reply_t *rep)
+{
+    int count = 0;
+    int r = 0;
+
+    if (!uuid_given(req))
+        return -EKEYREJECTED;
+
+    r = refresh(d);
+    if (r < 0)
+        return r;
+
+    for (int i = 0; i < LUKS_NSLOTS; i++) {
+        if (d->slots[i].status != -ENODATA &&
+            memcmp(d->slots[i].uuid, req->uuid, sizeof(req->uuid)) == 0)
+            slots[count++] = i;
+    }
+
+    rep->datalen = count * sizeof(int32_t);
+    return count;
+}
+
+/*
+ * Changes the slots of a device. Since requests are handled one at a time,
+ * all writes through the daemon are serialized; the library locks the
+ * device against writers elsewhere.
+ */
+static int
+do_write(device_t *d, const lmd_request_t *req, const void *data)
+{
+    luksmeta_t *lm = NULL;
+    int slot = 0;
+    int r = 0;
+
+    forget(d);
+
+    if (req->op == LMD_WIPE && req->slot < 0 && !uuid_given(req))
+        return -EINVAL;
+
+    r = crypt_load(d->cd, NULL, NULL);
+    if (r == 0)
+        r = open_handle(d, O_RDWR, &lm);
+    if (r < 0)
+        return r;
+
+    if (req->op == LMD_SAVE) {
+        r = luksmeta_handle_save(lm, req->slot, req->uuid, data,
+                                 req->datalen, LUKSMETA_SAVE_FIRST_FIT);
+    } else if (req->slot >= 0) {
+        r = luksmeta_handle_wipe(lm, req->slot,
+                                 uuid_given(req) ? req->uuid : NULL);
+    } else {
+        /* Without a slot, wipe every slot holding the UUID. */
+        while ((r = luksmeta_handle_find(lm, req->uuid, &slot, 1)) > 0) {
+            r = luksmeta_handle_wipe(lm, slot, req->uuid);
+            if (r < 0)
+                break;
+        }
+    }
+
+    if (r >= 0) {
+        int f = luksmeta_flush(lm);
+        r = f < 0 ? f : r;
+    }
+
+    luksmeta_close(lm);
+    return r;
+}
+
+/*
+ * Reads one request from a client and replies to it. Returns a negative
+ * errno value if the connection should be closed.
+ */
+static int
+serve(int fd)
+{
+    lmd_slot_t show[LUKS_NSLOTS] = {};
+    int32_t found[LUKS_NSLOTS] = {};
+    char path[LMD_MAX_PATH + 1] = {};
+    lmd_request_t req = {};
+    lmd_reply_t rep = {};
+    const void *out = NULL;
+    uint8_t *data = NULL;
+    device_t *d = NULL;
+    int r = 0;
+
+    /*
+     * The whole request must arrive in time, so that a client sending it a
+     * byte at a time cannot hold up everyone else.
+     */
+    if (clock_gettime(CLOCK_MONOTONIC, &deadline) < 0)
+        return -errno;
+    deadline.tv_sec += CLIENT_TIMEOUT;
+
+    r = lmd_recv(fd, &req, sizeof(req), &deadline);
+    if (r < 0)
+        return r;
+
+    if (req.pathlen == 0 || req.pathlen > LMD_MAX_PATH ||
+        req.datalen > LMD_MAX_DATA || (req.op != LMD_SAVE && req.datalen > 0))
+        return -EPROTO;
+
+    r = lmd_recv(fd, path, req.pathlen, &deadline);
+    if (r < 0)
+        return r;
+
+    if (strlen(path) != req.pathlen)
+        return -EPROTO;
+
+    data = malloc(req.datalen > 0 ? req.datalen : 1);
+    if (!data)
+        return -errno;
+
+    r = lmd_recv(fd, data, req.datalen, &deadline);
+    if (r < 0)
+        goto egress;
+
+    r = lookup(path, &d);
+    if (r == 0) {
+        switch (req.op) {
+        case LMD_LOAD: r = do_load(d, &req, &rep, &out); break;
+        case LMD_SHOW: r = do_show(d, show, &rep); out = show; break;
+        case LMD_FIND: r = do_find(d, &req, found, &rep); out = found; break;
+        case LMD_SAVE: r = do_write(d, &req, data); break;
+        case LMD_WIPE: r = do_write(d, &req, data); break;
+        default: r = -EOPNOTSUPP; break;
+        }
+    }
+
+    if (r < 0)
+        rep.datalen = 0;
+
+    rep.status = r;
+    if (clock_gettime(CLOCK_MONOTONIC, &deadline) < 0) {
+        r = -errno;
+        goto egress;
+    }
+    deadline.tv_sec += CLIENT_TIMEOUT;
+
+    r = lmd_send(fd, &rep, sizeof(rep), &deadline);
+    if (r == 0)
+        r = lmd_send(fd, out, rep.datalen, &deadline);
+
+egress:
+    memset(data, 0, req.datalen);
+    free(data);
+    return r;
+}
+
+/* Drops the devices named in a kernel uevent for a changed block device. */
+static void
+uevent(int fd)
+{
+    struct sockaddr_nl addr = {};
+    socklen_t alen = sizeof(addr);
+    char buf[8192] = {};
+    bool block = false;
+    bool change = false;
+    int major = -1;
+    int minor = -1;
+    ssize_t n = 0;
+
+    n = recvfrom(fd, buf, sizeof(buf) - 1, MSG_DONTWAIT,
+                 (struct sockaddr *) &addr, &alen);
+    if (n <= 0 || addr.nl_pid != 0)
+        return; /* Only the kernel is trusted. */
+
+    for (char *p = buf; p < &buf[n]; p += strlen(p) + 1) {
+        if (strcmp(p, "SUBSYSTEM=block") == 0)
+            block = true;
+        else if (strcmp(p, "ACTION=change") == 0 ||
+                 strcmp(p, "ACTION=remove") == 0)
+            change = true;
+        else if (strncmp(p, "MAJOR=", 6) == 0)
+            major = atoi(&p[6]);
+        else if (strncmp(p, "MINOR=", 6) == 0)
+            minor = atoi(&p[6]);
+    }
+
+    if (!block || !change || major < 0 || minor < 0)
+        return;
+
+    for (device_t **d = &devices; *d; ) {
+        if ((*d)->rdev != 0 && (*d)->rdev == makedev(major, minor))
+            drop(d);
+        else
+            d = &(*d)->next;
+    }
+}
+
+/*
+ * Listens for kernel uevents. These include the change events udev
+ * synthesizes after a device was written, so a LUKS header changed by
+ * cryptsetup is reloaded. Returns -1 if uevents are not available (for
+ * instance in a container); the stamps still catch luksmeta changes.
+ */
+static int
+listen_uevents(void)
+{
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+    int fd = -1;
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+                NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+        return -1;
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int
+listen_socket(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    mode_t mask = 0;
+    int fd = -1;
+    int r = 0;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -ENAMETOOLONG;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -errno;
+
+    /* Only the owner of the daemon (root) may use it. */
+    unlink(path);
+    mask = umask(0077);
+    r = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    umask(mask);
+    if (r == 0)
+        r = listen(fd, MAX_CLIENTS);
+    if (r < 0) {
+        r = -errno;
+        close(fd);
+        return r;
+    }
+
+    return fd;
+}
+
+static void
+on_signal(int sig)
+{
+    quit = 1;
+}
+
+static const struct option lopts[] = {
+    { "help",                      .val = 'h' },
+    { "socket", required_argument, .val = 's' },
+    {}
+};
+
+int
+main(int argc, char *argv[])
+{
+    struct pollfd fds[MAX_CLIENTS + 2] = {};
+    struct sigaction sa = { .sa_handler = on_signal };
+    const char *path = LMD_SOCKET;
+    size_t nfds = 2;
+
+    for (int c; (c = getopt_long(argc, argv, "hs:", lopts, NULL)) != -1; ) {
+        switch (c) {
+        case 's': path = optarg; break;
+        default: goto usage;
+        }
+    }
+
+    if (optind != argc)
+        goto usage;
+
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    fds[0].fd = listen_socket(path);
+    if (fds[0].fd < 0) {
+        fprintf(stderr, "Unable to listen on %s: %s\n",
+                path, strerror(-fds[0].fd));
+        return EX_OSERR;
+    }
+
+    fds[0].events = POLLIN;
+    fds[1].fd = listen_uevents();
+    fds[1].events = POLLIN;
+
+    while (!quit) {
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            fprintf(stderr, "Unable to wait for requests: %m\n");
+            break;
+        }
+
+        if (fds[1].revents & POLLIN)
+            uevent(fds[1].fd);
+
+        /* Requests are served one at a time, which serializes writes. */
+        for (size_t i = 2; i < nfds; i++) {
+            if (fds[i].revents == 0)
+                continue;
+
+            if (serve(fds[i].fd) < 0) {
+                close(fds[i].fd);
+                fds[i--] = fds[--nfds];
+            }
+        }
+
+        if ((fds[0].revents & POLLIN) && nfds < MAX_CLIENTS + 2) {
+            int fd = accept4(fds[0].fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd >= 0)
+                fds[nfds++] = (struct pollfd) { fd, POLLIN };
+        }
+    }
+
+    for (size_t i = 2; i < nfds; i++)
+        close(fds[i].fd);
+    if (fds[1].fd >= 0)
+        close(fds[1].fd);
+    close(fds[0].fd);
+    unlink(path);
+
+    while (devices)
+        drop(&devices);
+
+    return EX_OK;
+
+usage:
+    fprintf(stderr, "Usage: luksmetad [-s SOCKET]\n");
+    return EX_USAGE;
+}
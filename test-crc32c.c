@@ -19,11 +19,89 @@
 
 #include "crc32c.h"
 
+#include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+
+#define MAXLEN (8192 * 3 * 2 + 256 * 3 + 61)
+
+static uint8_t buffer[MAXLEN + 8];
+
+static void
+test_kernel(const crc32c_kernel_t *k)
+{
+    static const size_t lens[] = {
+        0, 1, 7, 8, 9, 63, 64, 255, 256, 767, 768, 769, 1000, 4096,
+        8192 * 3 - 1, 8192 * 3, 8192 * 3 + 1, MAXLEN
+    };
+
+    char test[] = { '1', '2', '3', '4', '5', '6', '7', '8', '9' };
+    assert(k->func(0, test, sizeof(test)) == 0xe3069283);
+
+    /* Exhaustively compare short lengths at every alignment. */
+    for (size_t len = 0; len <= 2048; len++) {
+        for (size_t off = 0; off < 8; off++) {
+            uint32_t exp = crc32c_table(~len, &buffer[off], len);
+            assert(k->func(~len, &buffer[off], len) == exp);
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(lens) / sizeof(*lens); i++) {
+        for (size_t off = 0; off < 8; off++) {
+            uint32_t exp = crc32c_table(0x12345678, &buffer[off], lens[i]);
+            uint32_t crc = k->func(0x12345678, &buffer[off], lens[i]);
+
+            if (crc != exp) {
+                fprintf(stderr, "%s: len=%zu off=%zu: %08x != %08x\n",
+                        k->name, lens[i], off, crc, exp);
+                abort();
+            }
+        }
+    }
+
+    /* Check that the CRC can be computed incrementally. */
+    for (size_t split = 0; split < MAXLEN; split += 997) {
+        uint32_t crc = k->func(0, buffer, split);
+        crc = k->func(crc, &buffer[split], MAXLEN - split);
+        assert(crc == crc32c_table(0, buffer, MAXLEN));
+    }
+}
+
+static void
+test_combine(void)
+{
+    uint32_t all = crc32c_table(0, buffer, MAXLEN);
+
+    for (size_t split = 0; split <= MAXLEN; split += 331) {
+        uint32_t a = crc32c(0, buffer, split);
+        uint32_t b = crc32c(0, &buffer[split], MAXLEN - split);
+        assert(crc32c_combine(a, b, MAXLEN - split) == all);
+    }
+
+    assert(crc32c_combine(0x12345678, 0, 0) == 0x12345678);
+}
 
 int
 main(int argc, char *argv[])
 {
     char test[] = { '1', '2', '3', '4', '5', '6', '7', '8', '9' };
+
+    srand(0);
+    for (size_t i = 0; i < sizeof(buffer); i++)
+        buffer[i] = rand();
+
+    for (size_t i = 0; crc32c_kernels[i].name; i++) {
+        const crc32c_kernel_t *k = &crc32c_kernels[i];
+
+        if (k->supported && !k->supported()) {
+            fprintf(stderr, "%s: unsupported\n", k->name);
+            continue;
+        }
+
+        test_kernel(k);
+        fprintf(stderr, "%s: ok\n", k->name);
+    }
+
+    test_combine();
     return crc32c(0, test, sizeof(test)) == 0xe3069283 ? 0 : 1;
 }
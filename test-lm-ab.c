@@ -0,0 +1,143 @@
+/* vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab smarttab colorcolumn=80: */
+/*
+ * Copyright (c) 2016 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "test.h"
+#include <endian.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define COPY 512  /* Offset of the second header copy */
+#define GEN 272   /* Offset of the generation within a header copy */
+
+static const luksmeta_uuid_t UUID = {
+    0xe2, 0x15, 0x7c, 0x48, 0x3b, 0xa0, 0x4d, 0x19,
+    0x86, 0xf4, 0x2e, 0x57, 0xc9, 0x0d, 0x61, 0xba
+};
+
+static uint64_t
+generation(off_t off)
+{
+    uint64_t gen = 0;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+    if (pread(fd, &gen, sizeof(gen), off + GEN) != sizeof(gen))
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+    close(fd);
+
+    return be64toh(gen);
+}
+
+static void
+corrupt(off_t off)
+{
+    int fd;
+
+    fd = open(filename, O_RDWR);
+    if (fd < 0)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+    if (pwrite(fd, "\xff", 1, off + 100) != 1)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+    close(fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+    uint8_t data[sizeof(UUID)] = {};
+    struct crypt_device *cd = NULL;
+    luksmeta_uuid_t uuid = {};
+    uint32_t offset = 0;
+    uint32_t length = 0;
+
+    crypt_free(test_format());
+    cd = test_init();
+    test_hole(cd, &offset, &length);
+
+    /* Initialization writes both copies. */
+    assert(luksmeta_nuke(cd) == 0);
+    assert(luksmeta_init_version(cd, LUKSMETA_VERSION_3) == 0);
+    assert(luksmeta_version(cd) == LUKSMETA_VERSION_3);
+    assert(generation(offset) == 2);
+    assert(generation(offset + COPY) == 1);
+
+    /* Each change overwrites the older copy. */
+    assert(luksmeta_save(cd, 0, UUID, UUID, sizeof(UUID)) == 0);
+    assert(generation(offset) == 2);
+    assert(generation(offset + COPY) == 3);
+
+    assert(test_layout((range_t[]) {
+        { 0, 1024 },                   /* LUKS header */
+        { 1024, 3072, true },          /* Keyslot Area */
+        { offset, 280 },               /* luksmeta header */
+        { offset + 280, 232, true },   /* Padding */
+        { offset + 512, 280 },         /* luksmeta header copy */
+        { offset + 792, 232, true },   /* Padding */
+        { offset + 1024, 16 },         /* luksmeta slot 0 */
+        END(offset + 1040),            /* Rest of the file */
+    }));
+
+    /* A damaged newest copy falls back to the previous state. */
+    corrupt(offset + COPY);
+    assert(luksmeta_test(cd) == 0);
+    assert(luksmeta_load(cd, 0, uuid, data, sizeof(data)) == -ENODATA);
+
+    /* The next change replaces the damaged copy. */
+    assert(luksmeta_save(cd, 1, UUID, UUID, sizeof(UUID)) == 1);
+    assert(generation(offset + COPY) == 3);
+    assert(luksmeta_load(cd, 1, uuid, data, sizeof(data)) == sizeof(UUID));
+    assert(memcmp(data, UUID, sizeof(UUID)) == 0);
+
+    /* A damaged older copy goes unnoticed. */
+    corrupt(offset);
+    assert(luksmeta_load(cd, 1, uuid, data, sizeof(data)) == sizeof(UUID));
+
+    /* Both copies damaged. */
+    corrupt(offset + COPY);
+    assert(luksmeta_test(cd) == -EINVAL);
+
+    /* Upgrading moves slots out of the way of the second copy. */
+    assert(luksmeta_nuke(cd) == 0);
+    assert(luksmeta_init_version(cd, LUKSMETA_VERSION_2) == 0);
+    assert(luksmeta_save(cd, 0, UUID, UUID, sizeof(UUID)) == 0);
+    assert(luksmeta_upgrade(cd, LUKSMETA_VERSION_3) == 0);
+    assert(luksmeta_version(cd) == LUKSMETA_VERSION_3);
+    assert(generation(offset) == 2);
+    assert(generation(offset + COPY) == 1);
+
+    assert(test_layout((range_t[]) {
+        { offset, 280 },               /* luksmeta header */
+        { offset + 280, 232, true },   /* Padding */
+        { offset + 512, 280 },         /* luksmeta header copy */
+        { offset + 792, 232, true },   /* Padding */
+        { offset + 1024, 16 },         /* luksmeta slot 0 */
+        END(offset + 1040),            /* Rest of the file */
+    }));
+
+    assert(luksmeta_load(cd, 0, uuid, data, sizeof(data)) == sizeof(UUID));
+    assert(memcmp(data, UUID, sizeof(UUID)) == 0);
+
+    crypt_free(cd);
+    unlink(filename);
+    return 0;
+}
@@ -0,0 +1,124 @@
+/* vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab smarttab colorcolumn=80: */
+/*
+ * Copyright (c) 2016 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "test.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const luksmeta_uuid_t UUID = {
+    0x4c, 0x8e, 0x02, 0x1b, 0xd5, 0x6a, 0x49, 0x3f,
+    0xb7, 0x10, 0x9c, 0x2d, 0x61, 0xfe, 0x83, 0x05
+};
+
+static uint8_t big[10000];
+
+int
+main(int argc, char *argv[])
+{
+    luksmeta_slot_t slots[8] = {};
+    struct crypt_device *cd = NULL;
+    uint8_t small[4] = {};
+    uint32_t offset = 0;
+    uint32_t length = 0;
+    int fd;
+
+    for (size_t i = 0; i < sizeof(big); i++)
+        big[i] = i * 7;
+
+    crypt_free(test_format());
+    cd = test_init();
+    test_hole(cd, &offset, &length);
+
+    /* Test an empty device. */
+    assert(luksmeta_load_all(cd, slots, 8) == 0);
+    for (size_t i = 0; i < 8; i++) {
+        assert(slots[i].status == -ENODATA);
+        assert(slots[i].data == NULL);
+    }
+
+    /* Fill slots 1, 3 and 6, leaving an unused page between 1 and 6. */
+    assert(luksmeta_save(cd, 1, UUID, UUID, sizeof(UUID)) == 1);
+    assert(luksmeta_save(cd, 4, UUID, UUID, 8) == 4);
+    assert(luksmeta_save(cd, 6, UUID, big, 100) == 6);
+    assert(luksmeta_save(cd, 3, UUID, big, sizeof(big)) == 3);
+    assert(luksmeta_wipe(cd, 4, UUID) == 0);
+
+    /* Test library allocated buffers. */
+    assert(luksmeta_load_all(cd, slots, 8) == 3);
+    for (size_t i = 0; i < 8; i++) {
+        switch (i) {
+        case 1:
+            assert(slots[i].status == sizeof(UUID));
+            assert(memcmp(slots[i].data, UUID, sizeof(UUID)) == 0);
+            break;
+        case 3:
+            assert(slots[i].status == sizeof(big));
+            assert(memcmp(slots[i].data, big, sizeof(big)) == 0);
+            break;
+        case 6:
+            assert(slots[i].status == 100);
+            assert(memcmp(slots[i].data, big, 100) == 0);
+            break;
+        default:
+            assert(slots[i].status == -ENODATA);
+            assert(slots[i].data == NULL);
+            continue;
+        }
+
+        assert(memcmp(slots[i].uuid, UUID, sizeof(UUID)) == 0);
+        free(slots[i].data);
+    }
+
+    /* Test caller provided buffers and a short array. */
+    memset(slots, 0, sizeof(slots));
+    slots[1].data = small;
+    slots[1].size = sizeof(small);
+    assert(luksmeta_load_all(cd, slots, 4) == 2);
+    assert(slots[1].status == -E2BIG);
+    assert(slots[1].data == small);
+    assert(slots[3].status == sizeof(big));
+    free(slots[3].data);
+    assert(slots[4].status == 0 && slots[4].data == NULL);
+    assert(slots[0].status == -ENODATA && slots[2].status == -ENODATA);
+
+    /* Test that corruption of one slot does not affect the others. */
+    fd = open(filename, O_RDWR);
+    if (fd < 0)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+    if (pwrite(fd, &(char) { 17 }, 1, offset + 4096) != 1)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+    close(fd);
+
+    memset(slots, 0, sizeof(slots));
+    assert(luksmeta_load_all(cd, slots, 8) == 3);
+    assert(slots[1].status == -EINVAL);
+    assert(slots[3].status == sizeof(big));
+    assert(slots[6].status == 100);
+    for (size_t i = 0; i < 8; i++)
+        free(slots[i].data);
+
+    crypt_free(cd);
+    unlink(filename);
+    return 0;
+}
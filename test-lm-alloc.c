@@ -0,0 +1,201 @@
+/* vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab smarttab colorcolumn=80: */
+/*
+ * Copyright (c) 2016 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "test.h"
+#include <endian.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * This test performs random saves and wipes and checks the placement of
+ * each save against a simple model of the free space: a page-by-page scan
+ * for first-fit and an exhaustive search of the free extents otherwise.
+ */
+
+#define ITERATIONS 400
+
+typedef struct {
+    uint32_t offset;
+    uint32_t length;
+    bool used;
+} extent_t;
+
+static const luksmeta_uuid_t UUID = {
+    0x2b, 0x64, 0xa9, 0x17, 0x3e, 0xc0, 0x4f, 0x51,
+    0x86, 0x0d, 0x7c, 0xe2, 0x95, 0x48, 0x1a, 0xb3
+};
+
+static extent_t model[8];
+static uint32_t length;
+static uint32_t offset;
+
+static bool
+is_free(uint32_t start, uint32_t end)
+{
+    if (start < 4096 || end > length)
+        return false;
+
+    for (size_t i = 0; i < 8; i++) {
+        uint32_t s = model[i].offset;
+        uint32_t e = s + ALIGN(model[i].length, true);
+
+        if (model[i].used && start < e && s < end)
+            return false;
+    }
+
+    return true;
+}
+
+static uint32_t
+expected(size_t size, int policy)
+{
+    uint32_t best = 0;
+    uint32_t bestlen = 0;
+
+    size = ALIGN(size, true);
+
+    if (policy == LUKSMETA_SAVE_FIRST_FIT) {
+        for (uint32_t off = 4096; off + size <= length; off += 4096) {
+            if (is_free(off, off + size))
+                return off;
+        }
+
+        return 0;
+    }
+
+    /* Find each free extent's start and measure its length. */
+    for (uint32_t off = 4096; off < length; off += 4096) {
+        uint32_t len = 0;
+
+        if (!is_free(off, off + 4096) || (off > 4096 &&
+                                          is_free(off - 4096, off)))
+            continue;
+
+        while (off + len < length && is_free(off + len, off + len + 4096))
+            len += 4096;
+
+        if (len < size)
+            continue;
+
+        if (best == 0 ||
+            (policy == LUKSMETA_SAVE_BEST_FIT && len < bestlen) ||
+            (policy == LUKSMETA_SAVE_WORST_FIT && len > bestlen))
+            best = off, bestlen = len;
+    }
+
+    return best;
+}
+
+static uint32_t
+placed(int slot)
+{
+    uint32_t off = 0;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+
+    /* Skip the magic, version, checksum and the UUID of the slot. */
+    if (pread(fd, &off, sizeof(off), offset + 16 + slot * 32 + 16) != 4)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+
+    close(fd);
+    return be32toh(off);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static uint8_t data[FILESIZE / 2];
+    struct crypt_device *cd = NULL;
+    luksmeta_t *lm = NULL;
+    int r;
+
+    srand(1);
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = rand();
+
+    crypt_free(test_format());
+    cd = test_init();
+    test_hole(cd, &offset, &length);
+
+    for (int policy = 0; policy < 3; policy++) {
+        memset(model, 0, sizeof(model));
+        assert(luksmeta_nuke(cd) == 0);
+        assert(luksmeta_init(cd) == 0);
+
+        r = luksmeta_open(cd, O_RDWR, &lm);
+        if (r < 0)
+            error(EXIT_FAILURE, -r, "%s:%d", __FILE__, __LINE__);
+
+        for (size_t i = 0; i < ITERATIONS; i++) {
+            int slot = rand() % 8;
+
+            if (model[slot].used) {
+                assert(luksmeta_handle_wipe(lm, slot, UUID) == 0);
+                model[slot].used = false;
+            } else {
+                size_t size = rand() % 20000 + 1;
+                uint32_t exp;
+
+                /* Occasionally save something large to fill up the gap. */
+                if (rand() % 4 == 0)
+                    size = rand() % (length / 2) + 1;
+
+                exp = expected(size, policy);
+
+                r = luksmeta_handle_save(lm, slot, UUID, data, size, policy);
+                if (exp == 0) {
+                    assert(r == -ENOSPC);
+                    continue;
+                }
+
+                assert(r == slot);
+                assert(placed(slot) == exp);
+                model[slot] = (extent_t) { exp, size, true };
+            }
+
+            /* Make sure that no save has clobbered another slot. */
+            for (int s = 0; s < 8; s++) {
+                luksmeta_uuid_t uuid = {};
+                static uint8_t buf[sizeof(data)];
+
+                r = luksmeta_handle_load(lm, s, uuid, buf, sizeof(buf));
+                if (!model[s].used) {
+                    assert(r == -ENODATA);
+                    continue;
+                }
+
+                assert(r == (int) model[s].length);
+                assert(memcmp(buf, data, model[s].length) == 0);
+            }
+        }
+
+        luksmeta_close(lm);
+    }
+
+    crypt_free(cd);
+    unlink(filename);
+    return 0;
+}
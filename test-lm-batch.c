@@ -0,0 +1,181 @@
+/* vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab smarttab colorcolumn=80: */
+/*
+ * Copyright (c) 2016 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "test.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NDEVS 4
+#define NITEMS 70 /* Enough for several rounds of batched reads */
+
+static const luksmeta_uuid_t UUID = {
+    0x2f, 0x61, 0xc8, 0x0a, 0x93, 0x4e, 0x4b, 0x15,
+    0xa2, 0x7d, 0x5e, 0x38, 0xf1, 0x06, 0xbc, 0x94
+};
+
+static char names[NDEVS][sizeof("/tmp/luksmetaXXXXXX")];
+static uint8_t big[10000];
+
+/* Copies the test file to a new file and loads it. */
+static struct crypt_device *
+copy_device(char *name)
+{
+    struct crypt_device *cd = NULL;
+    static uint8_t buf[FILESIZE];
+    int out;
+    int in;
+    int r;
+
+    strcpy(name, "/tmp/luksmetaXXXXXX");
+    in = open(filename, O_RDONLY);
+    out = mkstemp(name);
+    if (in < 0 || out < 0)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+
+    if (pread(in, buf, sizeof(buf), 0) != sizeof(buf))
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+    if (pwrite(out, buf, sizeof(buf), 0) != sizeof(buf))
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+
+    close(out);
+    close(in);
+
+    r = crypt_init(&cd, name);
+    if (r < 0)
+        error(EXIT_FAILURE, -r, "%s:%d", __FILE__, __LINE__);
+
+    r = crypt_load(cd, CRYPT_LUKS1, NULL);
+    if (r < 0)
+        error(EXIT_FAILURE, -r, "%s:%d", __FILE__, __LINE__);
+
+    return cd;
+}
+
+int
+main(int argc, char *argv[])
+{
+    static luksmeta_slot_t slots[NITEMS][8];
+    luksmeta_batch_t batch[NITEMS] = {};
+    struct crypt_device *cds[NDEVS] = {};
+    uint8_t small[4] = {};
+    luksmeta_t *lm = NULL;
+    uint32_t offset = 0;
+    uint32_t length = 0;
+    int fd;
+
+    for (size_t i = 0; i < sizeof(big); i++)
+        big[i] = i % 13;
+
+    crypt_free(test_format());
+    cds[0] = test_init();
+    test_hole(cds[0], &offset, &length);
+
+    assert(luksmeta_save(cds[0], 1, UUID, UUID, sizeof(UUID)) == 1);
+    assert(luksmeta_save(cds[0], 3, UUID, big, sizeof(big)) == 3);
+    assert(luksmeta_save(cds[0], 6, UUID, big, 100) == 6);
+
+    /* Device 1 has slot 1 corrupted and device 2 has no header at all. */
+    cds[1] = copy_device(names[1]);
+    fd = open(names[1], O_RDWR);
+    if (fd < 0)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+    if (pwrite(fd, &(char) { 17 }, 1, offset + 4096) != 1)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+    close(fd);
+
+    cds[2] = copy_device(names[2]);
+    assert(luksmeta_nuke(cds[2]) == 0);
+
+    /* Device 3 uses the packed layout with a compressed slot. */
+    cds[3] = copy_device(names[3]);
+    assert(luksmeta_nuke(cds[3]) == 0);
+    assert(luksmeta_init_version(cds[3], LUKSMETA_VERSION_3) == 0);
+    assert(luksmeta_open(cds[3], O_RDWR, &lm) == 0);
+    assert(luksmeta_handle_save(lm, 3, UUID, big, sizeof(big),
+                                LUKSMETA_SAVE_COMPRESS) == 3);
+    luksmeta_close(lm);
+
+    for (size_t i = 0; i < NITEMS; i++) {
+        batch[i].cd = cds[i % NDEVS];
+        batch[i].slots = slots[i];
+        batch[i].nslots = 8;
+    }
+
+    /* A caller provided buffer which is too small. */
+    slots[4][1].data = small;
+    slots[4][1].size = sizeof(small);
+
+    assert(luksmeta_load_batch(batch, NITEMS) == NITEMS - NITEMS / NDEVS);
+    for (size_t i = 0; i < NITEMS; i++) {
+        const luksmeta_slot_t *s = slots[i];
+
+        switch (i % NDEVS) {
+        case 0:
+        case 1:
+            assert(batch[i].status == 3);
+            assert(s[3].status == sizeof(big));
+            assert(memcmp(s[3].data, big, sizeof(big)) == 0);
+            assert(s[6].status == 100);
+            assert(memcmp(s[6].data, big, 100) == 0);
+            assert(memcmp(s[6].uuid, UUID, sizeof(UUID)) == 0);
+            assert(s[0].status == -ENODATA && s[0].data == NULL);
+
+            if (i == 4) {
+                assert(s[1].status == -E2BIG);
+                assert(s[1].data == small);
+            } else if (i % NDEVS == 1) {
+                assert(s[1].status == -EINVAL);
+            } else {
+                assert(s[1].status == sizeof(UUID));
+                assert(memcmp(s[1].data, UUID, sizeof(UUID)) == 0);
+            }
+            break;
+
+        case 2:
+            assert(batch[i].status == -ENOENT);
+            for (size_t j = 0; j < 8; j++)
+                assert(s[j].data == NULL);
+            break;
+
+        case 3:
+            assert(batch[i].status == 1);
+            assert(s[3].status == sizeof(big));
+            assert(memcmp(s[3].data, big, sizeof(big)) == 0);
+            assert(s[1].status == -ENODATA);
+            break;
+        }
+
+        for (size_t j = 0; j < 8; j++) {
+            if (s[j].data != small)
+                free(s[j].data);
+        }
+    }
+
+    for (size_t i = 0; i < NDEVS; i++) {
+        crypt_free(cds[i]);
+        unlink(i == 0 ? filename : names[i]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,222 @@
+/* vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab smarttab colorcolumn=80: */
+/*
+ * Copyright (c) 2016 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "test.h"
+#include <linux/loop.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const luksmeta_uuid_t UUID = {
+    0x4e, 0x2d, 0x91, 0x07, 0xc6, 0x3b, 0x4a, 0x58,
+    0x9f, 0x12, 0xe4, 0x7d, 0x30, 0xab, 0x65, 0xc1
+};
+
+/* Checks the counters of the cache. */
+static bool
+counted(uint64_t hits, uint64_t misses)
+{
+    luksmeta_cache_stats_t stats = {};
+
+    luksmeta_cache_stats(&stats);
+    return stats.hits == hits && stats.misses == misses;
+}
+
+/* Overwrites a byte of a file behind the library's back. */
+static uint8_t
+poke(const char *path, off_t off, uint8_t val)
+{
+    uint8_t old = 0;
+    int fd;
+
+    fd = open(path, O_RDWR);
+    if (fd < 0)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+    if (pread(fd, &old, 1, off) != 1 || pwrite(fd, &val, 1, off) != 1)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+
+    close(fd);
+    return old;
+}
+
+/* Attaches the test file to a free loop device, if we are allowed to. */
+static int
+loop_attach(char *path, size_t size)
+{
+    int loop = -1;
+    int ctl = -1;
+    int fd = -1;
+    int n = -1;
+
+    ctl = open("/dev/loop-control", O_RDWR);
+    if (ctl >= 0)
+        n = ioctl(ctl, LOOP_CTL_GET_FREE);
+    if (n >= 0) {
+        snprintf(path, size, "/dev/loop%d", n);
+        loop = open(path, O_RDWR);
+        fd = open(filename, O_RDWR);
+    }
+
+    if (loop >= 0 && (fd < 0 || ioctl(loop, LOOP_SET_FD, fd) < 0)) {
+        close(loop);
+        loop = -1;
+    }
+
+    if (fd >= 0)
+        close(fd);
+    if (ctl >= 0)
+        close(ctl);
+    return loop;
+}
+
+int
+main(int argc, char *argv[])
+{
+    uint8_t data[sizeof(UUID)] = {};
+    struct crypt_device *cd = NULL;
+    struct crypt_device *cd2 = NULL;
+    luksmeta_uuid_t uuid = {};
+    luksmeta_t *lm = NULL;
+    uint32_t offset = 0;
+    uint32_t length = 0;
+    char path[32] = {};
+    uint8_t old = 0;
+    int loop;
+    int fd;
+
+    crypt_free(test_format());
+    cd = test_init();
+    test_hole(cd, &offset, &length);
+
+    /* Nothing is counted while the cache is disabled. */
+    assert(luksmeta_test(cd) == 0);
+    assert(counted(0, 0));
+
+    luksmeta_cache_enable(1);
+    assert(luksmeta_test(cd) == 0);
+    assert(counted(0, 1));
+    assert(luksmeta_test(cd) == 0);
+    assert(counted(1, 1));
+
+    /* Writes made by the library invalidate the entry. */
+    assert(luksmeta_save(cd, 1, UUID, UUID, sizeof(UUID)) == 1);
+    assert(counted(2, 1));
+    assert(luksmeta_load(cd, 1, uuid, data, sizeof(data)) == sizeof(UUID));
+    assert(counted(2, 2));
+    assert(memcmp(data, UUID, sizeof(UUID)) == 0);
+    assert(luksmeta_load(cd, 1, uuid, data, sizeof(data)) == sizeof(UUID));
+    assert(counted(3, 2));
+
+    /* Entries are shared by all crypt devices for the same file. */
+    assert(crypt_init(&cd2, filename) == 0);
+    assert(crypt_load(cd2, CRYPT_LUKS1, NULL) == 0);
+    assert(luksmeta_load(cd2, 1, uuid, data, sizeof(data)) == sizeof(UUID));
+    assert(counted(4, 2));
+
+    /* Changes made behind the library's back are noticed. */
+    old = poke(filename, offset + 20, 0xff);
+    assert(luksmeta_test(cd) == -EINVAL);
+    assert(counted(4, 3));
+    poke(filename, offset + 20, old);
+    assert(luksmeta_load(cd, 1, uuid, data, sizeof(data)) == sizeof(UUID));
+    assert(counted(5, 3));
+
+    assert(luksmeta_wipe(cd2, 1, UUID) == 0);
+    assert(luksmeta_load(cd, 1, uuid, data, sizeof(data)) == -ENODATA);
+    crypt_free(cd2);
+
+    /* Images are cached as long as the file is unchanged. */
+    fd = open(filename, O_RDWR);
+    if (fd < 0)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+    luksmeta_cache_enable(0);
+    luksmeta_cache_enable(1);
+    assert(counted(0, 0));
+
+    assert(luksmeta_open_image(fd, &lm) == 0);
+    luksmeta_close(lm);
+    assert(luksmeta_open_image(fd, &lm) == 0);
+    assert(counted(1, 1));
+    assert(luksmeta_handle_save(lm, 2, UUID, UUID, 8, 0) == 2);
+    luksmeta_close(lm);
+
+    assert(luksmeta_open_image(fd, &lm) == 0);
+    assert(counted(1, 2));
+    assert(luksmeta_handle_load(lm, 2, uuid, data, sizeof(data)) == 8);
+    luksmeta_close(lm);
+    close(fd);
+
+    /* Disabling the cache empties it. */
+    assert(luksmeta_load(cd, 2, uuid, data, sizeof(data)) == 8);
+    assert(luksmeta_load(cd, 2, uuid, data, sizeof(data)) == 8);
+    assert(counted(2, 3));
+    luksmeta_cache_enable(0);
+    assert(luksmeta_load(cd, 2, uuid, data, sizeof(data)) == 8);
+    luksmeta_cache_enable(1);
+    assert(luksmeta_load(cd, 2, uuid, data, sizeof(data)) == 8);
+    assert(counted(0, 1));
+    luksmeta_cache_enable(0);
+
+    /*
+     * The modification time of a device node stays the same when the device
+     * is written, so images on block devices are checked by their content.
+     */
+    loop = loop_attach(path, sizeof(path));
+    if (loop >= 0) {
+        luksmeta_cache_enable(1);
+        fd = open(path, O_RDWR);
+        if (fd < 0)
+            error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+
+        assert(luksmeta_open_image(fd, &lm) == 0);
+        luksmeta_close(lm);
+        assert(luksmeta_open_image(fd, &lm) == 0);
+        luksmeta_close(lm);
+        assert(counted(1, 1));
+
+        /* The luksmeta header, changed through a second descriptor. */
+        old = poke(path, offset + 20, 0xff);
+        assert(luksmeta_open_image(fd, &lm) == -EINVAL);
+        assert(counted(1, 2));
+        poke(path, offset + 20, old);
+        assert(luksmeta_open_image(fd, &lm) == 0);
+        luksmeta_close(lm);
+        assert(counted(2, 2));
+
+        /* The LUKSv1 header: the active flag of keyslot 7. */
+        old = poke(path, 208 + 7 * 48, 0x55);
+        assert(luksmeta_open_image(fd, &lm) == 0);
+        luksmeta_close(lm);
+        assert(counted(2, 3));
+        poke(path, 208 + 7 * 48, old);
+
+        luksmeta_cache_enable(0);
+        close(fd);
+        assert(ioctl(loop, LOOP_CLR_FD) == 0);
+        close(loop);
+    }
+
+    crypt_free(cd);
+    unlink(filename);
+    return 0;
+}
@@ -0,0 +1,101 @@
+/* vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab smarttab colorcolumn=80: */
+/*
+ * Copyright (c) 2016 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "test.h"
+#include <error.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const luksmeta_uuid_t UUID = {
+    0x9a, 0x3e, 0x51, 0x07, 0xc2, 0x4d, 0x48, 0x96,
+    0xa1, 0x0b, 0x7f, 0xe4, 0x2c, 0x68, 0xd3, 0x5f
+};
+
+static uint8_t big[5000];
+
+int
+main(int argc, char *argv[])
+{
+    uint8_t data[sizeof(big)] = {};
+    struct crypt_device *cd = NULL;
+    luksmeta_uuid_t uuid = {};
+    uint32_t offset = 0;
+    uint32_t length = 0;
+    uint64_t moved = 0;
+    int r;
+
+    for (size_t i = 0; i < sizeof(big); i++)
+        big[i] = i * 7 + 1;
+
+    crypt_free(test_format());
+    cd = test_init();
+    test_hole(cd, &offset, &length);
+
+    /* Compacting an empty device does nothing. */
+    assert(luksmeta_compact(cd, &moved) == 0);
+    assert(moved == 0);
+
+    /* Fill four slots, then wipe the first and third. */
+    assert(luksmeta_save(cd, 0, UUID, UUID, sizeof(UUID)) == 0);
+    assert(luksmeta_save(cd, 1, UUID, big, sizeof(big)) == 1);
+    assert(luksmeta_save(cd, 2, UUID, UUID, sizeof(UUID)) == 2);
+    assert(luksmeta_save(cd, 3, UUID, big, sizeof(big)) == 3);
+    assert(luksmeta_wipe(cd, 0, UUID) == 0);
+    assert(luksmeta_wipe(cd, 2, UUID) == 0);
+
+    assert(test_layout((range_t[]) {
+        { 0, 1024 },                     /* LUKS header */
+        { 1024, 3072, true },            /* Keyslot Area */
+        { offset, 4096 },                /* luksmeta header */
+        { offset + 4096, 4096, true },   /* luksmeta slot 0 */
+        { offset + 8192, 8192 },         /* luksmeta slot 1 */
+        { offset + 16384, 4096, true },  /* luksmeta slot 2 */
+        { offset + 20480, 8192 },        /* luksmeta slot 3 */
+        END(offset + 28672),             /* Rest of the file */
+    }));
+
+    /* Slot 1 overlaps its destination, so it is moved twice. */
+    r = luksmeta_compact(cd, &moved);
+    if (r < 0)
+        error(EXIT_FAILURE, -r, "luksmeta_compact()");
+    assert(moved == sizeof(big) * 3);
+
+    assert(test_layout((range_t[]) {
+        { 0, 1024 },                     /* LUKS header */
+        { 1024, 3072, true },            /* Keyslot Area */
+        { offset, 4096 },                /* luksmeta header */
+        { offset + 4096, 8192 },         /* luksmeta slot 1 */
+        { offset + 12288, 8192 },        /* luksmeta slot 3 */
+        END(offset + 20480),             /* Rest of the file */
+    }));
+
+    for (int slot = 1; slot < 4; slot += 2) {
+        r = luksmeta_load(cd, slot, uuid, data, sizeof(data));
+        assert(r == sizeof(big));
+        assert(memcmp(uuid, UUID, sizeof(UUID)) == 0);
+        assert(memcmp(data, big, sizeof(big)) == 0);
+    }
+
+    /* A compact device is left alone. */
+    assert(luksmeta_compact(cd, &moved) == 0);
+    assert(moved == 0);
+
+    crypt_free(cd);
+    unlink(filename);
+    return 0;
+}
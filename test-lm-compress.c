@@ -0,0 +1,172 @@
+/* vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab smarttab colorcolumn=80: */
+/*
+ * Copyright (c) 2016 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "test.h"
+#include <endian.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+#define COMPRESSION true
+#else
+#define COMPRESSION false
+#endif
+
+static const luksmeta_uuid_t UUID = {
+    0x5d, 0x92, 0x1e, 0x7a, 0x0b, 0x4f, 0x46, 0xc1,
+    0xa8, 0x33, 0xe7, 0x6c, 0x20, 0xd9, 0x58, 0x14
+};
+
+static char json[2048];
+static uint8_t noise[512];
+
+/* Reads a field of the on-disk slot entry. */
+static uint32_t
+field(uint32_t offset, int slot, int index)
+{
+    uint32_t val = 0;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+
+    if (pread(fd, &val, sizeof(val), offset + 16 + slot * 32 + 16 + index * 4)
+        != sizeof(val))
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+
+    close(fd);
+    return be32toh(val);
+}
+
+static int
+save(struct crypt_device *cd, int slot, const void *buf, size_t size)
+{
+    luksmeta_t *lm = NULL;
+    int r;
+
+    r = luksmeta_open(cd, O_RDWR, &lm);
+    if (r < 0)
+        return r;
+
+    r = luksmeta_handle_save(lm, slot, UUID, buf, size,
+                             LUKSMETA_SAVE_COMPRESS);
+    luksmeta_close(lm);
+    return r;
+}
+
+int
+main(int argc, char *argv[])
+{
+    luksmeta_slot_t slots[8] = {};
+    struct crypt_device *cd = NULL;
+    luksmeta_uuid_t uuid = {};
+    uint8_t buf[sizeof(json)];
+    uint32_t offset = 0;
+    uint32_t length = 0;
+    size_t len = 0;
+    int fd;
+
+    while (len < sizeof(json) - 64)
+        len += sprintf(&json[len], "{\"kid\":\"%04zu\",\"alg\":\"ES512\"},",
+                       len);
+
+    srand(0);
+    for (size_t i = 0; i < sizeof(noise); i++)
+        noise[i] = rand();
+
+    crypt_free(test_format());
+    cd = test_init();
+    test_hole(cd, &offset, &length);
+
+    /* Version 1 devices never store compressed data. */
+    assert(save(cd, 0, json, len) == 0);
+    assert(field(offset, 0, 1) == len);
+    assert(field(offset, 0, 3) == 0);
+
+    /* Version 2 devices store compressed data when it helps. */
+    assert(luksmeta_upgrade(cd, LUKSMETA_VERSION_2) == 0);
+    assert(save(cd, 1, json, len) == 1);
+    assert(save(cd, 2, noise, sizeof(noise)) == 2);
+    assert(luksmeta_save(cd, 3, UUID, json, len) == 3);
+
+    if (COMPRESSION) {
+        assert(field(offset, 1, 1) < len / 3);
+        assert(field(offset, 1, 3) != 0);
+    } else {
+        assert(field(offset, 1, 1) == len);
+        assert(field(offset, 1, 3) == 0);
+    }
+
+    assert(field(offset, 2, 1) == sizeof(noise));
+    assert(field(offset, 2, 3) == 0);
+    assert(field(offset, 3, 1) == len);
+    assert(field(offset, 3, 3) == 0);
+
+    /* Loading returns the original data. */
+    assert(luksmeta_load(cd, 1, uuid, NULL, 0) == (int) len);
+    assert(luksmeta_load(cd, 1, uuid, buf, len - 1) == -E2BIG);
+    assert(luksmeta_load(cd, 1, uuid, buf, sizeof(buf)) == (int) len);
+    assert(memcmp(uuid, UUID, sizeof(UUID)) == 0);
+    assert(memcmp(buf, json, len) == 0);
+
+    assert(luksmeta_load_all(cd, slots, 8) == 4);
+    for (int slot = 0; slot < 4; slot++) {
+        if (slot == 2) {
+            assert(slots[slot].status == sizeof(noise));
+            assert(memcmp(slots[slot].data, noise, sizeof(noise)) == 0);
+        } else {
+            assert(slots[slot].status == (int) len);
+            assert(memcmp(slots[slot].data, json, len) == 0);
+        }
+
+        free(slots[slot].data);
+    }
+
+    /* Caller buffers which are too small for the original data. */
+    memset(slots, 0, sizeof(slots));
+    slots[1].data = buf;
+    slots[1].size = len - 1;
+    assert(luksmeta_load_all(cd, slots, 2) == 2);
+    assert(slots[1].status == -E2BIG);
+    free(slots[0].data);
+
+    /* Compressed data survives compaction. */
+    assert(luksmeta_wipe(cd, 0, UUID) == 0);
+    assert(luksmeta_compact(cd, NULL) == 0);
+    assert(luksmeta_load(cd, 1, uuid, buf, sizeof(buf)) == (int) len);
+    assert(memcmp(buf, json, len) == 0);
+
+    /* Corrupted data is detected before it is decompressed. */
+    fd = open(filename, O_RDWR);
+    if (fd < 0)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+    if (pwrite(fd, "\xff", 1, offset + field(offset, 1, 0) + 5) != 1)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+    close(fd);
+
+    assert(luksmeta_load(cd, 1, uuid, buf, sizeof(buf)) == -EINVAL);
+
+    crypt_free(cd);
+    unlink(filename);
+    return 0;
+}
@@ -0,0 +1,147 @@
+/* vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab smarttab colorcolumn=80: */
+/*
+ * Copyright (c) 2016 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "test.h"
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ENTRIES 112 /* The capacity of the entry table */
+
+static void
+make_uuid(luksmeta_uuid_t uuid, uint8_t n)
+{
+    memset(uuid, 0, sizeof(luksmeta_uuid_t));
+    uuid[0] = 0xa5;
+    uuid[15] = n;
+}
+
+int
+main(int argc, char *argv[])
+{
+    luksmeta_uuid_t uuids[4] = {};
+    struct crypt_device *cd = NULL;
+    luksmeta_uuid_t uuid = {};
+    uint8_t data[32] = {};
+    uint32_t offset = 0;
+    uint32_t length = 0;
+    luksmeta_t *lm = NULL;
+
+    crypt_free(test_format());
+    cd = test_init();
+    test_hole(cd, &offset, &length);
+
+    /* Entries require version 4. */
+    assert(luksmeta_nuke(cd) == 0);
+    assert(luksmeta_init_version(cd, LUKSMETA_VERSION_3) == 0);
+    make_uuid(uuid, 1);
+    assert(luksmeta_entry_save(cd, 0, uuid, "x", 1) == -ENOTSUP);
+    assert(luksmeta_entry_list(cd, 0, uuids, 4) == 0);
+    assert(luksmeta_upgrade(cd, LUKSMETA_VERSION_4) == 0);
+    assert(luksmeta_version(cd) == LUKSMETA_VERSION_4);
+
+    /* Several entries per keyslot, saved out of order. */
+    for (uint8_t i = 3; i > 0; i--) {
+        make_uuid(uuid, i);
+        memset(data, i, sizeof(data));
+        assert(luksmeta_entry_save(cd, 2, uuid, data, i * 8) == 0);
+    }
+
+    make_uuid(uuid, 9);
+    assert(luksmeta_entry_save(cd, 5, uuid, "entry", 5) == 0);
+    assert(luksmeta_save(cd, 2, uuid, "slot", 4) == 2);
+
+    /* Invalid requests. */
+    assert(luksmeta_entry_save(cd, 5, uuid, "entry", 5) == -EALREADY);
+    assert(luksmeta_entry_save(cd, 8, uuid, "entry", 5) == -EBADSLT);
+    assert(luksmeta_entry_save(cd, 0, (luksmeta_uuid_t) {}, "x", 1)
+           == -EKEYREJECTED);
+    assert(luksmeta_entry_load(cd, 4, uuid, data, sizeof(data)) == -ENODATA);
+    assert(luksmeta_entry_wipe(cd, 4, uuid) == -EALREADY);
+
+    /* Listing is sorted and reports the total. */
+    assert(luksmeta_entry_list(cd, 2, uuids, 4) == 3);
+    for (uint8_t i = 0; i < 3; i++) {
+        make_uuid(uuid, i + 1);
+        assert(memcmp(uuids[i], uuid, sizeof(uuid)) == 0);
+    }
+    assert(luksmeta_entry_list(cd, 2, uuids, 1) == 3);
+    assert(luksmeta_entry_list(cd, 5, uuids, 4) == 1);
+    assert(luksmeta_entry_list(cd, 0, uuids, 4) == 0);
+
+    /* Entries and slots do not interfere. */
+    make_uuid(uuid, 2);
+    assert(luksmeta_entry_load(cd, 2, uuid, NULL, 0) == 16);
+    assert(luksmeta_entry_load(cd, 2, uuid, data, 8) == -E2BIG);
+    assert(luksmeta_entry_load(cd, 2, uuid, data, sizeof(data)) == 16);
+    for (size_t i = 0; i < 16; i++)
+        assert(data[i] == 2);
+
+    make_uuid(uuid, 9);
+    assert(luksmeta_load(cd, 2, uuid, data, sizeof(data)) == 4);
+    assert(memcmp(data, "slot", 4) == 0);
+    assert(luksmeta_entry_load(cd, 5, uuid, data, sizeof(data)) == 5);
+    assert(memcmp(data, "entry", 5) == 0);
+
+    /* Wiping one entry leaves the others. */
+    make_uuid(uuid, 2);
+    assert(luksmeta_entry_wipe(cd, 2, uuid) == 0);
+    assert(luksmeta_entry_load(cd, 2, uuid, data, sizeof(data)) == -ENODATA);
+    assert(luksmeta_entry_list(cd, 2, uuids, 4) == 2);
+    make_uuid(uuid, 3);
+    assert(memcmp(uuids[1], uuid, sizeof(uuid)) == 0);
+    assert(luksmeta_entry_load(cd, 2, uuid, data, sizeof(data)) == 24);
+
+    /* Compaction moves slots around the entries. */
+    assert(luksmeta_compact(cd, NULL) == 0);
+    assert(luksmeta_entry_load(cd, 2, uuid, data, sizeof(data)) == 24);
+    make_uuid(uuid, 9);
+    assert(luksmeta_load(cd, 2, uuid, data, sizeof(data)) == 4);
+    assert(memcmp(data, "slot", 4) == 0);
+
+    /* Fill the table; three entries remain from above. */
+    assert(luksmeta_open(cd, O_RDWR, &lm) == 0);
+    for (int i = 0; i < ENTRIES - 3; i++) {
+        make_uuid(uuid, i);
+        assert(luksmeta_handle_entry_save(lm, 7, uuid, &i, sizeof(i), 0) == 0);
+    }
+
+    make_uuid(uuid, 200);
+    assert(luksmeta_handle_entry_save(lm, 0, uuid, "x", 1, 0) == -ENOSPC);
+    luksmeta_close(lm);
+
+    assert(luksmeta_entry_list(cd, 7, NULL, 0) == ENTRIES - 3);
+    for (int i = 0; i < ENTRIES - 3; i++) {
+        int j = -1;
+
+        make_uuid(uuid, i);
+        assert(luksmeta_entry_load(cd, 7, uuid, &j, sizeof(j)) == sizeof(j));
+        assert(j == i);
+    }
+
+    /* Wiping makes room again. */
+    assert(luksmeta_entry_wipe(cd, 7, uuid) == 0);
+    assert(luksmeta_entry_save(cd, 7, uuid, "y", 1) == 0);
+
+    crypt_free(cd);
+    unlink(filename);
+    return 0;
+}
@@ -0,0 +1,121 @@
+/* vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab smarttab colorcolumn=80: */
+/*
+ * Copyright (c) 2016 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "test.h"
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const luksmeta_uuid_t UUID0 = {
+    0x6a, 0x1e, 0x3f, 0x52, 0x8b, 0x0c, 0x4d, 0x17,
+    0x9e, 0x21, 0x55, 0xc7, 0x03, 0xba, 0x4f, 0x90
+};
+
+static const luksmeta_uuid_t UUID1 = {
+    0x1d, 0x7f, 0x2c, 0x88, 0x40, 0x93, 0x4b, 0x2e,
+    0xa6, 0x5d, 0x0e, 0x71, 0xc4, 0x39, 0x8a, 0x12
+};
+
+int
+main(int argc, char *argv[])
+{
+    uint8_t data[sizeof(UUID0)] = {};
+    struct crypt_device *cd = NULL;
+    luksmeta_uuid_t uuid = {};
+    luksmeta_t *lm = NULL;
+    int slots[3] = {};
+    uint32_t offset = 0;
+    uint32_t length = 0;
+    int r;
+
+    /* Test that opening fails without a luksmeta header. */
+    cd = test_format();
+    assert(luksmeta_open(cd, O_RDONLY, &lm) == -ENOENT);
+    crypt_free(cd);
+
+    cd = test_init();
+    test_hole(cd, &offset, &length);
+
+    assert(luksmeta_open(cd, O_WRONLY, &lm) == -EINVAL);
+
+    /* Perform several operations on a single handle. */
+    r = luksmeta_open(cd, O_RDWR, &lm);
+    if (r < 0)
+        error(EXIT_FAILURE, -r, "%s:%d", __FILE__, __LINE__);
+
+    assert(luksmeta_handle_save(lm, 0, UUID0, UUID0, sizeof(UUID0), 0) == 0);
+    assert(luksmeta_handle_save(lm, 1, UUID1, UUID1, sizeof(UUID1), 0) == 1);
+    assert(luksmeta_handle_save(lm, 1, UUID1, UUID1, sizeof(UUID1), 0)
+           == -EALREADY);
+    assert(luksmeta_handle_save(lm, 2, UUID1, UUID1, sizeof(UUID1), 99)
+           == -EINVAL);
+    assert(luksmeta_handle_load(lm, 0, uuid, data, sizeof(data))
+           == sizeof(data));
+    assert(memcmp(uuid, UUID0, sizeof(UUID0)) == 0);
+    assert(memcmp(data, UUID0, sizeof(UUID0)) == 0);
+    assert(luksmeta_handle_wipe(lm, 0, UUID1) == -EKEYREJECTED);
+    assert(luksmeta_handle_wipe(lm, 0, UUID0) == 0);
+    assert(luksmeta_handle_load(lm, 0, uuid, data, sizeof(data))
+           == -ENODATA);
+    luksmeta_close(lm);
+
+    assert(test_layout((range_t[]) {
+        { 0, 1024 },                   /* LUKS header */
+        { 1024, 3072, true },          /* Keyslot Area */
+        { offset, 4096 },              /* luksmeta header */
+        { offset + 4096, 4096, true }, /* luksmeta slot 0 */
+        { offset + 8192, 4096 },       /* luksmeta slot 1 */
+        END(offset + 12288),           /* Rest of the file */
+    }));
+
+    /* Test that changes made through the handle are visible elsewhere. */
+    assert(luksmeta_load(cd, 1, uuid, data, sizeof(data)) == sizeof(data));
+    assert(memcmp(uuid, UUID1, sizeof(UUID1)) == 0);
+    assert(memcmp(data, UUID1, sizeof(UUID1)) == 0);
+
+    /* Test that a read-only handle cannot modify the device. */
+    r = luksmeta_open(cd, O_RDONLY, &lm);
+    if (r < 0)
+        error(EXIT_FAILURE, -r, "%s:%d", __FILE__, __LINE__);
+
+    assert(luksmeta_handle_save(lm, 2, UUID0, UUID0, sizeof(UUID0), 0) < 0);
+    assert(luksmeta_handle_wipe(lm, 1, UUID1) < 0);
+    assert(luksmeta_handle_load(lm, 1, uuid, data, sizeof(data))
+           == sizeof(data));
+    assert(luksmeta_handle_load(lm, 2, uuid, data, sizeof(data))
+           == -ENODATA);
+    luksmeta_close(lm);
+
+    /* Test finding slots by UUID. */
+    assert(luksmeta_save(cd, 4, UUID1, UUID1, sizeof(UUID1)) == 4);
+    assert(luksmeta_save(cd, 6, UUID1, UUID1, sizeof(UUID1)) == 6);
+    assert(luksmeta_find(cd, UUID0, slots, 3) == 0);
+    assert(luksmeta_find(cd, (luksmeta_uuid_t) {}, slots, 3)
+           == -EKEYREJECTED);
+    assert(luksmeta_find(cd, UUID1, slots, 3) == 3);
+    assert(slots[0] == 1 && slots[1] == 4 && slots[2] == 6);
+    assert(luksmeta_find(cd, UUID1, slots, 1) == 3);
+    assert(luksmeta_find(cd, UUID1, NULL, 0) == 3);
+
+    crypt_free(cd);
+    unlink(filename);
+    return 0;
+}
@@ -0,0 +1,133 @@
+/* vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab smarttab colorcolumn=80: */
+/*
+ * Copyright (c) 2016 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "test.h"
+#include <sys/mman.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const luksmeta_uuid_t UUID = {
+    0x58, 0x0b, 0xe3, 0x9d, 0x14, 0x72, 0x4f, 0xa6,
+    0x8c, 0x31, 0xd9, 0x05, 0x6e, 0xb2, 0x47, 0xf8
+};
+
+/* Copies the first size bytes of the test file into a memfd. */
+static int
+copy_image(size_t size)
+{
+    uint8_t *buf = NULL;
+    int out;
+    int in;
+
+    buf = malloc(size);
+    in = open(filename, O_RDONLY);
+    out = memfd_create("image", 0);
+    if (!buf || in < 0 || out < 0)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+
+    if (pread(in, buf, size, 0) != (ssize_t) size)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+    if (pwrite(out, buf, size, 0) != (ssize_t) size)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+
+    close(in);
+    free(buf);
+    return out;
+}
+
+int
+main(int argc, char *argv[])
+{
+    uint8_t data[sizeof(UUID)] = {};
+    struct crypt_device *cd = NULL;
+    luksmeta_uuid_t uuid = {};
+    luksmeta_t *lm = NULL;
+    uint32_t offset = 0;
+    uint32_t length = 0;
+    int slots[8] = {};
+    int fd;
+
+    crypt_free(test_format());
+    cd = test_init();
+    test_hole(cd, &offset, &length);
+    assert(luksmeta_save(cd, 1, UUID, UUID, sizeof(UUID)) == 1);
+
+    /* Read through the image of a live device. */
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+    assert(luksmeta_open_image(fd, &lm) == 0);
+    close(fd);
+
+    assert(luksmeta_handle_load(lm, 1, uuid, data, sizeof(data))
+           == sizeof(UUID));
+    assert(memcmp(uuid, UUID, sizeof(UUID)) == 0);
+    assert(memcmp(data, UUID, sizeof(UUID)) == 0);
+    assert(luksmeta_handle_find(lm, UUID, slots, 8) == 1);
+    assert(luksmeta_handle_save(lm, 2, UUID, UUID, sizeof(UUID), 0) < 0);
+    luksmeta_close(lm);
+
+    /* Changes made through an image are seen by libcryptsetup users. */
+    fd = open(filename, O_RDWR);
+    if (fd < 0)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+    assert(luksmeta_open_image(fd, &lm) == 0);
+    close(fd);
+
+    assert(luksmeta_handle_save(lm, CRYPT_ANY_SLOT, UUID, UUID, 8, 0) == 0);
+    luksmeta_close(lm);
+
+    assert(luksmeta_load(cd, 0, uuid, data, sizeof(data)) == 8);
+    assert(test_layout((range_t[]) {
+        { 0, 1024 },                   /* LUKS header */
+        { 1024, 3072, true },          /* Keyslot Area */
+        { offset, 4096 },              /* luksmeta header */
+        { offset + 4096, 4096 },       /* luksmeta slot 1 */
+        { offset + 8192, 4096 },       /* luksmeta slot 0 */
+        END(offset + 12288),           /* Rest of the file */
+    }));
+
+    /* A header backup holds everything up to the encrypted data. */
+    fd = copy_image(offset + length);
+    assert(luksmeta_open_image(fd, &lm) == 0);
+    assert(luksmeta_handle_load(lm, 0, uuid, data, sizeof(data)) == 8);
+    assert(luksmeta_handle_wipe(lm, 1, UUID) == 0);
+    luksmeta_close(lm);
+    close(fd);
+    assert(luksmeta_load(cd, 1, uuid, data, sizeof(data)) == sizeof(UUID));
+
+    /* A truncated backup. */
+    fd = copy_image(100);
+    assert(luksmeta_open_image(fd, &lm) == -ENOENT);
+    close(fd);
+
+    /* Not a LUKSv1 header. */
+    fd = memfd_create("image", 0);
+    assert(fd >= 0 && ftruncate(fd, 1024 * 1024) == 0);
+    assert(luksmeta_open_image(fd, &lm) == -ENOTSUP);
+    close(fd);
+
+    crypt_free(cd);
+    unlink(filename);
+    return 0;
+}
@@ -35,6 +35,7 @@ int
 main(int argc, char *argv[])
 {
     uint8_t data[sizeof(UUID)] = {};
+    luksmeta_zero_t strategy = LUKSMETA_ZERO_NONE;
     struct crypt_device *cd = NULL;
     luksmeta_uuid_t uuid = {};
     uint32_t offset = 0;
@@ -110,6 +111,18 @@ main(int argc, char *argv[])
         END(offset),                   /* Rest of the file */
     }));
 
+    /* Test that the zeroing strategy is reported */
+    assert(luksmeta_init(cd) == 0);
+    assert(luksmeta_nuke_strategy(cd, &strategy) == 0);
+    assert(strategy == LUKSMETA_ZERO_FALLOCATE ||
+           strategy == LUKSMETA_ZERO_WRITE);
+    assert(luksmeta_test(cd) == -ENOENT);
+    assert(test_layout((range_t[]) {
+        { 0, 1024 },                   /* LUKS header */
+        { 1024, 3072, true },          /* Keyslot Area */
+        END(offset),                   /* Rest of the file */
+    }));
+
     crypt_free(cd);
     unlink(filename);
     return 0;
@@ -0,0 +1,178 @@
+/* vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab smarttab colorcolumn=80: */
+/*
+ * Copyright (c) 2016 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "test.h"
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NWRITERS 6
+
+static const luksmeta_uuid_t UUID = {
+    0x91, 0x3a, 0x57, 0xe0, 0x2c, 0x84, 0x4d, 0x6b,
+    0xbe, 0x19, 0x70, 0xa5, 0xd3, 0x4f, 0x08, 0x2e
+};
+
+/* Checks whether the test file could be locked right now. */
+static bool
+lockable(int fd, int op)
+{
+    if (flock(fd, op | LOCK_NB) == 0) {
+        assert(flock(fd, LOCK_UN) == 0);
+        return true;
+    }
+
+    assert(errno == EWOULDBLOCK);
+    return false;
+}
+
+/* Saves to any free slot from a process of its own. */
+static void
+writer(uint8_t n)
+{
+    struct crypt_device *cd = NULL;
+    uint8_t buf[3000];
+
+    memset(buf, n, sizeof(buf));
+
+    if (crypt_init(&cd, filename) < 0 ||
+        crypt_load(cd, CRYPT_LUKS1, NULL) < 0)
+        _exit(EXIT_FAILURE);
+
+    if (luksmeta_save(cd, CRYPT_ANY_SLOT, UUID, buf, sizeof(buf)) < 0)
+        _exit(EXIT_FAILURE);
+
+    crypt_free(cd);
+    _exit(EXIT_SUCCESS);
+}
+
+int
+main(int argc, char *argv[])
+{
+    luksmeta_slot_t slots[8] = {};
+    struct crypt_device *cd = NULL;
+    luksmeta_t *a = NULL;
+    luksmeta_t *b = NULL;
+    bool seen[NWRITERS] = {};
+    int ro[2];
+    int fd;
+
+    crypt_free(test_format());
+    cd = test_init();
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+    assert(lockable(fd, LOCK_EX));
+
+    /* Readers share the lock. */
+    assert(luksmeta_open(cd, O_RDONLY, &a) == 0);
+    assert(luksmeta_open(cd, O_RDONLY, &b) == 0);
+    assert(lockable(fd, LOCK_SH));
+    assert(!lockable(fd, LOCK_EX));
+    luksmeta_close(a);
+    assert(!lockable(fd, LOCK_EX));
+    luksmeta_close(b);
+    assert(lockable(fd, LOCK_EX));
+
+    /* A writer holds the lock alone until the handle is closed. */
+    assert(luksmeta_open(cd, O_RDWR, &a) == 0);
+    assert(!lockable(fd, LOCK_SH));
+    luksmeta_close(a);
+    assert(lockable(fd, LOCK_EX));
+
+    /* Waiting for a lock held by the same thread fails instead. */
+    assert(luksmeta_open(cd, O_RDWR, &a) == 0);
+    assert(luksmeta_test(cd) == -EDEADLK);
+    assert(luksmeta_open(cd, O_RDWR, &b) == -EDEADLK);
+    luksmeta_close(a);
+    assert(luksmeta_open(cd, O_RDONLY, &a) == 0);
+    assert(luksmeta_test(cd) == 0);
+    assert(luksmeta_save(cd, 7, UUID, UUID, sizeof(UUID)) == -EDEADLK);
+    luksmeta_close(a);
+    assert(lockable(fd, LOCK_EX));
+
+    /* With O_NONBLOCK, a lock held elsewhere fails instead of waiting. */
+    assert(flock(fd, LOCK_SH) == 0);
+    assert(luksmeta_open(cd, O_RDONLY | O_NONBLOCK, &a) == 0);
+    luksmeta_close(a);
+    assert(luksmeta_open(cd, O_RDWR | O_NONBLOCK, &a) == -EAGAIN);
+    assert(flock(fd, LOCK_UN) == 0);
+    assert(flock(fd, LOCK_EX) == 0);
+    assert(luksmeta_open(cd, O_RDONLY | O_NONBLOCK, &a) == -EAGAIN);
+    assert(flock(fd, LOCK_UN) == 0);
+    assert(luksmeta_open(cd, O_RDWR | O_NONBLOCK, &a) == 0);
+    luksmeta_close(a);
+    assert(luksmeta_open(cd, O_WRONLY | O_NONBLOCK, &a) == -EINVAL);
+
+    /* Read-only images are shared. */
+    ro[0] = open(filename, O_RDONLY);
+    ro[1] = open(filename, O_RDONLY);
+    if (ro[0] < 0 || ro[1] < 0)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+    assert(luksmeta_open_image(ro[0], &a) == 0);
+    assert(luksmeta_open_image(ro[1], &b) == 0);
+    close(ro[0]);
+    close(ro[1]);
+    assert(lockable(fd, LOCK_SH));
+    assert(!lockable(fd, LOCK_EX));
+    luksmeta_close(a);
+    luksmeta_close(b);
+    assert(lockable(fd, LOCK_EX));
+
+    /* Concurrent writers each get a slot of their own. */
+    for (int i = 0; i < NWRITERS; i++) {
+        pid_t pid = fork();
+        if (pid < 0)
+            error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+        if (pid == 0)
+            writer(i + 1);
+    }
+
+    for (int i = 0; i < NWRITERS; i++) {
+        int status = 0;
+
+        assert(wait(&status) > 0);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    }
+
+    assert(luksmeta_load_all(cd, slots, 8) == NWRITERS);
+    for (int i = 0; i < NWRITERS; i++) {
+        const uint8_t *data = slots[i].data;
+        uint8_t n = data[0];
+
+        assert(slots[i].status == 3000);
+        assert(n >= 1 && n <= NWRITERS && !seen[n - 1]);
+        seen[n - 1] = true;
+
+        for (size_t j = 0; j < 3000; j++)
+            assert(data[j] == n);
+
+        free(slots[i].data);
+    }
+
+    close(fd);
+    crypt_free(cd);
+    unlink(filename);
+    return 0;
+}
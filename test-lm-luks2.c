@@ -0,0 +1,292 @@
+/* vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab smarttab colorcolumn=80: */
+/*
+ * Copyright (c) 2016 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "test.h"
+#include "luks2.h"
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_LUKS2
+
+static const luksmeta_uuid_t UUID = {
+    0x3f, 0xa9, 0x61, 0x0e, 0xd4, 0x27, 0x4c, 0x85,
+    0xb1, 0x5a, 0x98, 0x3c, 0x02, 0xe7, 0x7d, 0x46
+};
+
+static uint8_t big[3000];
+
+#define U "\"3fa9610e-d427-4c85-b15a-983c02e77d46\""
+
+/* Parses a token with the reader of luks2.c. */
+static int
+parsed(const char *json)
+{
+    luks2_slot_t slots[8] = {};
+    int r;
+
+    r = luks2_parse(json, slots, 8);
+    luks2_free(slots, 8);
+    return r;
+}
+
+/* Parses a token whose slots array holds the given element. */
+static int
+parsed_slot(const char *slot)
+{
+    char json[256];
+
+    snprintf(json, sizeof(json),
+             "{\"type\":\"luksmeta\",\"keyslots\":[],\"slots\":[%s]}", slot);
+    return parsed(json);
+}
+
+/* Parses a token holding slot 0 with the given base64 data. */
+static int
+parsed_data(const char *data)
+{
+    char slot[128];
+
+    snprintf(slot, sizeof(slot),
+             "{\"slot\":0,\"uuid\":" U ",\"data\":\"%s\"}", data);
+    return parsed_slot(slot);
+}
+
+/*
+ * The token text has already been through json-c when libcryptsetup loaded
+ * the header, but its reader must not trust it either.
+ */
+static void
+check_parser(void)
+{
+    luks2_slot_t slots[8] = {};
+    char deep[4096 + 16] = "{\"x\":";
+
+    assert(luks2_parse("{\"slots\":[{\"slot\":7,\"uuid\":" U ","
+                       "\"data\":\"AQID\",\"x\":[{}]}],\"y\":-1.5e3}",
+                       slots, 8) == 0);
+    assert(slots[7].size == 3 && memcmp(slots[7].data, "\1\2\3", 3) == 0);
+    assert(memcmp(slots[7].uuid, UUID, sizeof(UUID)) == 0);
+    assert(slots[0].data == NULL);
+    luks2_free(slots, 8);
+
+    /* Truncated text, strings and escapes */
+    assert(parsed("") == -EINVAL);
+    assert(parsed("{\"slots\":[") == -EINVAL);
+    assert(parsed("{\"type\":\"luks") == -EINVAL);
+    assert(parsed("{\"type\":\"luks\\") == -EINVAL);
+    assert(parsed("{\"type\":\"\\u12") == -EINVAL);
+    assert(parsed("{\"type\":true") == -EINVAL);
+    assert(parsed("{}x") == -EINVAL);
+
+    /* Bad escapes, control characters and literals */
+    assert(parsed("{\"t\":\"\\\"\\\\\\/\\b\\f\\n\\r\\t\\u00e9\"}")
+           == 0);
+    assert(parsed("{\"t\":\"\\x\"}") == -EINVAL);
+    assert(parsed("{\"t\":\"\\u12g4\"}") == -EINVAL);
+    assert(parsed("{\"t\":\"a\nb\"}") == -EINVAL);
+    assert(parsed("{\"t\":[true,false,null,0,-2.5E+3]}") == 0);
+    assert(parsed("{\"t\":tru}") == -EINVAL);
+    assert(parsed("{\"t\":nan}") == -EINVAL);
+    assert(parsed("{\"t\": inf}") == -EINVAL);
+    assert(parsed("{\"t\":-}") == -EINVAL);
+
+    /* Nesting */
+    memset(deep + strlen(deep), '[', 4096);
+    assert(parsed(deep) == -EINVAL);
+    assert(parsed("{\"x\":[[[[[[[[[[[[[[[[[[[[]]]]]]]]]]]]]]]]]]]]}") == 0);
+
+    /* Base64 padding */
+    assert(parsed_data("") == 0);
+    assert(parsed_data("AQ==") == 0);
+    assert(parsed_data("AQI=") == 0);
+    assert(parsed_data("AQI") == -EINVAL);
+    assert(parsed_data("A===") == -EINVAL);
+    assert(parsed_data("====") == -EINVAL);
+    assert(parsed_data("AQ=I") == -EINVAL);
+    assert(parsed_data("AQ==AQID") == -EINVAL);
+    assert(parsed_data("AR==") == -EINVAL);
+    assert(parsed_data("AQJ=") == -EINVAL);
+    assert(parsed_data("AQ\\u003d=") == -EINVAL);
+
+    /* Slots */
+    assert(parsed_slot("{\"slot\":8,\"uuid\":" U ",\"data\":\"\"}")
+           == -EINVAL);
+    assert(parsed_slot("{\"slot\":-1,\"uuid\":" U ",\"data\":\"\"}")
+           == -EINVAL);
+    assert(parsed_slot("{\"slot\":\"1\",\"uuid\":" U ",\"data\":\"\"}")
+           == -EINVAL);
+    assert(parsed_slot("{\"slot\":1,\"data\":\"\"}") == -EINVAL);
+    assert(parsed_slot("{\"slot\":1,\"uuid\":\"3fa9610e\",\"data\":\"\"}")
+           == -EINVAL);
+    assert(parsed_slot("{\"slot\":1,\"uuid\":" U ",\"data\":\"\"},"
+                       "{\"slot\":1,\"uuid\":" U ",\"data\":\"\"}") == -EINVAL);
+}
+
+static struct crypt_device *
+format_luks2(void)
+{
+    struct crypt_device *cd = NULL;
+    int fd;
+    int r;
+
+    fd = mkstemp(filename);
+    if (fd < 0)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+
+    /* LUKSv2 reserves 16MB for its headers and keyslots by default. */
+    if (ftruncate(fd, 32 * 1024 * 1024) != 0)
+        error(EXIT_FAILURE, errno, "%s:%d", __FILE__, __LINE__);
+    close(fd);
+
+    r = crypt_init(&cd, filename);
+    if (r < 0)
+        error(EXIT_FAILURE, -r, "%s:%d", __FILE__, __LINE__);
+
+    r = crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64",
+                     NULL, NULL, 32, NULL);
+    if (r < 0)
+        error(EXIT_FAILURE, -r, "%s:%d", __FILE__, __LINE__);
+
+    return cd;
+}
+
+static struct crypt_device *
+reload(struct crypt_device *cd)
+{
+    int r;
+
+    crypt_free(cd);
+
+    r = crypt_init(&cd, filename);
+    if (r < 0)
+        error(EXIT_FAILURE, -r, "%s:%d", __FILE__, __LINE__);
+
+    r = crypt_load(cd, CRYPT_LUKS2, NULL);
+    if (r < 0)
+        error(EXIT_FAILURE, -r, "%s:%d", __FILE__, __LINE__);
+
+    return cd;
+}
+
+int
+main(int argc, char *argv[])
+{
+    luksmeta_slot_t slots[8] = {};
+    struct crypt_device *cd = NULL;
+    uint8_t data[sizeof(big)] = {};
+    luksmeta_uuid_t uuid = {};
+    luksmeta_t *lm = NULL;
+    int found[8] = {};
+
+    for (size_t i = 0; i < sizeof(big); i++)
+        big[i] = i * 13;
+
+    check_parser();
+
+    cd = format_luks2();
+    assert(luksmeta_test(cd) == -ENOENT);
+    assert(luksmeta_load(cd, 0, uuid, data, sizeof(data)) == -ENOENT);
+    assert(luksmeta_nuke(cd) == 0);
+
+    assert(luksmeta_init(cd) == 0);
+    assert(luksmeta_init(cd) == -EALREADY);
+    assert(luksmeta_test(cd) == 0);
+    assert(luksmeta_version(cd) == -ENOTSUP);
+
+    /* The same calls work as on LUKSv1. */
+    assert(luksmeta_save(cd, 1, UUID, big, sizeof(big)) == 1);
+    assert(luksmeta_save(cd, 1, UUID, big, 1) == -EALREADY);
+    assert(luksmeta_save(cd, 8, UUID, big, 1) == -EBADSLT);
+    assert(luksmeta_save(cd, 3, UUID, "", 0) == 3);
+    assert(luksmeta_save(cd, CRYPT_ANY_SLOT, UUID, big, 5) == 0);
+    assert(luksmeta_update(cd, 0, UUID, big + 1, 7) == 0);
+
+    /* Everything is read back with a single JSON read. */
+    cd = reload(cd);
+    assert(luksmeta_load(cd, 1, uuid, data, 10) == -E2BIG);
+    assert(luksmeta_load(cd, 1, uuid, data, sizeof(data)) == sizeof(big));
+    assert(memcmp(uuid, UUID, sizeof(UUID)) == 0);
+    assert(memcmp(data, big, sizeof(big)) == 0);
+    assert(luksmeta_load(cd, 3, uuid, NULL, 0) == 0);
+    assert(luksmeta_load(cd, 2, uuid, data, sizeof(data)) == -ENODATA);
+    assert(luksmeta_find(cd, UUID, found, 8) == 3);
+    assert(found[0] == 0 && found[1] == 1 && found[2] == 3);
+
+    assert(luksmeta_load_all(cd, slots, 8) == 3);
+    assert(slots[0].status == 7);
+    assert(memcmp(slots[0].data, big + 1, 7) == 0);
+    assert(slots[1].status == sizeof(big));
+    assert(slots[2].status == -ENODATA);
+    assert(slots[3].status == 0);
+    for (size_t i = 0; i < 8; i++)
+        free(slots[i].data);
+
+    /* Operations which depend on the LUKSv1 layout are not supported. */
+    assert(luksmeta_compact(cd, NULL) == -ENOTSUP);
+    assert(luksmeta_upgrade(cd, LUKSMETA_VERSION_2) == -ENOTSUP);
+    assert(luksmeta_entry_save(cd, 0, UUID, "x", 1) == -ENOTSUP);
+
+    /* Read-only handles cannot change the token. */
+    assert(luksmeta_open(cd, O_RDONLY, &lm) == 0);
+    assert(luksmeta_handle_wipe(lm, 1, UUID) == -EBADF);
+    luksmeta_close(lm);
+
+    assert(luksmeta_wipe(cd, 1, (luksmeta_uuid_t) { 1 }) == -EKEYREJECTED);
+    assert(luksmeta_wipe(cd, 1, UUID) == 0);
+    assert(luksmeta_wipe(cd, 1, UUID) == -EALREADY);
+
+    cd = reload(cd);
+    assert(luksmeta_load(cd, 1, uuid, data, sizeof(data)) == -ENODATA);
+    assert(luksmeta_load(cd, 0, uuid, data, sizeof(data)) == 7);
+
+    /* Writers reread the token, keeping changes made since they opened. */
+    assert(luksmeta_open(cd, O_RDWR, &lm) == 0);
+    assert(luksmeta_save(cd, 5, UUID, big, 3) == 5);
+    assert(luksmeta_handle_save(lm, 5, UUID, big, 4, 0) == -EALREADY);
+    assert(luksmeta_handle_save(lm, 6, UUID, big, 4, 0) == 6);
+    luksmeta_close(lm);
+
+    cd = reload(cd);
+    assert(luksmeta_load(cd, 5, uuid, data, sizeof(data)) == 3);
+    assert(luksmeta_load(cd, 6, uuid, data, sizeof(data)) == 4);
+
+    /* Nuking removes the token. */
+    assert(luksmeta_nuke(cd) == 0);
+    assert(luksmeta_test(cd) == -ENOENT);
+    cd = reload(cd);
+    assert(luksmeta_test(cd) == -ENOENT);
+
+    crypt_free(cd);
+    unlink(filename);
+    return 0;
+}
+
+#else
+
+int
+main(int argc, char *argv[])
+{
+    return 77; /* Skipped: libcryptsetup lacks LUKSv2 support */
+}
+
+#endif
@@ -0,0 +1,135 @@
+/* vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab smarttab colorcolumn=80: */
+/*
+ * Copyright (c) 2016 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "test.h"
+#include <errno.h>
+#include <error.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const luksmeta_uuid_t UUID = {
+    0x27, 0xe0, 0x4b, 0x9d, 0x61, 0x3c, 0x45, 0xf2,
+    0x8a, 0x76, 0x0f, 0xd3, 0xb9, 0x14, 0x5e, 0xc8
+};
+
+static uint8_t data[400];
+
+int
+main(int argc, char *argv[])
+{
+    luksmeta_slot_t slots[8] = {};
+    uint8_t buf[sizeof(data)] = {};
+    struct crypt_device *cd = NULL;
+    luksmeta_uuid_t uuid = {};
+    uint32_t offset = 0;
+    uint32_t length = 0;
+    uint64_t moved = 0;
+
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = i * 5 + 1;
+
+    crypt_free(test_format());
+    cd = test_init();
+    test_hole(cd, &offset, &length);
+
+    /* Start out with two slots in the default layout. */
+    assert(luksmeta_version(cd) == LUKSMETA_VERSION_1);
+    assert(luksmeta_save(cd, 0, UUID, UUID, sizeof(UUID)) == 0);
+    assert(luksmeta_save(cd, 1, UUID, data, 300) == 1);
+
+    /* Upgrade the header. */
+    assert(luksmeta_upgrade(cd, 5) == -EINVAL);
+    assert(luksmeta_upgrade(cd, LUKSMETA_VERSION_2) == 0);
+    assert(luksmeta_version(cd) == LUKSMETA_VERSION_2);
+    assert(luksmeta_upgrade(cd, LUKSMETA_VERSION_2) == -EALREADY);
+    assert(luksmeta_upgrade(cd, LUKSMETA_VERSION_1) == -EINVAL);
+
+    assert(test_layout((range_t[]) {
+        { 0, 1024 },                   /* LUKS header */
+        { 1024, 3072, true },          /* Keyslot Area */
+        { offset, 4096 },              /* luksmeta header */
+        { offset + 4096, 4096 },       /* luksmeta slot 0 */
+        { offset + 8192, 4096 },       /* luksmeta slot 1 */
+        END(offset + 12288),           /* Rest of the file */
+    }));
+
+    /* Pack the existing slots. */
+    assert(luksmeta_compact(cd, &moved) == 0);
+    assert(moved == sizeof(UUID) + 300);
+
+    assert(test_layout((range_t[]) {
+        { 0, 1024 },                   /* LUKS header */
+        { 1024, 3072, true },          /* Keyslot Area */
+        { offset, 272 },               /* luksmeta header */
+        { offset + 272, 240, true },   /* Padding */
+        { offset + 512, 16 },          /* luksmeta slot 0 */
+        { offset + 528, 48, true },    /* Padding */
+        { offset + 576, 300 },         /* luksmeta slot 1 */
+        END(offset + 876),             /* Rest of the file */
+    }));
+
+    assert(luksmeta_load(cd, 0, uuid, buf, sizeof(buf)) == sizeof(UUID));
+    assert(memcmp(buf, UUID, sizeof(UUID)) == 0);
+    assert(luksmeta_load(cd, 1, uuid, buf, sizeof(buf)) == 300);
+    assert(memcmp(buf, data, 300) == 0);
+
+    /* New slots are packed as well. */
+    assert(luksmeta_save(cd, 2, UUID, data, 100) == 2);
+    assert(test_layout((range_t[]) {
+        { offset + 876, 20, true },    /* Padding */
+        { offset + 896, 100 },         /* luksmeta slot 2 */
+        END(offset + 996),             /* Rest of the file */
+    }));
+
+    /* Initialize a packed device from scratch. */
+    assert(luksmeta_nuke(cd) == 0);
+    assert(luksmeta_init_version(cd, 5) == -EINVAL);
+    assert(luksmeta_init_version(cd, LUKSMETA_VERSION_2) == 0);
+    assert(luksmeta_version(cd) == LUKSMETA_VERSION_2);
+
+    /* All eight slots fit in the first page along with the header. */
+    for (int slot = 0; slot < 8; slot++)
+        assert(luksmeta_save(cd, slot, UUID, data, sizeof(data)) == slot);
+
+    assert(test_layout((range_t[]) {
+        { offset, 272 },               /* luksmeta header */
+        { offset + 272, 240, true },   /* Padding */
+        { offset + 512, 3536 },        /* luksmeta slots */
+        END(offset + 4048),            /* Rest of the file */
+    }));
+
+    assert(luksmeta_load_all(cd, slots, 8) == 8);
+    for (int slot = 0; slot < 8; slot++) {
+        assert(slots[slot].status == sizeof(data));
+        assert(memcmp(slots[slot].data, data, sizeof(data)) == 0);
+        free(slots[slot].data);
+    }
+
+    /* Wiping a slot only clears its own bytes. */
+    assert(luksmeta_wipe(cd, 3, UUID) == 0);
+    assert(test_layout((range_t[]) {
+        { offset + 512, 1744 },        /* luksmeta slots 0-2 */
+        { offset + 1856, 448, true },  /* luksmeta slot 3 */
+        { offset + 2304, 1744 },       /* luksmeta slots 4-7 */
+        END(offset + 4048),            /* Rest of the file */
+    }));
+
+    crypt_free(cd);
+    unlink(filename);
+    return 0;
+}
@@ -0,0 +1,233 @@
+/* vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab smarttab colorcolumn=80: */
+/*
+ * Copyright (c) 2016 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "test.h"
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * This test replaces pwrite(), pwritev() and fdatasync() for libluksmeta in
+ * order to record the order in which data is written and flushed, and to
+ * make flushes fail.
+ */
+
+typedef struct {
+    char type;    /* 'W' for writes, 'S' for flushes */
+    off_t offset;
+    size_t size;
+} event_t;
+
+static event_t events[64];
+static size_t nevents;
+static bool trace;
+static int syncs = -1; /* Flushes to succeed before the rest fail, or -1 */
+
+static void
+record(char type, off_t offset, size_t size)
+{
+    if (!trace)
+        return;
+
+    assert(nevents < sizeof(events) / sizeof(*events));
+    events[nevents++] = (event_t) { type, offset, size };
+}
+
+ssize_t
+pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+    /* Synchronous writes would make the explicit barriers pointless. */
+    if (trace)
+        assert((fcntl(fd, F_GETFL) & (O_SYNC | O_DSYNC)) == 0);
+
+    record('W', offset, count);
+    return syscall(SYS_pwrite64, fd, buf, count, offset);
+}
+
+ssize_t
+pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    size_t count = 0;
+
+    if (trace)
+        assert((fcntl(fd, F_GETFL) & (O_SYNC | O_DSYNC)) == 0);
+
+    for (int i = 0; i < iovcnt; i++)
+        count += iov[i].iov_len;
+
+    record('W', offset, count);
+    return syscall(SYS_pwritev, fd, iov, iovcnt, offset, 0);
+}
+
+int
+fdatasync(int fd)
+{
+    record('S', 0, 0);
+
+    if (syncs == 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    if (syncs > 0)
+        syncs--;
+
+    return syscall(SYS_fdatasync, fd);
+}
+
+static void
+expect(const event_t *exp)
+{
+    size_t i;
+
+    for (i = 0; exp[i].type; i++) {
+        assert(i < nevents);
+        assert(events[i].type == exp[i].type);
+        if (exp[i].type == 'W') {
+            assert(events[i].offset == exp[i].offset);
+            assert(events[i].size == exp[i].size);
+        }
+    }
+
+    assert(i == nevents);
+    nevents = 0;
+}
+
+static const luksmeta_uuid_t UUID = {
+    0x91, 0x3a, 0x5c, 0x07, 0xee, 0x42, 0x4b, 0x68,
+    0x8d, 0x1f, 0x27, 0xb0, 0x66, 0xc9, 0x34, 0xda
+};
+
+int
+main(int argc, char *argv[])
+{
+    struct crypt_device *cd = NULL;
+    luksmeta_t *lm = NULL;
+    uint32_t offset = 0;
+    uint32_t length = 0;
+    size_t hdr;
+
+    crypt_free(test_format());
+    cd = test_init();
+    test_hole(cd, &offset, &length);
+
+    /* Determine the header size from a re-initialization. */
+    assert(luksmeta_nuke(cd) == 0);
+    trace = true;
+    assert(luksmeta_init(cd) == 0);
+    assert(nevents == 2 && events[0].type == 'W' && events[1].type == 'S');
+    assert(events[0].offset == offset);
+    hdr = events[0].size;
+    nevents = 0;
+
+    /* Data must be flushed before the header which references it. */
+    assert(luksmeta_save(cd, 0, UUID, UUID, sizeof(UUID)) == 0);
+    expect((event_t[]) {
+        { 'W', offset + 4096, sizeof(UUID) },
+        { 'S' },
+        { 'W', offset, hdr },
+        { 'S' },
+        {}
+    });
+
+    /* The data must be erased before the header is updated. */
+    assert(luksmeta_wipe(cd, 0, UUID) == 0);
+    expect((event_t[]) {
+        { 'W', offset + 4096, sizeof(UUID) },
+        { 'S' },
+        { 'W', offset, hdr },
+        { 'S' },
+        {}
+    });
+
+    /* An update needs one header write and no barrier for the erasure. */
+    assert(luksmeta_save(cd, 0, UUID, UUID, sizeof(UUID)) == 0);
+    nevents = 0;
+    assert(luksmeta_update(cd, 0, UUID, UUID, 8) == 0);
+    expect((event_t[]) {
+        { 'W', offset + 8192, 8 },
+        { 'S' },
+        { 'W', offset, hdr },
+        { 'S' },
+        { 'W', offset + 4096, sizeof(UUID) },
+        {}
+    });
+    assert(luksmeta_wipe(cd, 0, UUID) == 0);
+    nevents = 0;
+
+    /* Failed operations must not write anything. */
+    assert(luksmeta_wipe(cd, 0, UUID) == -EALREADY);
+    assert(luksmeta_save(cd, 0, (luksmeta_uuid_t) {}, UUID, 1)
+           == -EKEYREJECTED);
+    assert(luksmeta_update(cd, 0, UUID, UUID, 1) == -ENODATA);
+    expect((event_t[]) { {} });
+
+    /* With two header copies, each change needs only one flush. */
+    trace = false;
+    assert(luksmeta_nuke(cd) == 0);
+    assert(luksmeta_init_version(cd, LUKSMETA_VERSION_3) == 0);
+    assert(luksmeta_open(cd, O_RDWR, &lm) == 0);
+    trace = true;
+
+    assert(luksmeta_handle_save(lm, 0, UUID, UUID, sizeof(UUID), 0) == 0);
+    assert(luksmeta_handle_save(lm, 1, UUID, UUID, sizeof(UUID), 0) == 1);
+    assert(luksmeta_handle_wipe(lm, 0, UUID) == 0);
+    luksmeta_close(lm);
+    expect((event_t[]) {
+        { 'W', offset + 1024, sizeof(UUID) },
+        { 'S' },
+        { 'W', offset + 512, hdr + 8 },
+        { 'W', offset + 1088, sizeof(UUID) },
+        { 'S' },
+        { 'W', offset, hdr + 8 },
+        { 'W', offset + 1024, sizeof(UUID) },
+        { 'S' },
+        { 'W', offset + 512, hdr + 8 },
+        { 'S' },
+        {}
+    });
+
+    /*
+     * The header is flushed when the handle is closed. The one-shot
+     * functions must report when this fails after the change succeeded.
+     */
+    syncs = 1;
+    assert(luksmeta_save(cd, 2, UUID, UUID, sizeof(UUID)) == -EIO);
+    expect((event_t[]) {
+        { 'W', offset + 1024, sizeof(UUID) },
+        { 'S' },
+        { 'W', offset, hdr + 8 },
+        { 'S' },
+        {}
+    });
+
+    syncs = 1;
+    assert(luksmeta_wipe(cd, 2, UUID) == -EIO);
+    nevents = 0;
+    syncs = -1;
+
+    trace = false;
+    crypt_free(cd);
+    unlink(filename);
+    return 0;
+}
@@ -0,0 +1,111 @@
+/* vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab smarttab colorcolumn=80: */
+/*
+ * Copyright (c) 2016 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "test.h"
+#include <errno.h>
+#include <error.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const luksmeta_uuid_t UUID0 = {
+    0x6f, 0x21, 0xd8, 0x4a, 0x93, 0x0c, 0x4e, 0x7b,
+    0xb5, 0x3e, 0x12, 0xa9, 0x47, 0xf0, 0x8d, 0x66
+};
+
+static const luksmeta_uuid_t UUID1 = {
+    0xc3, 0x58, 0x0e, 0x91, 0x2b, 0x7d, 0x40, 0xa4,
+    0x9e, 0x64, 0xd1, 0x05, 0xbb, 0x3a, 0x72, 0xe8
+};
+
+static uint8_t big[5000];
+
+int
+main(int argc, char *argv[])
+{
+    uint8_t data[sizeof(big)] = {};
+    struct crypt_device *cd = NULL;
+    luksmeta_uuid_t uuid = {};
+    uint32_t offset = 0;
+    uint32_t length = 0;
+    int r;
+
+    for (size_t i = 0; i < sizeof(big); i++)
+        big[i] = i * 3 + 1;
+
+    crypt_free(test_format());
+    cd = test_init();
+    test_hole(cd, &offset, &length);
+
+    /* Invalid updates. */
+    assert(luksmeta_update(cd, 8, UUID0, UUID0, sizeof(UUID0)) == -EBADSLT);
+    assert(luksmeta_update(cd, 0, UUID0, UUID0, sizeof(UUID0)) == -ENODATA);
+    assert(luksmeta_update(cd, 0, (luksmeta_uuid_t) {}, UUID0, 1)
+           == -EKEYREJECTED);
+
+    assert(luksmeta_save(cd, 0, UUID0, UUID0, sizeof(UUID0)) == 0);
+    assert(luksmeta_save(cd, 1, UUID1, UUID1, sizeof(UUID1)) == 1);
+
+    /* Replace slot 0 with larger data of a different type. */
+    r = luksmeta_update(cd, 0, UUID1, big, sizeof(big));
+    if (r < 0)
+        error(EXIT_FAILURE, -r, "luksmeta_update()");
+    assert(r == 0);
+
+    assert(test_layout((range_t[]) {
+        { 0, 1024 },                   /* LUKS header */
+        { 1024, 3072, true },          /* Keyslot Area */
+        { offset, 4096 },              /* luksmeta header */
+        { offset + 4096, 4096, true }, /* old luksmeta slot 0 */
+        { offset + 8192, 4096 },       /* luksmeta slot 1 */
+        { offset + 12288, 8192 },      /* luksmeta slot 0 */
+        END(offset + 20480),           /* Rest of the file */
+    }));
+
+    assert(luksmeta_load(cd, 0, uuid, data, sizeof(data)) == sizeof(big));
+    assert(memcmp(uuid, UUID1, sizeof(UUID1)) == 0);
+    assert(memcmp(data, big, sizeof(big)) == 0);
+    assert(luksmeta_load(cd, 1, uuid, data, sizeof(data)) == sizeof(UUID1));
+    assert(memcmp(uuid, UUID1, sizeof(UUID1)) == 0);
+    assert(memcmp(data, UUID1, sizeof(UUID1)) == 0);
+
+    /* Replace it again with smaller data, which reuses the first page. */
+    assert(luksmeta_update(cd, 0, UUID0, UUID0, sizeof(UUID0)) == 0);
+
+    assert(test_layout((range_t[]) {
+        { 0, 1024 },                   /* LUKS header */
+        { 1024, 3072, true },          /* Keyslot Area */
+        { offset, 4096 },              /* luksmeta header */
+        { offset + 4096, 4096 },       /* luksmeta slot 0 */
+        { offset + 8192, 4096 },       /* luksmeta slot 1 */
+        END(offset + 12288),           /* Rest of the file */
+    }));
+
+    assert(luksmeta_load(cd, 0, uuid, data, sizeof(data)) == sizeof(UUID0));
+    assert(memcmp(uuid, UUID0, sizeof(UUID0)) == 0);
+    assert(memcmp(data, UUID0, sizeof(UUID0)) == 0);
+
+    /* An update which does not fit leaves the slot untouched. */
+    r = luksmeta_update(cd, 0, UUID1, big, length);
+    assert(r == -ENOSPC);
+    assert(luksmeta_load(cd, 0, uuid, data, sizeof(data)) == sizeof(UUID0));
+    assert(memcmp(data, UUID0, sizeof(UUID0)) == 0);
+
+    crypt_free(cd);
+    unlink(filename);
+    return 0;
+}
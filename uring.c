@@ -0,0 +1,225 @@
+/* vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab smarttab colorcolumn=80: */
+/*
+ * Copyright (c) 2016 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "uring.h"
+
+#include <errno.h>
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct uring {
+    int fd;
+    unsigned entries;   /* Reads allowed in flight */
+    unsigned queued;    /* Reads not submitted yet */
+    unsigned inflight;  /* Reads queued or submitted but not reaped */
+
+    void *sq;
+    size_t sqlen;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+
+    void *cq;
+    size_t cqlen;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_sqe *sqes;
+    size_t sqeslen;
+};
+
+static void *
+map(int fd, size_t len, off_t off)
+{
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, off);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+int
+uring_open(uring_t **ring, unsigned n)
+{
+    struct io_uring_params p = {};
+    uring_t *u = NULL;
+    int r = 0;
+
+    u = calloc(1, sizeof(*u));
+    if (!u)
+        return -errno;
+
+    u->fd = syscall(__NR_io_uring_setup, n, &p);
+    if (u->fd < 0) {
+        r = errno == ENOSYS ? -ENOTSUP : -errno;
+        free(u);
+        return r;
+    }
+
+    /* IORING_OP_READ appeared in the same release (5.6) as this feature. */
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        uring_close(u);
+        return -ENOTSUP;
+    }
+
+    u->entries = n;
+    u->sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    u->sq = map(u->fd, u->sqlen, IORING_OFF_SQ_RING);
+    u->cq = map(u->fd, u->cqlen, IORING_OFF_CQ_RING);
+    u->sqes = map(u->fd, u->sqeslen, IORING_OFF_SQES);
+    if (!u->sq || !u->cq || !u->sqes) {
+        r = -errno;
+        uring_close(u);
+        return r;
+    }
+
+    u->sq_tail = (unsigned *) ((uint8_t *) u->sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *) ((uint8_t *) u->sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *) ((uint8_t *) u->sq + p.sq_off.array);
+    u->cq_head = (unsigned *) ((uint8_t *) u->cq + p.cq_off.head);
+    u->cq_tail = (unsigned *) ((uint8_t *) u->cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *) ((uint8_t *) u->cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) ((uint8_t *) u->cq + p.cq_off.cqes);
+
+    *ring = u;
+    return 0;
+}
+
+int
+uring_read(uring_t *ring, int fd, void *buf, size_t size, off_t off,
+           uint64_t tag)
+{
+    struct io_uring_sqe *sqe = NULL;
+    unsigned tail = *ring->sq_tail;
+    unsigned i = tail & *ring->sq_mask;
+
+    /*
+     * The completion queue is at least as large as the submission queue,
+     * so limiting the reads in flight also rules out completion overflows.
+     */
+    if (ring->inflight >= ring->entries)
+        return -EBUSY;
+
+    if (size > UINT32_MAX)
+        return -EINVAL;
+
+    sqe = &ring->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = size;
+    sqe->off = off;
+    sqe->user_data = tag;
+
+    ring->sq_array[i] = i;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+    ring->inflight++;
+    return 0;
+}
+
+int
+uring_wait(uring_t *ring, uint64_t *tag, ssize_t *res)
+{
+    for (;;) {
+        unsigned head = *ring->cq_head;
+        long r = 0;
+
+        if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+
+            *tag = cqe->user_data;
+            *res = cqe->res;
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            ring->inflight--;
+            return 0;
+        }
+
+        if (ring->inflight == 0)
+            return -ENOENT;
+
+        r = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        ring->queued -= r;
+    }
+}
+
+void
+uring_close(uring_t *ring)
+{
+    if (!ring)
+        return;
+
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqeslen);
+    if (ring->cq)
+        munmap(ring->cq, ring->cqlen);
+    if (ring->sq)
+        munmap(ring->sq, ring->sqlen);
+
+    close(ring->fd);
+    free(ring);
+}
+
+#else
+
+int
+uring_open(uring_t **ring, unsigned n)
+{
+    return -ENOTSUP;
+}
+
+int
+uring_read(uring_t *ring, int fd, void *buf, size_t size, off_t off,
+           uint64_t tag)
+{
+    return -ENOTSUP;
+}
+
+int
+uring_wait(uring_t *ring, uint64_t *tag, ssize_t *res)
+{
+    return -ENOTSUP;
+}
+
+void
+uring_close(uring_t *ring)
+{
+}
+
+#endif
@@ -0,0 +1,56 @@
+/* vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab smarttab colorcolumn=80: */
+/*
+ * Copyright (c) 2016 Red Hat, Inc.
+ * Author: Nathaniel McCallum <npmccallum@redhat.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A minimal io_uring instance which only performs reads. */
+typedef struct uring uring_t;
+
+/*
+ * Sets up a ring with room for n reads in flight. Returns zero or a negative
+ * errno value, -ENOTSUP if io_uring support is not compiled in or the kernel
+ * does not provide it.
+ */
+int
+uring_open(uring_t **ring, unsigned n);
+
+/*
+ * Queues a positional read; the tag is returned with its completion. At
+ * most n reads (as given to uring_open()) may be in flight. Queued reads are
+ * only submitted by uring_wait().
+ */
+int
+uring_read(uring_t *ring, int fd, void *buf, size_t size, off_t off,
+           uint64_t tag);
+
+/*
+ * Submits the queued reads and waits for one to complete, whose tag and
+ * result (bytes read or a negative errno value) are stored. Returns zero,
+ * -ENOENT if no read is in flight or another negative errno value if the
+ * reads could not be submitted.
+ */
+int
+uring_wait(uring_t *ring, uint64_t *tag, ssize_t *res);
+
+void
+uring_close(uring_t *ring);